@@ -22,35 +22,150 @@ This file is based on the emacs-sqlite3 package written by Syohei
 YOSHIDA <syohex@gmail.com>, which can be found at:
 
 https://github.com/syohex/emacs-sqlite3 */
+#include <errno.h>
+#include <fcntl.h>
+#include <fts.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <regex.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 #include <emacs-module.h>
+#ifndef SQLITE_ENABLE_SESSION
+#define SQLITE_ENABLE_SESSION
+#endif
 #include <sqlite3.h>
 
+#pragma weak sqlite3session_create
+#pragma weak sqlite3session_delete
+#pragma weak sqlite3session_attach
+#pragma weak sqlite3session_changeset
+#pragma weak sqlite3changeset_apply
+#pragma weak sqlite3changeset_op
+#pragma weak sqlite3changeset_conflict
+#pragma weak sqlite3_stmt_scanstatus
+#ifdef SQLITE_SCANSTAT_NCYCLE
+#pragma weak sqlite3_stmt_scanstatus_v2
+#endif
+
 int plugin_is_GPL_compatible;
 
-#define _SELECT(_1, _2, _3, _4, _5, N, ...) N
-#define _COUNT(...) _SELECT(__VA_ARGS__, 5, 4, 3, 2, 1, 0)
+/* Extensions linked into the module are registered for every
+   connection with `sqlite3_auto_extension'.  Define
+   SQLITE_BACKPORT_EXTENSIONS as a list of X(init_function) entries to
+   bundle some, for example
+
+     -DSQLITE_BACKPORT_EXTENSIONS='X(sqlite3_spellfix_init)' -DSQLITE_CORE spellfix.c  */
+#ifdef SQLITE_BACKPORT_EXTENSIONS
+#define X(init) int init(sqlite3 *, char **, const sqlite3_api_routines *);
+SQLITE_BACKPORT_EXTENSIONS
+#undef X
+#endif
+
+#define _SELECT(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, N, ...) N
+#define _COUNT(...) _SELECT(__VA_ARGS__, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
 #define Q(name) env->intern(env, #name)
 #define build_string(s) env->make_string(env, (s), strlen((s)))
 #define make_int(n) env->make_integer(env, n)
 #define TYPE_OF(value) env->type_of(env, (value))
 #define EQ(a, b) env->eq(env, (a), (b))
 #define TYPEP(value, type) EQ(TYPE_OF(value), Q(type))
+#define call0(name) env->funcall(env, Q(name), 0, NULL)
 #define call(name, ...) env->funcall(env, Q(name), _COUNT(__VA_ARGS__), (emacs_value []){ __VA_ARGS__ })
 #define xsignal(symbol, ...) env->non_local_exit_signal(env, Q(symbol), call(list, __VA_ARGS__))
 #define NILP(value) !(env->is_not_nil(env, (value)))
 #define XFIXNUM(value) env->extract_integer(env, (value))
 
+/* Prepared statements kept per connection, keyed by their SQL.  */
+#define STATEMENT_CACHE_SIZE 32
+
+struct Cached_Statement {
+  char *sql;
+  uint64_t hash;
+  sqlite3_stmt *stmt;
+  bool busy;
+  unsigned long last_used;
+  unsigned long uses;
+};
+
+struct Statement_Cache {
+  int count;
+  unsigned long clock;
+  struct Cached_Statement entries[STATEMENT_CACHE_SIZE];
+};
+
+/* The maintenance policy set by `sqlite-maintenance'.  */
+struct Maintenance {
+  int analysis_limit;
+  int vacuum_pages;
+  double min_interval;          /* Seconds between runs.  */
+  double last_run;
+  emacs_value timer;            /* Global reference to the idle timer.  */
+};
+
+/* A connection opened with `sqlite-open' :shared, together with its
+   statement cache, is kept in a registry keyed by file so that every
+   handle on the same file uses it.  */
+struct Shared_Connection {
+  char *path;
+  dev_t dev;
+  ino_t ino;
+  sqlite3 *db;
+  struct Statement_Cache *cache;
+  int refs;
+  struct Shared_Connection *next;
+};
+
+static struct Shared_Connection *shared_connections = NULL;
+
+/* The arguments of a `sqlite-open' :lazy, kept until first use.  */
+struct Lazy_Open {
+  char *path;
+  int flags;
+  bool shared;
+  emacs_value timer;            /* The idle timer opening it, or NULL.  */
+};
+
 struct Lisp_Sqlite {
   sqlite3 *db;
+  sqlite3_session *session;
+  struct Statement_Cache *cache;
+  struct Maintenance *maintenance;
+  struct Shared_Connection *shared;
+  struct Lazy_Open *lazy;
+  struct Scheduler *scheduler;
+  /* Nonzero while a query runs Lisp code, which must not close the
+     database under it.  */
+  int busy;
+  struct Lisp_Kv *kv_stores;
+  emacs_value warmup_timer;     /* The idle timer of `sqlite-warmup', or NULL.  */
 };
 
 struct Lisp_Statement {
   sqlite3 *db;
   sqlite3_stmt *stmt;
   bool eof;
+  unsigned char *decode;        /* Column hints for `row_to_value'.  */
+};
+
+struct Lisp_Shards {
+  int count;
+  sqlite3 **dbs;
 };
 
 static
@@ -62,6 +177,77 @@ CHECK_STRING(emacs_env *env, emacs_value value) {
   return false;
 }
 
+static
+char *
+copy_string(emacs_env *env, emacs_value value) {
+  ptrdiff_t size = 0;
+  env->copy_string_contents(env, value, NULL, &size);
+  char *encoded = malloc(size);
+  env->copy_string_contents(env, value, encoded, &size);
+  return encoded;
+}
+
+static
+emacs_value
+keyword_arg(emacs_env *env, ptrdiff_t nargs, emacs_value *args, ptrdiff_t start, const char *keyword) {
+  emacs_value key = env->intern(env, keyword);
+  for (ptrdiff_t i = start; i + 1 < nargs; i += 2) {
+    if (EQ(args[i], key))
+      return args[i + 1];
+  }
+  return Q(nil);
+}
+
+/* Value is the number of arguments before the first keyword in
+   ARGS, searching from START.  */
+static
+ptrdiff_t
+positional_args(emacs_env *env, ptrdiff_t nargs, emacs_value *args, ptrdiff_t start) {
+  for (ptrdiff_t i = start; i < nargs; ++i)
+    if (!NILP(call(keywordp, args[i])))
+      return i;
+  return nargs;
+}
+
+/* The environment of the module function currently running.  SQLite
+   calls back into Lisp (user-defined functions, virtual tables) from
+   inside `sqlite3_step', where no environment is passed along, so the
+   entry points record theirs here.  Callbacks must restore it after
+   calling Lisp, since Lisp may re-enter the module.  */
+static emacs_env *current_env = NULL;
+
+/* The thread Emacs runs Lisp in.  Worker threads must not call Lisp.  */
+static pthread_t main_thread;
+
+/* Global references whose owners were destroyed by SQLite, which does
+   not give us an environment to free them with.  They are released
+   the next time a module function is entered.  */
+static emacs_value *stale_refs = NULL;
+static size_t stale_refs_count = 0;
+static size_t stale_refs_size = 0;
+
+static
+void
+stale_ref_push(emacs_value ref) {
+  if (stale_refs_count == stale_refs_size) {
+    size_t size = stale_refs_size ? stale_refs_size * 2 : 16;
+    emacs_value *refs = realloc(stale_refs, size * sizeof(emacs_value));
+    if (!refs)
+      return;
+    stale_refs = refs;
+    stale_refs_size = size;
+  }
+  stale_refs[stale_refs_count++] = ref;
+}
+
+static
+void
+enter_env(emacs_env *env) {
+  current_env = env;
+  while (stale_refs_count > 0)
+    env->free_global_ref(env, stale_refs[--stale_refs_count]);
+}
+
 static
 emacs_finalizer
 user_ptr_check(emacs_env *env, emacs_value value) {
@@ -70,12 +256,188 @@ user_ptr_check(emacs_env *env, emacs_value value) {
   return NULL;
 }
 
+static
+uint64_t
+hash_bytes(const void *data, size_t len) {
+  const unsigned char *s = data;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= s[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/* Return a statement for SQL from CACHE, preparing it if needed.  A
+   statement is lent to one user at a time: if the cached one is busy,
+   or the cache is full of busy statements, an uncached statement is
+   returned.  Either way it must be given back with
+   `statement_cache_release'.  Value is NULL if SQL does not prepare,
+   with the code in *RET.  */
+static
+sqlite3_stmt *
+statement_cache_prepare(sqlite3 *db, struct Statement_Cache *cache, const char *sql, int *ret) {
+  size_t len = strlen(sql);
+  uint64_t hash = hash_bytes(sql, len);
+  struct Cached_Statement *victim = NULL;
+
+  for (int i = 0; i < cache->count; ++i) {
+    struct Cached_Statement *entry = &cache->entries[i];
+    if (entry->hash == hash && strcmp(entry->sql, sql) == 0 && !entry->busy) {
+      entry->busy = true;
+      entry->last_used = ++cache->clock;
+      entry->uses++;
+      *ret = SQLITE_OK;
+      return entry->stmt;
+    }
+    if (!entry->busy && (!victim || entry->last_used < victim->last_used))
+      victim = entry;
+  }
+
+  sqlite3_stmt *stmt = NULL;
+  *ret = sqlite3_prepare_v2(db, sql, len, &stmt, NULL);
+  if (*ret != SQLITE_OK || !stmt)
+    return stmt;
+
+  if (cache->count < STATEMENT_CACHE_SIZE) {
+    victim = &cache->entries[cache->count++];
+  } else if (victim) {
+    sqlite3_finalize(victim->stmt);
+    free(victim->sql);
+  } else {
+    return stmt;
+  }
+
+  victim->sql = strdup(sql);
+  victim->hash = hash;
+  victim->stmt = stmt;
+  victim->busy = true;
+  victim->last_used = ++cache->clock;
+  victim->uses = 1;
+  return stmt;
+}
+
+static
+void
+statement_cache_release(struct Statement_Cache *cache, sqlite3_stmt *stmt) {
+  for (int i = 0; i < cache->count; ++i) {
+    if (cache->entries[i].stmt == stmt) {
+      sqlite3_reset(stmt);
+      sqlite3_clear_bindings(stmt);
+      cache->entries[i].busy = false;
+      return;
+    }
+  }
+  sqlite3_finalize(stmt);
+}
+
+static
+void
+statement_cache_clear(struct Statement_Cache *cache) {
+  for (int i = 0; i < cache->count; ++i) {
+    sqlite3_finalize(cache->entries[i].stmt);
+    free(cache->entries[i].sql);
+  }
+  cache->count = 0;
+}
+
+/* Refresh the planner statistics of DB that need it, reading at most
+   ANALYSIS_LIMIT rows of each index.  The limit of the connection is
+   restored afterwards, as it also applies to ANALYZE of the user.  */
+static
+void
+maintenance_optimize(sqlite3 *db, int analysis_limit) {
+  sqlite3_stmt *stmt = NULL;
+  int previous = 0;
+  if (sqlite3_prepare_v2(db, "PRAGMA analysis_limit", -1, &stmt, NULL) == SQLITE_OK
+      && sqlite3_step(stmt) == SQLITE_ROW)
+    previous = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+
+  char *sql = sqlite3_mprintf("PRAGMA analysis_limit=%d; PRAGMA optimize", analysis_limit);
+  sqlite3_exec(db, sql, NULL, NULL, NULL);
+  sqlite3_free(sql);
+  sql = sqlite3_mprintf("PRAGMA analysis_limit=%d", previous);
+  sqlite3_exec(db, sql, NULL, NULL, NULL);
+  sqlite3_free(sql);
+}
+
+/* Drop the connection and statement cache of PTR.  A shared
+   connection is only closed with its last handle.  */
+static
+void
+lisp_sqlite_release(struct Lisp_Sqlite *ptr) {
+  struct Shared_Connection *shared = ptr->shared;
+  if (shared) {
+    if (--shared->refs == 0) {
+      struct Shared_Connection **link = &shared_connections;
+      while (*link != shared)
+        link = &(*link)->next;
+      *link = shared->next;
+      statement_cache_clear(shared->cache);
+      free(shared->cache);
+      sqlite3_close(shared->db);
+      free(shared->path);
+      free(shared);
+    }
+    ptr->shared = NULL;
+  } else if (ptr->cache) {
+    statement_cache_clear(ptr->cache);
+    free(ptr->cache);
+    if (ptr->db)
+      sqlite3_close(ptr->db);
+  }
+  ptr->cache = NULL;
+  ptr->db = NULL;
+}
+
+static
+void
+lazy_open_free(struct Lazy_Open *lazy) {
+  if (lazy) {
+    if (lazy->timer)
+      stale_ref_push(lazy->timer);
+    free(lazy->path);
+    free(lazy);
+  }
+}
+
+/* Cancel the idle timer that would open LAZY.  */
+static
+void
+lazy_open_cancel(emacs_env *env, struct Lazy_Open *lazy) {
+  if (lazy->timer) {
+    call(cancel-timer, lazy->timer);
+    env->free_global_ref(env, lazy->timer);
+    lazy->timer = NULL;
+  }
+}
+
+static void scheduler_free(struct Scheduler *scheduler);
+static void kv_detach_all(struct Lisp_Sqlite *ptr);
+static bool kv_flush_all(struct Lisp_Sqlite *ptr, char **errmsg);
+
 static
 void
 lisp_sqlite_free(void *arg) {
   struct Lisp_Sqlite *ptr = (struct Lisp_Sqlite *)arg;
-  if (ptr->db)
-    sqlite3_close(ptr->db);
+  lazy_open_free(ptr->lazy);
+  scheduler_free(ptr->scheduler);
+  kv_detach_all(ptr);
+  /* A connection with an idle timer is reachable from it, so it has
+     none by now.  */
+  if (ptr->maintenance) {
+    if (ptr->db)
+      maintenance_optimize(ptr->db, ptr->maintenance->analysis_limit);
+    free(ptr->maintenance);
+  }
+  if (ptr->session)
+    sqlite3session_delete(ptr->session);
+  /* A pending warmup timer is reachable from it too, so this one has
+     fired.  */
+  if (ptr->warmup_timer)
+    stale_ref_push(ptr->warmup_timer);
+  lisp_sqlite_release(ptr);
   free(ptr);
 }
 
@@ -85,35 +447,73 @@ lisp_statement_free(void *arg) {
   struct Lisp_Statement *ptr = (struct Lisp_Statement *)arg;
   if (ptr->stmt)
     sqlite3_finalize(ptr->stmt);
+  free(ptr->decode);
+  free(ptr);
+}
+
+static
+void
+lisp_shards_free(void *arg) {
+  struct Lisp_Shards *ptr = (struct Lisp_Shards *)arg;
+  if (ptr->dbs) {
+    for (int i = 0; i < ptr->count; ++i)
+      sqlite3_close(ptr->dbs[i]);
+    free(ptr->dbs);
+  }
   free(ptr);
 }
 
 static
 emacs_value
-lisp_sqlite_make(emacs_env *env, sqlite3 *db) {
+lisp_sqlite_make(emacs_env *env) {
   struct Lisp_Sqlite *ptr = malloc(sizeof(struct Lisp_Sqlite));
-  ptr->db = db;
+  ptr->db = NULL;
+  ptr->session = NULL;
+  ptr->cache = NULL;
+  ptr->maintenance = NULL;
+  ptr->shared = NULL;
+  ptr->lazy = NULL;
+  ptr->scheduler = NULL;
+  ptr->busy = 0;
+  ptr->kv_stores = NULL;
+  ptr->warmup_timer = NULL;
   return env->make_user_ptr(env, lisp_sqlite_free, ptr);
 }
 
 static
 emacs_value
-lisp_statement_make(emacs_env *env, sqlite3 *db, sqlite3_stmt *stmt) {
+lisp_statement_make(emacs_env *env, sqlite3 *db, sqlite3_stmt *stmt, unsigned char *decode) {
   struct Lisp_Statement *ptr = malloc(sizeof(struct Lisp_Statement));
   ptr->db = db;
   ptr->stmt = stmt;
   ptr->eof = false;
+  ptr->decode = decode;
   return env->make_user_ptr(env, lisp_statement_free, ptr);
 }
 
+static int lisp_sqlite_connect(struct Lisp_Sqlite *ptr, const char *path, int flags, bool shared);
+
 static
 struct Lisp_Sqlite *
 lisp_sqlite_check(emacs_env *env, emacs_value db) {
   emacs_finalizer finalizer = user_ptr_check(env, db);
   if (finalizer == lisp_sqlite_free) {
     struct Lisp_Sqlite *ptr = env->get_user_ptr(env, db);
-    if (ptr->db)
+    if (!ptr->db && ptr->lazy) {
+      int ret = lisp_sqlite_connect(ptr, ptr->lazy->path, ptr->lazy->flags, ptr->lazy->shared);
+      if (ret != SQLITE_OK) {
+        xsignal(error, build_string("Could not open database"), build_string(ptr->lazy->path),
+                build_string(sqlite3_errstr(ret)));
+        return NULL;
+      }
+      lazy_open_cancel(env, ptr->lazy);
+      lazy_open_free(ptr->lazy);
+      ptr->lazy = NULL;
+    }
+    if (ptr->db) {
+      enter_env(env);
       return ptr;
+    }
     xsignal(error, build_string("Database closed"));
   } else if (finalizer == lisp_statement_free) {
     xsignal(error, build_string("Invalid database object"));
@@ -123,14 +523,34 @@ lisp_sqlite_check(emacs_env *env, emacs_value db) {
   return NULL;
 }
 
+/* Let Emacs process input, timers and process output in the middle of
+   a long query on PTR.  Value is false if the query should stop
+   because the user asked to quit.  */
+static
+bool
+lisp_sqlite_yield(emacs_env *env, struct Lisp_Sqlite *ptr) {
+  ptr->busy++;
+  /* `process_input' only checks for a quit, and is new in Emacs 27.  */
+  bool quit = false;
+  if (env->size >= (ptrdiff_t)sizeof(struct emacs_env_27))
+    quit = env->process_input(env) == emacs_process_input_quit;
+  if (!quit)
+    call(accept-process-output, Q(nil), make_int(0));
+  ptr->busy--;
+  enter_env(env);
+  return !quit && env->non_local_exit_check(env) == emacs_funcall_exit_return;
+}
+
 static
 struct Lisp_Statement *
 lisp_statement_check(emacs_env *env, emacs_value stmt) {
   emacs_finalizer finalizer = user_ptr_check(env, stmt);
   if (finalizer == lisp_statement_free) {
     struct Lisp_Statement *ptr = env->get_user_ptr(env, stmt);
-    if (ptr->stmt)
+    if (ptr->stmt) {
+      enter_env(env);
       return ptr;
+    }
     xsignal(error, build_string("Statement closed"));
   } else if (finalizer == lisp_sqlite_free) {
     xsignal(error, build_string("Invalid set object"));
@@ -140,422 +560,7218 @@ lisp_statement_check(emacs_env *env, emacs_value stmt) {
   return NULL;
 }
 
-static int db_count = 0;
-
+/* Decode one UTF-8 character at *P, advancing it.  Invalid sequences
+   decode as -1 after consuming a single byte, so callers can copy
+   them through unchanged.  */
 static
-emacs_value
-Fsqlite_open(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
-  int flags = (SQLITE_OPEN_CREATE  | SQLITE_OPEN_READWRITE);
-#ifdef SQLITE_OPEN_FULLMUTEX
-  flags |= SQLITE_OPEN_FULLMUTEX;
-#endif
-#ifdef SQLITE_OPEN_URI
-  flags |= SQLITE_OPEN_URI;
-#endif
+int32_t
+utf8_decode(const unsigned char **p, const unsigned char *end) {
+  const unsigned char *s = *p;
+  int32_t c = *s;
+  int len = (c < 0x80) ? 1 : (c < 0xC2) ? 0 : (c < 0xE0) ? 2 : (c < 0xF0) ? 3 : (c < 0xF5) ? 4 : 0;
 
-  emacs_value name;
-  if ((nargs > 0) && !NILP(args[0])) {
-    name = call(expand_file_name, args[0], Q(nil));
-  } else {
-#ifdef SQLITE_OPEN_MEMORY
-    /* In-memory database.  These have to have different names to
-       refer to different databases.  */
-    name = call(format, build_string(":memory:%d"), make_int(++db_count));
-    flags |= SQLITE_OPEN_MEMORY;
-#else
-    xsignal(error, build_string("sqlite in-memory is not available"));
-#endif
+  if (len == 0 || s + len > end) {
+    *p = s + 1;
+    return -1;
   }
 
-  ptrdiff_t size=0;
-  env->copy_string_contents(env, name, NULL, &size);
-  char *encoded = malloc(size);
-  env->copy_string_contents(env, name, encoded, &size);
-
-  sqlite3 *sdb;
-  int ret = sqlite3_open_v2 (encoded, &sdb, flags, NULL);
-  free(encoded);
-  if (ret != SQLITE_OK)
-    return Q(nil);
+  if (len > 1) {
+    c &= 0x3F >> (len - 1);
+    for (int i = 1; i < len; ++i) {
+      if ((s[i] & 0xC0) != 0x80) {
+        *p = s + 1;
+        return -1;
+      }
+      c = (c << 6) | (s[i] & 0x3F);
+    }
+  }
 
-  return lisp_sqlite_make(env, sdb);
+  *p = s + len;
+  return c;
 }
 
 static
-emacs_value
-Fsqlite_close(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
-  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
-  if (!ptr)
-    return Q(nil);
-
-  sqlite3_close(ptr->db);
-  ptr->db = NULL;
-  return Q(t);
+int
+utf8_encode(int32_t c, unsigned char *out) {
+  if (c < 0x80) {
+    out[0] = c;
+    return 1;
+  } else if (c < 0x800) {
+    out[0] = 0xC0 | (c >> 6);
+    out[1] = 0x80 | (c & 0x3F);
+    return 2;
+  } else if (c < 0x10000) {
+    out[0] = 0xE0 | (c >> 12);
+    out[1] = 0x80 | ((c >> 6) & 0x3F);
+    out[2] = 0x80 | (c & 0x3F);
+    return 3;
+  }
+  out[0] = 0xF0 | (c >> 18);
+  out[1] = 0x80 | ((c >> 12) & 0x3F);
+  out[2] = 0x80 | ((c >> 6) & 0x3F);
+  out[3] = 0x80 | (c & 0x3F);
+  return 4;
 }
 
-/* Bind values in a statement like
-   "insert into foo values (?, ?, ?)".  */
+/* Translate the Emacs regexp RE into a POSIX extended regexp for
+   regcomp.  The GNU operators \w, \W, \b, \B, \<, \>, \` and \' mean
+   the same in both syntaxes and are passed through.  Returns NULL if
+   RE uses a construct that has no POSIX counterpart.  */
 static
-const char *
-bind_values (emacs_env *env, sqlite3 *db, sqlite3_stmt *stmt, emacs_value values) {
-  sqlite3_reset(stmt);
-  bool is_vector = TYPEP(values, vector);
-  int len = (is_vector)?env->vec_size(env, values):XFIXNUM(call(length, values));
+char *
+emacs_regexp_to_posix(const char *re, int len) {
+  /* The worst case is every character gaining a backslash, or a
+     syntax class growing into a bracket expression.  */
+  char *out = malloc(len * 12 + 1);
+  char *o = out;
+  bool at_start = true;
+  /* Whether the previous token was a postfix operator.  */
+  bool quantified = false;
 
   for (int i = 0; i < len; ++i) {
-    int ret = SQLITE_MISMATCH;
-    emacs_value value;
-    if (is_vector) {
-      value = env->vec_get(env, values, i);
-    } else {
-      value = call(car, values);
-      values = call(cdr, values);
-    }
-
-    emacs_value type = TYPE_OF(value);
-    if (EQ(type, Q(string))) {
-      bool blob = false;
+    char c = re[i];
+    bool start = at_start;
+    bool after_operator = quantified;
+    at_start = false;
+    quantified = false;
 
-      emacs_value coding_system = call(get-text-property, make_int(0), Q(coding-system), value);
-      if (!NILP(coding_system)) {
-        if (EQ(coding_system, Q(binary))) {
-            blob = true;
-        } else {
-          value = call(encode-coding-string, value, coding_system, Q(nil), Q(nil));
+    if (c == '[') {
+      /* Bracket expressions share their syntax, copy them as is.  */
+      int j = i + 1;
+      if (j < len && re[j] == '^')
+        ++j;
+      if (j < len && re[j] == ']')
+        ++j;
+      while (j < len && re[j] != ']') {
+        if (re[j] == '[' && j + 1 < len && re[j + 1] == ':') {
+          const char *close = strstr(re + j + 2, ":]");
+          if (close && close - re < len)
+            j = close - re + 1;
         }
+        ++j;
       }
-
-      ptrdiff_t size = 0;
-      env->copy_string_contents(env, value, NULL, &size);
-
-      if (blob) {
-        if (size) {
-          if (size != XFIXNUM(call(length, value)) + 1) {
-            xsignal(error, build_string("BLOB values must be unibyte"));
-            return "";
-          }
-
-          char *encoded = malloc(size);
-          env->copy_string_contents(env, value, encoded, &size);
-          ret = sqlite3_bind_blob(stmt, i + 1, encoded, size - 1, free);
-        } else {
-          ret = sqlite3_bind_blob(stmt, i + 1, NULL, 0, NULL);
-        }
+      if (j >= len) {
+        free(out);
+        return NULL;
+      }
+      memcpy(o, re + i, j - i + 1);
+      o += j - i + 1;
+      i = j;
+    } else if (c == '(' || c == ')' || c == '|' || c == '{' || c == '}') {
+      *o++ = '\\';
+      *o++ = c;
+    } else if (c == '^') {
+      if (!start)
+        *o++ = '\\';
+      *o++ = c;
+    } else if (c == '$') {
+      bool end = (i + 1 == len)
+        || (i + 2 < len && re[i + 1] == '\\' && (re[i + 2] == ')' || re[i + 2] == '|'));
+      if (!end)
+        *o++ = '\\';
+      *o++ = c;
+    } else if (c == '*' || c == '+' || c == '?') {
+      if (start) {
+        *o++ = '\\';
+        *o++ = c;
+      } else if (after_operator && c == '?') {
+        /* Non-greedy operators match the same strings.  */
       } else {
-        if (size) {
-          char *encoded = malloc(size);
-          env->copy_string_contents(env, value, encoded, &size);
-          ret = sqlite3_bind_text(stmt, i + 1, encoded, size - 1, free);
-        } else {
-          ret = sqlite3_bind_text(stmt, i + 1, NULL, 0, NULL);
+        *o++ = c;
+        quantified = true;
+      }
+    } else if (c == '\\' && i + 1 < len) {
+      char d = re[++i];
+      switch (d) {
+      case '(':
+        if (i + 1 < len && re[i + 1] == '?') {
+          /* Shy and explicitly numbered groups.  */
+          i += 2;
+          while (i < len && re[i] != ':')
+            ++i;
+        }
+        *o++ = '(';
+        at_start = true;
+        break;
+      case '|':
+        *o++ = '|';
+        at_start = true;
+        break;
+      case ')':
+      case '{':
+      case '}':
+        *o++ = d;
+        break;
+      case 's':
+      case 'S':
+        if (++i >= len) {
+          free(out);
+          return NULL;
+        }
+        switch (re[i]) {
+        case '-':
+        case ' ':
+          o = stpcpy(o, d == 's' ? "[[:space:]]" : "[^[:space:]]");
+          break;
+        case 'w':
+          o = stpcpy(o, d == 's' ? "\\w" : "\\W");
+          break;
+        case '_':
+          o = stpcpy(o, d == 's' ? "[_[:alnum:]]" : "[^_[:alnum:]]");
+          break;
+        case '.':
+          o = stpcpy(o, d == 's' ? "[[:punct:]]" : "[^[:punct:]]");
+          break;
+        default:
+          free(out);
+          return NULL;
+        }
+        break;
+      case '_':
+        if (i + 1 < len && (re[i + 1] == '<' || re[i + 1] == '>')) {
+          /* Symbol boundaries, approximated by word boundaries.  */
+          *o++ = '\\';
+          *o++ = re[++i];
+          break;
         }
+        free(out);
+        return NULL;
+      case 'c':
+      case 'C':
+      case '=':
+        free(out);
+        return NULL;
+      default:
+        *o++ = '\\';
+        *o++ = d;
+        break;
       }
-    } else if (EQ(type, Q(integer))) {
-      ret = sqlite3_bind_int64(stmt, i + 1, XFIXNUM(value));
-    } else if (EQ(type, Q(float))) {
-      ret = sqlite3_bind_double(stmt, i + 1, env->extract_float(env, value));
-    } else if (NILP(value)) {
-        ret = sqlite3_bind_null(stmt, i + 1);
-    } else if (EQ(value, Q(t))) {
-      ret = sqlite3_bind_int(stmt, i + 1, 1);
-    } else if (EQ(value, Q(false))) {
-      ret = sqlite3_bind_int(stmt, i + 1, 0);
     } else {
-      return "invalid argument";
+      *o++ = c;
     }
-
-    if (ret != SQLITE_OK)
-      return sqlite3_errmsg (db);
   }
 
-  return NULL;
+  *o = '\0';
+  return out;
 }
 
 static
-emacs_value
-Fsqlite_execute(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
-  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
-  if (!ptr)
-    return Q(nil);
+void
+regexp_free(void *arg) {
+  regfree((regex_t *)arg);
+  free(arg);
+}
 
-  if(!CHECK_STRING(env, args[1]))
-    return Q(nil);
+/* regexp(PATTERN, STRING), which also implements "STRING REGEXP
+   PATTERN".  PATTERN uses Emacs syntax.  The compiled pattern is
+   kept as auxiliary data, so it is only compiled once per
+   statement.  */
+static
+void
+sql_regexp(sqlite3_context *ctx, int argc __attribute__((unused)), sqlite3_value **argv) {
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL || sqlite3_value_type(argv[1]) == SQLITE_NULL)
+    return;
 
-  if (nargs > 2) {
-    emacs_value type = TYPE_OF(args[2]);
-    if (!(NILP(args[2]) || EQ(type, Q(cons)) || EQ(type, Q(vector)))) {
-      xsignal(error, build_string ("VALUES must be a list or a vector"));
-      return Q(nil);
+  regex_t *re = sqlite3_get_auxdata(ctx, 0);
+  bool fresh = false;
+  if (!re) {
+    const char *pattern = (const char *)sqlite3_value_text(argv[0]);
+    char *posix = emacs_regexp_to_posix(pattern, sqlite3_value_bytes(argv[0]));
+    if (!posix) {
+      sqlite3_result_error(ctx, "Unsupported regexp construct", -1);
+      return;
+    }
+
+    re = malloc(sizeof(regex_t));
+    int ret = regcomp(re, posix, REG_EXTENDED | REG_NOSUB);
+    free(posix);
+    if (ret) {
+      char errbuf[256];
+      regerror(ret, re, errbuf, sizeof(errbuf));
+      free(re);
+      sqlite3_result_error(ctx, errbuf, -1);
+      return;
     }
+    fresh = true;
   }
 
-  const char *errmsg = NULL;
-  ptrdiff_t size = 0;
-  env->copy_string_contents(env, args[1], NULL, &size);
-  char *encoded = malloc(size);
-  env->copy_string_contents(env, args[1], encoded, &size);
-  sqlite3_stmt *stmt = NULL;
+  const char *string = (const char *)sqlite3_value_text(argv[1]);
+  sqlite3_result_int(ctx, regexec(re, string, 0, NULL, 0) == 0);
 
-  /* We only execute the first statement -- if there's several
-     (separated by a semicolon), the subsequent statements won't be
-     done.  */
-  int ret = sqlite3_prepare_v2(ptr->db, encoded, -1, &stmt, NULL);
-  free(encoded);
+  /* SQLite may free the data right away, so hand it over last.  */
+  if (fresh)
+    sqlite3_set_auxdata(ctx, 0, re, regexp_free);
+}
 
-  if (ret != SQLITE_OK) {
-    if (stmt) {
-      sqlite3_finalize (stmt);
-      sqlite3_reset (stmt);
+/* casefold(STRING) returns STRING in lower case.  */
+static
+void
+sql_casefold(sqlite3_context *ctx, int argc __attribute__((unused)), sqlite3_value **argv) {
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+    return;
+
+  const unsigned char *s = sqlite3_value_text(argv[0]);
+  int len = sqlite3_value_bytes(argv[0]);
+  const unsigned char *end = s + len;
+  /* Lower-casing can grow a 2-byte character into 3 bytes at most.  */
+  unsigned char *out = sqlite3_malloc(len * 2 + 1);
+  if (!out) {
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+
+  unsigned char *o = out;
+  while (s < end) {
+    if (*s < 0x80) {
+      unsigned char c = *s++;
+      *o++ = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    } else {
+      const unsigned char *start = s;
+      int32_t c = utf8_decode(&s, end);
+      if (c < 0) {
+        *o++ = *start;
+      } else {
+        o += utf8_encode(towlower(c), o);
+      }
     }
+  }
 
-    errmsg = sqlite3_errmsg(ptr->db);
-    goto exit;
+  sqlite3_result_text(ctx, (char *)out, o - out, sqlite3_free);
+}
+
+static
+wchar_t *
+utf8_to_wcs(const unsigned char *s, int len, bool fold) {
+  const unsigned char *end = s + len;
+  wchar_t *out = malloc((len + 1) * sizeof(wchar_t));
+  wchar_t *o = out;
+  while (s < end) {
+    const unsigned char *start = s;
+    int32_t c = utf8_decode(&s, end);
+    if (c < 0)
+      c = *start;
+    *o++ = fold ? (wchar_t)towlower(c) : (wchar_t)c;
+  }
+  *o = L'\0';
+  return out;
+}
+
+/* The collations "emacs" and "emacs_nocase" order strings like
+   `string-collate-lessp' does, optionally ignoring case.  Strings
+   the locale considers equal are ordered by their bytes, so the
+   collation stays a total order.  */
+static
+int
+collate_emacs(void *arg, int len1, const void *str1, int len2, const void *str2) {
+  bool fold = arg != NULL;
+  wchar_t *s1 = utf8_to_wcs(str1, len1, fold);
+  wchar_t *s2 = utf8_to_wcs(str2, len2, fold);
+  int ret = wcscoll(s1, s2);
+  free(s1);
+  free(s2);
+
+  if (ret == 0 && !fold) {
+    ret = memcmp(str1, str2, len1 < len2 ? len1 : len2);
+    if (ret == 0)
+      ret = len1 - len2;
+  }
+  return ret;
+}
+
+/* fnv1a(X) returns the 64-bit FNV-1a hash of the bytes of X.  */
+static
+void
+sql_fnv1a(sqlite3_context *ctx, int argc __attribute__((unused)), sqlite3_value **argv) {
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+    return;
+
+  const unsigned char *s = sqlite3_value_blob(argv[0]);
+  int len = sqlite3_value_bytes(argv[0]);
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (int i = 0; i < len; ++i) {
+    hash ^= s[i];
+    hash *= 0x100000001b3ULL;
+  }
+  sqlite3_result_int64(ctx, (sqlite3_int64)hash);
+}
+
+static uint32_t crc32_table[256];
+
+static
+void
+crc32_init(void) {
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; ++k)
+      c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+    crc32_table[i] = c;
+  }
+}
+
+/* crc32(X) returns the CRC-32 checksum of the bytes of X, as computed
+   by zlib and gzip.  */
+static
+void
+sql_crc32(sqlite3_context *ctx, int argc __attribute__((unused)), sqlite3_value **argv) {
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+    return;
+
+  const unsigned char *s = sqlite3_value_blob(argv[0]);
+  int len = sqlite3_value_bytes(argv[0]);
+  uint32_t crc = 0xFFFFFFFF;
+  for (int i = 0; i < len; ++i)
+    crc = crc32_table[(crc ^ s[i]) & 0xFF] ^ (crc >> 8);
+  sqlite3_result_int64(ctx, crc ^ 0xFFFFFFFF);
+}
+
+/* The emacs_buffer virtual table module.
+
+     CREATE VIRTUAL TABLE lines USING emacs_buffer(NAME)
+
+   gives a table with one row per line of the accessible portion of
+   the buffer NAME.  The rowid and the line column are the line
+   number, text is the line without its newline and pos is the buffer
+   position where the line starts.  Constraints on the line number
+   seek directly to the requested lines.  */
+
+/* A snapshot of the buffer text and the start of each line in it,
+   shared by the table and its open cursors.  */
+struct Buffer_Text {
+  int refs;
+  char *text;
+  sqlite3_int64 lines;
+  ptrdiff_t *starts;            /* Byte offsets, LINES + 1 entries.  */
+  ptrdiff_t *positions;         /* Buffer positions, LINES entries.  */
+};
+
+struct Buffer_Vtab {
+  sqlite3_vtab base;
+  char *name;
+  /* What the snapshot was taken from.  BUFFER is a global reference.  */
+  emacs_value buffer;
+  intmax_t tick, begv, zv;
+  struct Buffer_Text *snapshot;
+};
+
+struct Buffer_Cursor {
+  sqlite3_vtab_cursor base;
+  struct Buffer_Text *snapshot;
+  sqlite3_int64 line;
+  sqlite3_int64 last;
+};
+
+enum {
+  BUFFER_LINE_EQ = 1,
+  BUFFER_LINE_MIN = 2,
+  BUFFER_LINE_MAX = 4,
+};
+
+static
+void
+buffer_text_unref(struct Buffer_Text *snapshot) {
+  if (snapshot && --snapshot->refs == 0) {
+    free(snapshot->text);
+    free(snapshot->starts);
+    free(snapshot->positions);
+    free(snapshot);
+  }
+}
+
+/* Split TEXT into lines.  A final newline ends the last line rather
+   than starting an empty one.  */
+static
+struct Buffer_Text *
+buffer_text_make(char *text, ptrdiff_t size, intmax_t begv) {
+  struct Buffer_Text *snapshot = malloc(sizeof(struct Buffer_Text));
+  snapshot->refs = 1;
+  snapshot->text = text;
+
+  sqlite3_int64 lines = 0;
+  for (const char *p = text; (p = memchr(p, '\n', text + size - p)); ++p)
+    ++lines;
+  if (size > 0 && text[size - 1] != '\n')
+    ++lines;
+
+  snapshot->lines = lines;
+  snapshot->starts = malloc((lines + 1) * sizeof(ptrdiff_t));
+  snapshot->positions = malloc((lines + 1) * sizeof(ptrdiff_t));
+
+  ptrdiff_t pos = begv;
+  const char *p = text;
+  for (sqlite3_int64 i = 0; i < lines; ++i) {
+    snapshot->starts[i] = p - text;
+    snapshot->positions[i] = pos;
+    const char *eol = memchr(p, '\n', text + size - p);
+    if (!eol)
+      eol = text + size;
+    for (const char *q = p; q < eol; ++q)
+      pos += ((*q & 0xC0) != 0x80);
+    pos += 1;
+    p = eol + 1;
+  }
+  snapshot->starts[lines] = (size > 0 && text[size - 1] == '\n') ? size : size + 1;
+  return snapshot;
+}
+
+/* Make OLD the current buffer again, keeping any pending non-local
+   exit, which would otherwise prevent that.  */
+static
+void
+restore_buffer(emacs_env *env, emacs_value old) {
+  emacs_value symbol, data;
+  enum emacs_funcall_exit status = env->non_local_exit_get(env, &symbol, &data);
+  env->non_local_exit_clear(env);
+  call(set-buffer, old);
+  if (status == emacs_funcall_exit_signal)
+    env->non_local_exit_signal(env, symbol, data);
+  else if (status == emacs_funcall_exit_throw)
+    env->non_local_exit_throw(env, symbol, data);
+}
+
+/* Make sure the snapshot of TAB is current.  Runs in the thread of
+   the module function that steps the statement.  */
+static
+int
+buffer_vtab_refresh(struct Buffer_Vtab *tab) {
+  if (!pthread_equal(pthread_self(), main_thread)) {
+    sqlite3_free(tab->base.zErrMsg);
+    tab->base.zErrMsg = sqlite3_mprintf("Buffers cannot be read from a worker thread");
+    return SQLITE_ERROR;
+  }
+
+  emacs_env *env = current_env;
+  emacs_value buffer = call(get-buffer, build_string(tab->name));
+  if (NILP(buffer)) {
+    sqlite3_free(tab->base.zErrMsg);
+    tab->base.zErrMsg = sqlite3_mprintf("No such buffer: %s", tab->name);
+    return SQLITE_ERROR;
+  }
+
+  emacs_value old = call0(current-buffer);
+  call(set-buffer, buffer);
+  intmax_t tick = XFIXNUM(call0(buffer-chars-modified-tick));
+  intmax_t begv = XFIXNUM(call0(point-min));
+  intmax_t zv = XFIXNUM(call0(point-max));
+
+  if (env->non_local_exit_check(env) == emacs_funcall_exit_return
+      && !(tab->snapshot && EQ(tab->buffer, buffer)
+           && tab->tick == tick && tab->begv == begv && tab->zv == zv)) {
+    emacs_value text = call(buffer-substring-no-properties, make_int(begv), make_int(zv));
+    ptrdiff_t size = 0;
+    if (!env->copy_string_contents(env, text, NULL, &size)) {
+      restore_buffer(env, old);
+      return SQLITE_ERROR;
+    }
+    char *encoded = malloc(size);
+    env->copy_string_contents(env, text, encoded, &size);
+
+    buffer_text_unref(tab->snapshot);
+    tab->snapshot = buffer_text_make(encoded, size - 1, begv);
+    if (tab->buffer)
+      env->free_global_ref(env, tab->buffer);
+    tab->buffer = env->make_global_ref(env, buffer);
+    tab->tick = tick;
+    tab->begv = begv;
+    tab->zv = zv;
+  }
+  restore_buffer(env, old);
+
+  if (env->non_local_exit_check(env) != emacs_funcall_exit_return)
+    return SQLITE_ERROR;
+  return SQLITE_OK;
+}
+
+static
+int
+buffer_vtab_connect(sqlite3 *db, void *aux __attribute__((unused)), int argc, const char *const *argv,
+                    sqlite3_vtab **vtab, char **errmsg) {
+  if (argc != 4) {
+    *errmsg = sqlite3_mprintf("emacs_buffer takes the name of a buffer");
+    return SQLITE_ERROR;
+  }
+
+  int ret = sqlite3_declare_vtab(db, "CREATE TABLE x(line INTEGER, text TEXT, pos INTEGER)");
+  if (ret != SQLITE_OK)
+    return ret;
+
+  struct Buffer_Vtab *tab = sqlite3_malloc(sizeof(struct Buffer_Vtab));
+  if (!tab)
+    return SQLITE_NOMEM;
+  memset(tab, 0, sizeof(struct Buffer_Vtab));
+
+  /* Accept both emacs_buffer(name) and emacs_buffer('name').  */
+  const char *name = argv[3];
+  size_t len = strlen(name);
+  if (len >= 2 && (name[0] == '\'' || name[0] == '"') && name[len - 1] == name[0]) {
+    tab->name = sqlite3_mprintf("%.*s", (int)(len - 2), name + 1);
+  } else {
+    tab->name = sqlite3_mprintf("%s", name);
+  }
+
+  *vtab = &tab->base;
+  return SQLITE_OK;
+}
+
+static
+int
+buffer_vtab_disconnect(sqlite3_vtab *vtab) {
+  struct Buffer_Vtab *tab = (struct Buffer_Vtab *)vtab;
+  if (tab->buffer)
+    stale_ref_push(tab->buffer);
+  buffer_text_unref(tab->snapshot);
+  sqlite3_free(tab->name);
+  sqlite3_free(tab);
+  return SQLITE_OK;
+}
+
+static
+int
+buffer_vtab_best_index(sqlite3_vtab *vtab __attribute__((unused)), sqlite3_index_info *info) {
+  int eq = -1, min = -1, max = -1;
+
+  for (int i = 0; i < info->nConstraint; ++i) {
+    const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+    if (!c->usable || (c->iColumn != -1 && c->iColumn != 0))
+      continue;
+    switch (c->op) {
+    case SQLITE_INDEX_CONSTRAINT_EQ:
+      eq = i;
+      break;
+    case SQLITE_INDEX_CONSTRAINT_GT:
+    case SQLITE_INDEX_CONSTRAINT_GE:
+      min = i;
+      break;
+    case SQLITE_INDEX_CONSTRAINT_LT:
+    case SQLITE_INDEX_CONSTRAINT_LE:
+      max = i;
+      break;
+    }
+  }
+
+  int argv_index = 0;
+  info->idxNum = 0;
+  info->estimatedCost = 1000000;
+  info->estimatedRows = 1000000;
+  if (eq >= 0) {
+    info->idxNum = BUFFER_LINE_EQ;
+    /* Not omitted: SQLite checks values that are not integers.  */
+    info->aConstraintUsage[eq].argvIndex = ++argv_index;
+    info->estimatedCost = 1;
+    info->estimatedRows = 1;
+    info->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+  } else {
+    if (min >= 0) {
+      info->idxNum |= BUFFER_LINE_MIN;
+      info->aConstraintUsage[min].argvIndex = ++argv_index;
+      info->estimatedCost /= 4;
+      info->estimatedRows /= 4;
+    }
+    if (max >= 0) {
+      info->idxNum |= BUFFER_LINE_MAX;
+      info->aConstraintUsage[max].argvIndex = ++argv_index;
+      info->estimatedCost /= 4;
+      info->estimatedRows /= 4;
+    }
+  }
+
+  /* The GT and LT bounds are exclusive; tell xFilter which ones.  */
+  if (min >= 0 && info->aConstraint[min].op == SQLITE_INDEX_CONSTRAINT_GT)
+    info->idxNum |= BUFFER_LINE_MIN << 4;
+  if (max >= 0 && info->aConstraint[max].op == SQLITE_INDEX_CONSTRAINT_LT)
+    info->idxNum |= BUFFER_LINE_MAX << 4;
+
+  /* Rows come out in line order.  */
+  if (info->nOrderBy == 1
+      && (info->aOrderBy[0].iColumn == -1 || info->aOrderBy[0].iColumn == 0)
+      && !info->aOrderBy[0].desc)
+    info->orderByConsumed = 1;
+
+  return SQLITE_OK;
+}
+
+static
+int
+buffer_vtab_open(sqlite3_vtab *vtab __attribute__((unused)), sqlite3_vtab_cursor **cursor) {
+  struct Buffer_Cursor *cur = sqlite3_malloc(sizeof(struct Buffer_Cursor));
+  if (!cur)
+    return SQLITE_NOMEM;
+  memset(cur, 0, sizeof(struct Buffer_Cursor));
+  *cursor = &cur->base;
+  return SQLITE_OK;
+}
+
+static
+int
+buffer_vtab_close(sqlite3_vtab_cursor *cursor) {
+  struct Buffer_Cursor *cur = (struct Buffer_Cursor *)cursor;
+  buffer_text_unref(cur->snapshot);
+  sqlite3_free(cur);
+  return SQLITE_OK;
+}
+
+/* Set *LINE to VALUE if it is an integral number.  */
+static
+bool
+buffer_line_value(sqlite3_value *value, sqlite3_int64 *line) {
+  if (sqlite3_value_type(value) == SQLITE_INTEGER) {
+    *line = sqlite3_value_int64(value);
+    return true;
+  }
+  if (sqlite3_value_type(value) == SQLITE_FLOAT) {
+    double d = sqlite3_value_double(value);
+    if (d >= -0x1p62 && d < 0x1p62 && d == (double)(sqlite3_int64)d) {
+      *line = (sqlite3_int64)d;
+      return true;
+    }
+  }
+  return false;
+}
+
+static
+int
+buffer_vtab_filter(sqlite3_vtab_cursor *cursor, int idx_num, const char *idx_str __attribute__((unused)),
+                   int argc, sqlite3_value **argv) {
+  struct Buffer_Cursor *cur = (struct Buffer_Cursor *)cursor;
+  struct Buffer_Vtab *tab = (struct Buffer_Vtab *)cursor->pVtab;
+
+  int ret = buffer_vtab_refresh(tab);
+  if (ret != SQLITE_OK)
+    return ret;
+
+  buffer_text_unref(cur->snapshot);
+  cur->snapshot = tab->snapshot;
+  cur->snapshot->refs++;
+  cur->line = 1;
+  cur->last = cur->snapshot->lines;
+
+  /* Nothing compares equal to NULL.  */
+  for (int i = 0; i < argc; ++i) {
+    if (sqlite3_value_type(argv[i]) == SQLITE_NULL) {
+      cur->last = 0;
+      return SQLITE_OK;
+    }
+  }
+
+  /* Only integral bounds narrow the scan; SQLite checks the rows
+     against the others.  */
+  int n = 0;
+  sqlite3_int64 bound;
+  if (idx_num & BUFFER_LINE_EQ) {
+    if (buffer_line_value(argv[n++], &bound))
+      cur->line = cur->last = bound;
+  } else {
+    if ((idx_num & BUFFER_LINE_MIN) && buffer_line_value(argv[n++], &bound)) {
+      if (idx_num & (BUFFER_LINE_MIN << 4))
+        ++bound;
+      if (bound > cur->line)
+        cur->line = bound;
+    }
+    if ((idx_num & BUFFER_LINE_MAX) && buffer_line_value(argv[n++], &bound)) {
+      if (idx_num & (BUFFER_LINE_MAX << 4))
+        --bound;
+      if (bound < cur->last)
+        cur->last = bound;
+    }
+  }
+
+  if (cur->line < 1)
+    cur->line = 1;
+  if (cur->last > cur->snapshot->lines)
+    cur->last = cur->snapshot->lines;
+  return SQLITE_OK;
+}
+
+static
+int
+buffer_vtab_next(sqlite3_vtab_cursor *cursor) {
+  ((struct Buffer_Cursor *)cursor)->line++;
+  return SQLITE_OK;
+}
+
+static
+int
+buffer_vtab_eof(sqlite3_vtab_cursor *cursor) {
+  struct Buffer_Cursor *cur = (struct Buffer_Cursor *)cursor;
+  return cur->line > cur->last;
+}
+
+static
+int
+buffer_vtab_column(sqlite3_vtab_cursor *cursor, sqlite3_context *ctx, int column) {
+  struct Buffer_Cursor *cur = (struct Buffer_Cursor *)cursor;
+  struct Buffer_Text *snapshot = cur->snapshot;
+  sqlite3_int64 i = cur->line - 1;
+
+  switch (column) {
+  case 0:
+    sqlite3_result_int64(ctx, cur->line);
+    break;
+  case 1:
+    sqlite3_result_text(ctx, snapshot->text + snapshot->starts[i],
+                        snapshot->starts[i + 1] - snapshot->starts[i] - 1,
+                        SQLITE_TRANSIENT);
+    break;
+  case 2:
+    sqlite3_result_int64(ctx, snapshot->positions[i]);
+    break;
+  }
+  return SQLITE_OK;
+}
+
+static
+int
+buffer_vtab_rowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid) {
+  *rowid = ((struct Buffer_Cursor *)cursor)->line;
+  return SQLITE_OK;
+}
+
+static sqlite3_module buffer_module = {
+  .iVersion = 0,
+  .xCreate = buffer_vtab_connect,
+  .xConnect = buffer_vtab_connect,
+  .xBestIndex = buffer_vtab_best_index,
+  .xDisconnect = buffer_vtab_disconnect,
+  .xDestroy = buffer_vtab_disconnect,
+  .xOpen = buffer_vtab_open,
+  .xClose = buffer_vtab_close,
+  .xFilter = buffer_vtab_filter,
+  .xNext = buffer_vtab_next,
+  .xEof = buffer_vtab_eof,
+  .xColumn = buffer_vtab_column,
+  .xRowid = buffer_vtab_rowid,
+};
+
+/* The FTS5 auxiliary function match_offsets(TABLE) returns the
+   matches of the current row as a BLOB of native 32-bit integer
+   triples (column, offset, length), ordered by column and offset.
+   Offsets and lengths count characters, so they can be added to a
+   buffer position directly.  */
+
+struct Fts_Match {
+  int column;
+  int token;
+  int size;                     /* In tokens.  */
+};
+
+struct Fts_Tokens {
+  int count;
+  int size;
+  int *starts;
+  int *ends;
+};
+
+static
+int
+fts_match_compare(const void *a, const void *b) {
+  const struct Fts_Match *x = a, *y = b;
+  if (x->column != y->column)
+    return x->column - y->column;
+  return x->token - y->token;
+}
+
+static
+int
+fts_collect_token(void *arg, int flags, const char *token __attribute__((unused)), int len __attribute__((unused)),
+                  int start, int end) {
+  struct Fts_Tokens *tokens = (struct Fts_Tokens *)arg;
+  if (flags & FTS5_TOKEN_COLOCATED)
+    return SQLITE_OK;
+  if (tokens->count == tokens->size) {
+    tokens->size = tokens->size ? tokens->size * 2 : 64;
+    tokens->starts = realloc(tokens->starts, tokens->size * sizeof(int));
+    tokens->ends = realloc(tokens->ends, tokens->size * sizeof(int));
+  }
+  tokens->starts[tokens->count] = start;
+  tokens->ends[tokens->count] = end;
+  tokens->count++;
+  return SQLITE_OK;
+}
+
+static
+void
+fts_match_offsets(const Fts5ExtensionApi *api, Fts5Context *fts, sqlite3_context *ctx,
+                  int argc __attribute__((unused)), sqlite3_value **argv __attribute__((unused))) {
+  int count = 0;
+  int ret = api->xInstCount(fts, &count);
+  if (ret != SQLITE_OK) {
+    sqlite3_result_error_code(ctx, ret);
+    return;
+  }
+
+  struct Fts_Match *matches = malloc((count + 1) * sizeof(struct Fts_Match));
+  for (int i = 0; ret == SQLITE_OK && i < count; ++i) {
+    int phrase;
+    ret = api->xInst(fts, i, &phrase, &matches[i].column, &matches[i].token);
+    matches[i].size = api->xPhraseSize(fts, phrase);
+  }
+  qsort(matches, count, sizeof(struct Fts_Match), fts_match_compare);
+
+  int32_t *out = sqlite3_malloc((count + 1) * 3 * sizeof(int32_t));
+  struct Fts_Tokens tokens = { 0, 0, NULL, NULL };
+  int n = 0;
+
+  for (int i = 0; ret == SQLITE_OK && i < count; ) {
+    int column = matches[i].column;
+    const char *text;
+    int len;
+    ret = api->xColumnText(fts, column, &text, &len);
+    tokens.count = 0;
+    if (ret == SQLITE_OK)
+      ret = api->xTokenize(fts, text, len, &tokens, fts_collect_token);
+
+    /* Convert byte offsets to character offsets in one pass.  */
+    int byte = 0, chars = 0;
+    for (; ret == SQLITE_OK && i < count && matches[i].column == column; ++i) {
+      int first = matches[i].token;
+      int last = first + (matches[i].size > 0 ? matches[i].size : 1) - 1;
+      if (first >= tokens.count || last >= tokens.count)
+        continue;
+
+      int start = tokens.starts[first], end = tokens.ends[last];
+      if (start < byte) {
+        byte = 0;
+        chars = 0;
+      }
+      for (; byte < start; ++byte)
+        chars += ((text[byte] & 0xC0) != 0x80);
+      int length = 0;
+      for (int b = start; b < end; ++b)
+        length += ((text[b] & 0xC0) != 0x80);
+
+      out[n++] = column;
+      out[n++] = chars;
+      out[n++] = length;
+    }
+  }
+
+  free(tokens.starts);
+  free(tokens.ends);
+  free(matches);
+  if (ret != SQLITE_OK) {
+    sqlite3_free(out);
+    sqlite3_result_error_code(ctx, ret);
+    return;
+  }
+  sqlite3_result_blob(ctx, out, n * sizeof(int32_t), sqlite3_free);
+}
+
+static
+fts5_api *
+fts5_api_from_db(sqlite3 *db) {
+  fts5_api *api = NULL;
+  sqlite3_stmt *stmt = NULL;
+  if (sqlite3_prepare_v2(db, "SELECT fts5(?1)", -1, &stmt, NULL) == SQLITE_OK) {
+    sqlite3_bind_pointer(stmt, 1, &api, "fts5_api_ptr", NULL);
+    sqlite3_step(stmt);
+  }
+  sqlite3_finalize(stmt);
+  return api;
+}
+
+/* Vector similarity over BLOBs of native float32 values.  The kernels
+   come in AVX2, SSE and portable versions, picked once at load time.
+   vec_dot(A, B), vec_cosine(A, B) and vec_l2(A, B) compare two
+   vectors; vec_f32('[1, 2.5, ...]') builds one from a JSON array.
+   The table-valued function
+
+     SELECT id, score FROM vec_top_k('table', 'column', :query, 10, 'cosine')
+
+   scans a column and returns the rowids of the K best matches, best
+   first, keeping only a K-element heap.  */
+
+struct Vec_Sums {
+  double dot;
+  double a2;                    /* Squared norms.  */
+  double b2;
+};
+
+static
+void
+vec_sums_portable(const float *a, const float *b, size_t n, struct Vec_Sums *sums) {
+  float dot = 0, a2 = 0, b2 = 0;
+  for (size_t i = 0; i < n; ++i) {
+    dot += a[i] * b[i];
+    a2 += a[i] * a[i];
+    b2 += b[i] * b[i];
+  }
+  sums->dot = dot;
+  sums->a2 = a2;
+  sums->b2 = b2;
+}
+
+static
+double
+vec_l2_portable(const float *a, const float *b, size_t n) {
+  float sum = 0;
+  for (size_t i = 0; i < n; ++i) {
+    float d = a[i] - b[i];
+    sum += d * d;
+  }
+  return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static
+float
+hsum_sse(__m128 v) {
+  __m128 high = _mm_movehl_ps(v, v);
+  v = _mm_add_ps(v, high);
+  high = _mm_shuffle_ps(v, v, 1);
+  return _mm_cvtss_f32(_mm_add_ss(v, high));
+}
+
+__attribute__((target("sse2")))
+static
+void
+vec_sums_sse(const float *a, const float *b, size_t n, struct Vec_Sums *sums) {
+  __m128 dot = _mm_setzero_ps(), a2 = _mm_setzero_ps(), b2 = _mm_setzero_ps();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128 x = _mm_loadu_ps(a + i), y = _mm_loadu_ps(b + i);
+    dot = _mm_add_ps(dot, _mm_mul_ps(x, y));
+    a2 = _mm_add_ps(a2, _mm_mul_ps(x, x));
+    b2 = _mm_add_ps(b2, _mm_mul_ps(y, y));
+  }
+  vec_sums_portable(a + i, b + i, n - i, sums);
+  sums->dot += hsum_sse(dot);
+  sums->a2 += hsum_sse(a2);
+  sums->b2 += hsum_sse(b2);
+}
+
+__attribute__((target("sse2")))
+static
+double
+vec_l2_sse(const float *a, const float *b, size_t n) {
+  __m128 sum = _mm_setzero_ps();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128 d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+    sum = _mm_add_ps(sum, _mm_mul_ps(d, d));
+  }
+  return hsum_sse(sum) + vec_l2_portable(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static
+float
+hsum_avx(__m256 v) {
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  __m128 high = _mm_movehl_ps(sum, sum);
+  sum = _mm_add_ps(sum, high);
+  high = _mm_shuffle_ps(sum, sum, 1);
+  return _mm_cvtss_f32(_mm_add_ss(sum, high));
+}
+
+__attribute__((target("avx2,fma")))
+static
+void
+vec_sums_avx2(const float *a, const float *b, size_t n, struct Vec_Sums *sums) {
+  __m256 dot = _mm256_setzero_ps(), a2 = _mm256_setzero_ps(), b2 = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 x = _mm256_loadu_ps(a + i), y = _mm256_loadu_ps(b + i);
+    dot = _mm256_fmadd_ps(x, y, dot);
+    a2 = _mm256_fmadd_ps(x, x, a2);
+    b2 = _mm256_fmadd_ps(y, y, b2);
+  }
+  vec_sums_portable(a + i, b + i, n - i, sums);
+  sums->dot += hsum_avx(dot);
+  sums->a2 += hsum_avx(a2);
+  sums->b2 += hsum_avx(b2);
+}
+
+__attribute__((target("avx2,fma")))
+static
+double
+vec_l2_avx2(const float *a, const float *b, size_t n) {
+  __m256 sum = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    sum = _mm256_fmadd_ps(d, d, sum);
+  }
+  return hsum_avx(sum) + vec_l2_portable(a + i, b + i, n - i);
+}
+#endif
+
+static void (*vec_sums)(const float *, const float *, size_t, struct Vec_Sums *) = vec_sums_portable;
+static double (*vec_l2_squared)(const float *, const float *, size_t) = vec_l2_portable;
+
+static
+void
+vec_init(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    vec_sums = vec_sums_avx2;
+    vec_l2_squared = vec_l2_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    vec_sums = vec_sums_sse;
+    vec_l2_squared = vec_l2_sse;
+  }
+#endif
+}
+
+enum vec_metric { VEC_DOT, VEC_COSINE, VEC_L2 };
+
+/* Score vectors A and B of N floats by METRIC.  Higher is better except
+   for VEC_L2.  */
+static
+double
+vec_score(enum vec_metric metric, const float *a, const float *b, size_t n) {
+  if (metric == VEC_L2)
+    return sqrt(vec_l2_squared(a, b, n));
+
+  struct Vec_Sums sums;
+  vec_sums(a, b, n, &sums);
+  if (metric == VEC_DOT)
+    return sums.dot;
+  if (sums.a2 == 0 || sums.b2 == 0)
+    return 0;
+  return sums.dot / sqrt(sums.a2 * sums.b2);
+}
+
+static
+void
+sql_vec_compare(sqlite3_context *ctx, int argc __attribute__((unused)), sqlite3_value **argv) {
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL || sqlite3_value_type(argv[1]) == SQLITE_NULL)
+    return;
+  int len = sqlite3_value_bytes(argv[0]);
+  if (len != sqlite3_value_bytes(argv[1]) || len % sizeof(float)) {
+    sqlite3_result_error(ctx, "Vectors of different sizes", -1);
+    return;
+  }
+  const float *a = sqlite3_value_blob(argv[0]);
+  const float *b = sqlite3_value_blob(argv[1]);
+  enum vec_metric metric = (enum vec_metric)(intptr_t)sqlite3_user_data(ctx);
+  sqlite3_result_double(ctx, vec_score(metric, a, b, len / sizeof(float)));
+}
+
+static
+void
+sql_vec_f32(sqlite3_context *ctx, int argc __attribute__((unused)), sqlite3_value **argv) {
+  const char *text = (const char *)sqlite3_value_text(argv[0]);
+  if (!text)
+    return;
+
+  size_t count = 0, size = 16;
+  float *out = sqlite3_malloc(size * sizeof(float));
+  const char *p = text;
+  while (*p == ' ' || *p == '[')
+    ++p;
+  while (out && *p && *p != ']') {
+    char *end;
+    double d = strtod(p, &end);
+    if (end == p) {
+      sqlite3_free(out);
+      sqlite3_result_error(ctx, "Invalid vector", -1);
+      return;
+    }
+    if (count == size) {
+      size *= 2;
+      out = sqlite3_realloc(out, size * sizeof(float));
+      if (!out)
+        break;
+    }
+    out[count++] = d;
+    p = end;
+    while (*p == ' ' || *p == ',' || *p == '\n')
+      ++p;
+  }
+  if (!out) {
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+  sqlite3_result_blob(ctx, out, count * sizeof(float), sqlite3_free);
+}
+
+struct Vec_Hit {
+  sqlite3_int64 id;
+  double score;
+};
+
+struct Vec_Cursor {
+  sqlite3_vtab_cursor base;
+  struct Vec_Hit *hits;
+  int count;
+  int index;
+};
+
+struct Vec_Vtab {
+  sqlite3_vtab base;
+  sqlite3 *db;
+};
+
+#define VEC_COLUMN_ID 0
+#define VEC_COLUMN_SCORE 1
+#define VEC_COLUMN_TABLE 2
+#define VEC_COLUMN_COLUMN 3
+#define VEC_COLUMN_QUERY 4
+#define VEC_COLUMN_K 5
+#define VEC_COLUMN_METRIC 6
+
+static
+int
+vec_vtab_connect(sqlite3 *db, void *aux __attribute__((unused)), int argc __attribute__((unused)),
+                 const char *const *argv __attribute__((unused)), sqlite3_vtab **vtab,
+                 char **errmsg __attribute__((unused))) {
+  int ret = sqlite3_declare_vtab(db, "CREATE TABLE x(id INTEGER, score REAL, "
+                                 "tbl HIDDEN, col HIDDEN, query HIDDEN, k HIDDEN, metric HIDDEN)");
+  if (ret != SQLITE_OK)
+    return ret;
+
+  struct Vec_Vtab *tab = sqlite3_malloc(sizeof(struct Vec_Vtab));
+  if (!tab)
+    return SQLITE_NOMEM;
+  memset(tab, 0, sizeof(struct Vec_Vtab));
+  tab->db = db;
+  *vtab = &tab->base;
+  return SQLITE_OK;
+}
+
+static
+int
+vec_vtab_disconnect(sqlite3_vtab *vtab) {
+  sqlite3_free(vtab);
+  return SQLITE_OK;
+}
+
+/* Each argument is passed to xFilter at argvIndex column - 1; idxNum
+   has a bit for each argument given.  */
+static
+int
+vec_vtab_best_index(sqlite3_vtab *vtab __attribute__((unused)), sqlite3_index_info *info) {
+  int args[VEC_COLUMN_METRIC + 1] = { -1, -1, -1, -1, -1, -1, -1 };
+
+  for (int i = 0; i < info->nConstraint; ++i) {
+    const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+    if (c->iColumn < VEC_COLUMN_TABLE || c->op != SQLITE_INDEX_CONSTRAINT_EQ)
+      continue;
+    if (!c->usable)
+      return SQLITE_CONSTRAINT;
+    args[c->iColumn] = i;
+  }
+  if (args[VEC_COLUMN_TABLE] < 0 || args[VEC_COLUMN_COLUMN] < 0 || args[VEC_COLUMN_QUERY] < 0)
+    return SQLITE_CONSTRAINT;
+
+  int argv_index = 0;
+  info->idxNum = 0;
+  for (int column = VEC_COLUMN_TABLE; column <= VEC_COLUMN_METRIC; ++column) {
+    if (args[column] < 0)
+      continue;
+    info->idxNum |= 1 << column;
+    info->aConstraintUsage[args[column]].argvIndex = ++argv_index;
+    info->aConstraintUsage[args[column]].omit = 1;
+  }
+  info->estimatedCost = 100000;
+  info->estimatedRows = 10;
+  return SQLITE_OK;
+}
+
+static
+int
+vec_vtab_open(sqlite3_vtab *vtab __attribute__((unused)), sqlite3_vtab_cursor **cursor) {
+  struct Vec_Cursor *cur = sqlite3_malloc(sizeof(struct Vec_Cursor));
+  if (!cur)
+    return SQLITE_NOMEM;
+  memset(cur, 0, sizeof(struct Vec_Cursor));
+  *cursor = &cur->base;
+  return SQLITE_OK;
+}
+
+static
+int
+vec_vtab_close(sqlite3_vtab_cursor *cursor) {
+  struct Vec_Cursor *cur = (struct Vec_Cursor *)cursor;
+  sqlite3_free(cur->hits);
+  sqlite3_free(cur);
+  return SQLITE_OK;
+}
+
+/* Whether hit A ranks before hit B.  */
+static
+bool
+vec_hit_better(enum vec_metric metric, const struct Vec_Hit *a, const struct Vec_Hit *b) {
+  return (metric == VEC_L2) ? a->score < b->score : a->score > b->score;
+}
+
+/* Restore the heap property below I, with the worst hit at the top.  */
+static
+void
+vec_heap_down(enum vec_metric metric, struct Vec_Hit *heap, int count, int i) {
+  for (;;) {
+    int worst = i, left = 2 * i + 1, right = left + 1;
+    if (left < count && vec_hit_better(metric, &heap[worst], &heap[left]))
+      worst = left;
+    if (right < count && vec_hit_better(metric, &heap[worst], &heap[right]))
+      worst = right;
+    if (worst == i)
+      return;
+    struct Vec_Hit tmp = heap[i];
+    heap[i] = heap[worst];
+    heap[worst] = tmp;
+    i = worst;
+  }
+}
+
+static
+int
+vec_vtab_filter(sqlite3_vtab_cursor *cursor, int idx_num, const char *idx_str __attribute__((unused)),
+                int argc __attribute__((unused)), sqlite3_value **argv) {
+  struct Vec_Cursor *cur = (struct Vec_Cursor *)cursor;
+  struct Vec_Vtab *tab = (struct Vec_Vtab *)cursor->pVtab;
+  sqlite3_value *args[VEC_COLUMN_METRIC + 1] = { NULL };
+  for (int column = VEC_COLUMN_TABLE, i = 0; column <= VEC_COLUMN_METRIC; ++column)
+    if (idx_num & (1 << column))
+      args[column] = argv[i++];
+
+  int k = args[VEC_COLUMN_K] ? sqlite3_value_int(args[VEC_COLUMN_K]) : 10;
+  enum vec_metric metric = VEC_COSINE;
+  if (args[VEC_COLUMN_METRIC]) {
+    const char *name = (const char *)sqlite3_value_text(args[VEC_COLUMN_METRIC]);
+    if (name && strcmp(name, "dot") == 0) {
+      metric = VEC_DOT;
+    } else if (name && strcmp(name, "l2") == 0) {
+      metric = VEC_L2;
+    } else if (!name || strcmp(name, "cosine") != 0) {
+      tab->base.zErrMsg = sqlite3_mprintf("vec_top_k: unknown metric");
+      return SQLITE_ERROR;
+    }
+  }
+
+  int dim = sqlite3_value_bytes(args[VEC_COLUMN_QUERY]) / sizeof(float);
+  float *query = sqlite3_malloc(dim * sizeof(float) + 1);
+  if (!query)
+    return SQLITE_NOMEM;
+  memcpy(query, sqlite3_value_blob(args[VEC_COLUMN_QUERY]), dim * sizeof(float));
+
+  char *sql = sqlite3_mprintf("SELECT rowid, \"%w\" FROM \"%w\"",
+                              sqlite3_value_text(args[VEC_COLUMN_COLUMN]),
+                              sqlite3_value_text(args[VEC_COLUMN_TABLE]));
+  sqlite3_stmt *stmt = NULL;
+  int ret = sqlite3_prepare_v2(tab->db, sql, -1, &stmt, NULL);
+  sqlite3_free(sql);
+  if (ret != SQLITE_OK) {
+    tab->base.zErrMsg = sqlite3_mprintf("vec_top_k: %s", sqlite3_errmsg(tab->db));
+    sqlite3_free(query);
+    return ret;
+  }
+
+  /* The heap grows with the rows, so that a large K costs no more
+     than the table has rows.  */
+  sqlite3_free(cur->hits);
+  int capacity = (k > 0 && k < 64) ? k : 64;
+  cur->hits = sqlite3_malloc64((sqlite3_uint64)capacity * sizeof(struct Vec_Hit));
+  cur->count = 0;
+  cur->index = 0;
+  if (!cur->hits) {
+    sqlite3_finalize(stmt);
+    sqlite3_free(query);
+    return SQLITE_NOMEM;
+  }
+
+  while (k > 0 && (ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+    if (sqlite3_column_bytes(stmt, 1) != dim * (int)sizeof(float))
+      continue;
+    struct Vec_Hit hit = {
+      sqlite3_column_int64(stmt, 0),
+      vec_score(metric, query, sqlite3_column_blob(stmt, 1), dim)
+    };
+    if (cur->count < k) {
+      if (cur->count == capacity) {
+        int grown = (capacity > k / 2) ? k : capacity * 2;
+        struct Vec_Hit *hits = sqlite3_realloc64(cur->hits, (sqlite3_uint64)grown * sizeof(struct Vec_Hit));
+        if (!hits) {
+          ret = SQLITE_NOMEM;
+          break;
+        }
+        cur->hits = hits;
+        capacity = grown;
+      }
+      /* Sift up.  */
+      int i = cur->count++;
+      cur->hits[i] = hit;
+      while (i > 0 && vec_hit_better(metric, &cur->hits[(i - 1) / 2], &cur->hits[i])) {
+        struct Vec_Hit tmp = cur->hits[i];
+        cur->hits[i] = cur->hits[(i - 1) / 2];
+        cur->hits[(i - 1) / 2] = tmp;
+        i = (i - 1) / 2;
+      }
+    } else if (vec_hit_better(metric, &hit, &cur->hits[0])) {
+      cur->hits[0] = hit;
+      vec_heap_down(metric, cur->hits, cur->count, 0);
+    }
+  }
+  if (k > 0 && ret != SQLITE_DONE && ret != SQLITE_NOMEM)
+    tab->base.zErrMsg = sqlite3_mprintf("vec_top_k: %s", sqlite3_errmsg(tab->db));
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
+  if (k > 0 && ret != SQLITE_DONE)
+    return ret;
+
+  /* Pop the heap from the back, which leaves the best hit first.  */
+  for (int n = cur->count - 1; n > 0; --n) {
+    struct Vec_Hit tmp = cur->hits[0];
+    cur->hits[0] = cur->hits[n];
+    cur->hits[n] = tmp;
+    vec_heap_down(metric, cur->hits, n, 0);
+  }
+  return SQLITE_OK;
+}
+
+static
+int
+vec_vtab_next(sqlite3_vtab_cursor *cursor) {
+  ((struct Vec_Cursor *)cursor)->index++;
+  return SQLITE_OK;
+}
+
+static
+int
+vec_vtab_eof(sqlite3_vtab_cursor *cursor) {
+  struct Vec_Cursor *cur = (struct Vec_Cursor *)cursor;
+  return cur->index >= cur->count;
+}
+
+static
+int
+vec_vtab_column(sqlite3_vtab_cursor *cursor, sqlite3_context *ctx, int column) {
+  struct Vec_Cursor *cur = (struct Vec_Cursor *)cursor;
+  if (column == VEC_COLUMN_ID)
+    sqlite3_result_int64(ctx, cur->hits[cur->index].id);
+  else if (column == VEC_COLUMN_SCORE)
+    sqlite3_result_double(ctx, cur->hits[cur->index].score);
+  return SQLITE_OK;
+}
+
+static
+int
+vec_vtab_rowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid) {
+  *rowid = ((struct Vec_Cursor *)cursor)->index;
+  return SQLITE_OK;
+}
+
+static sqlite3_module vec_top_k_module = {
+  .iVersion = 0,
+  .xConnect = vec_vtab_connect,
+  .xBestIndex = vec_vtab_best_index,
+  .xDisconnect = vec_vtab_disconnect,
+  .xOpen = vec_vtab_open,
+  .xClose = vec_vtab_close,
+  .xFilter = vec_vtab_filter,
+  .xNext = vec_vtab_next,
+  .xEof = vec_vtab_eof,
+  .xColumn = vec_vtab_column,
+  .xRowid = vec_vtab_rowid,
+};
+
+/* compress(X [, LEVEL [, METHOD]]) and decompress(X).  Compressed
+   values are BLOBs with a nine-byte header: the magic COMPRESS_MAGIC,
+   the method, with COMPRESS_TEXT set if X was text, and the
+   uncompressed size as a 32-bit little-endian integer.  METHOD is
+   'zlib', or 'zstd' when the module is built with -DHAVE_ZSTD -lzstd.
+   decompress returns values without a valid header, or that do not
+   decompress, unchanged, so columns can be compressed gradually.  */
+
+#define COMPRESS_MAGIC "\x89SQZ"
+#define COMPRESS_MAGIC_SIZE 4
+#define COMPRESS_ZLIB 1
+#define COMPRESS_ZSTD 2
+#define COMPRESS_TEXT 0x80
+#define COMPRESS_HEADER 9
+/* zlib cannot compress by more than about 1032 to 1.  */
+#define COMPRESS_ZLIB_RATIO 1032
+
+static
+void
+sql_compress(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+  int type = sqlite3_value_type(argv[0]);
+  if (type == SQLITE_NULL)
+    return;
+
+  const unsigned char *in = (type == SQLITE_BLOB) ? sqlite3_value_blob(argv[0]) : sqlite3_value_text(argv[0]);
+  size_t len = sqlite3_value_bytes(argv[0]);
+  int level = (argc > 1 && sqlite3_value_type(argv[1]) != SQLITE_NULL) ? sqlite3_value_int(argv[1]) : -1;
+  const char *method = (argc > 2) ? (const char *)sqlite3_value_text(argv[2]) : NULL;
+  if (len > UINT32_MAX) {
+    sqlite3_result_error_toobig(ctx);
+    return;
+  }
+
+  unsigned char tag;
+  size_t bound;
+  if (!method || strcmp(method, "zlib") == 0) {
+    tag = COMPRESS_ZLIB;
+    bound = compressBound(len);
+#ifdef HAVE_ZSTD
+  } else if (strcmp(method, "zstd") == 0) {
+    tag = COMPRESS_ZSTD;
+    bound = ZSTD_compressBound(len);
+#endif
+  } else {
+    sqlite3_result_error(ctx, "Unknown compression method", -1);
+    return;
+  }
+
+  unsigned char *out = sqlite3_malloc64(COMPRESS_HEADER + bound);
+  if (!out) {
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+  memcpy(out, COMPRESS_MAGIC, COMPRESS_MAGIC_SIZE);
+  out[COMPRESS_MAGIC_SIZE] = tag | ((type == SQLITE_TEXT) ? COMPRESS_TEXT : 0);
+  for (int i = 0; i < 4; ++i)
+    out[COMPRESS_MAGIC_SIZE + 1 + i] = (len >> (8 * i)) & 0xFF;
+
+  size_t size = bound;
+  bool ok;
+  if (tag == COMPRESS_ZLIB) {
+    uLongf dest = bound;
+    ok = compress2(out + COMPRESS_HEADER, &dest, in, len, (level < 0) ? Z_DEFAULT_COMPRESSION : level) == Z_OK;
+    size = dest;
+  } else {
+#ifdef HAVE_ZSTD
+    size = ZSTD_compress(out + COMPRESS_HEADER, bound, in, len, (level < 0) ? 3 : level);
+    ok = !ZSTD_isError(size);
+#else
+    ok = false;
+#endif
+  }
+  if (!ok) {
+    sqlite3_free(out);
+    sqlite3_result_error(ctx, "Compression failed", -1);
+    return;
+  }
+  sqlite3_result_blob64(ctx, out, COMPRESS_HEADER + size, sqlite3_free);
+}
+
+/* Decompress the LEN bytes at IN into a malloc'd *OUT of *OUT_LEN bytes,
+   and set *TEXT to whether the value was text.  Value is 1 on success,
+   0 if IN is not a compressed value or does not decompress, and -1 if
+   it uses a method this build does not support.  */
+static
+int
+decompress_bytes(const unsigned char *in, size_t len, unsigned char **out, size_t *out_len, bool *text) {
+  if (len < COMPRESS_HEADER || memcmp(in, COMPRESS_MAGIC, COMPRESS_MAGIC_SIZE))
+    return 0;
+  unsigned char tag = in[COMPRESS_MAGIC_SIZE] & ~COMPRESS_TEXT;
+  if (tag != COMPRESS_ZLIB && tag != COMPRESS_ZSTD)
+    return 0;
+#ifndef HAVE_ZSTD
+  if (tag == COMPRESS_ZSTD)
+    return -1;
+#endif
+
+  size_t size = 0;
+  for (int i = 0; i < 4; ++i)
+    size |= (size_t)in[COMPRESS_MAGIC_SIZE + 1 + i] << (8 * i);
+  const unsigned char *data = in + COMPRESS_HEADER;
+  size_t data_len = len - COMPRESS_HEADER;
+
+  /* Check the size against the data before allocating it.  */
+  if (tag == COMPRESS_ZLIB && size > data_len * COMPRESS_ZLIB_RATIO)
+    return 0;
+#ifdef HAVE_ZSTD
+  if (tag == COMPRESS_ZSTD && ZSTD_getFrameContentSize(data, data_len) != size)
+    return 0;
+#endif
+
+  *text = in[COMPRESS_MAGIC_SIZE] & COMPRESS_TEXT;
+  *out = malloc(size + 1);
+  if (!*out)
+    return 0;
+
+  bool ok = false;
+  if (tag == COMPRESS_ZLIB) {
+    uLongf dest = size;
+    ok = uncompress(*out, &dest, data, data_len) == Z_OK && dest == size;
+  } else {
+#ifdef HAVE_ZSTD
+    size_t dest = ZSTD_decompress(*out, size, data, data_len);
+    ok = !ZSTD_isError(dest) && dest == size;
+#endif
+  }
+  if (!ok) {
+    free(*out);
+    return 0;
+  }
+  (*out)[size] = '\0';
+  *out_len = size;
+  return 1;
+}
+
+static
+void
+sql_decompress(sqlite3_context *ctx, int argc __attribute__((unused)), sqlite3_value **argv) {
+  if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+    sqlite3_result_value(ctx, argv[0]);
+    return;
+  }
+
+  unsigned char *out;
+  size_t len;
+  bool text;
+  switch (decompress_bytes(sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0]), &out, &len, &text)) {
+  case 0:
+    sqlite3_result_value(ctx, argv[0]);
+    break;
+  case 1:
+    if (text)
+      sqlite3_result_text64(ctx, (const char *)out, len, free, SQLITE_UTF8);
+    else
+      sqlite3_result_blob64(ctx, out, len, free);
+    break;
+  default:
+    sqlite3_result_error(ctx, "zstd compression is not supported in this build", -1);
+    break;
+  }
+}
+
+/* Register the natively implemented SQL functions and modules on DB.  */
+static
+void
+register_functions(sqlite3 *db) {
+  int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+#ifdef SQLITE_INNOCUOUS
+  flags |= SQLITE_INNOCUOUS;
+#endif
+
+  sqlite3_create_function(db, "regexp", 2, flags, NULL, sql_regexp, NULL, NULL);
+  sqlite3_create_function(db, "casefold", 1, flags, NULL, sql_casefold, NULL, NULL);
+  sqlite3_create_function(db, "fnv1a", 1, flags, NULL, sql_fnv1a, NULL, NULL);
+  sqlite3_create_function(db, "crc32", 1, flags, NULL, sql_crc32, NULL, NULL);
+  sqlite3_create_collation(db, "emacs", SQLITE_UTF8, NULL, collate_emacs);
+  sqlite3_create_collation(db, "emacs_nocase", SQLITE_UTF8, (void *)1, collate_emacs);
+  sqlite3_create_module(db, "emacs_buffer", &buffer_module, NULL);
+  sqlite3_create_function(db, "vec_dot", 2, flags, (void *)VEC_DOT, sql_vec_compare, NULL, NULL);
+  sqlite3_create_function(db, "vec_cosine", 2, flags, (void *)VEC_COSINE, sql_vec_compare, NULL, NULL);
+  sqlite3_create_function(db, "vec_l2", 2, flags, (void *)VEC_L2, sql_vec_compare, NULL, NULL);
+  sqlite3_create_function(db, "vec_f32", 1, flags, NULL, sql_vec_f32, NULL, NULL);
+  sqlite3_create_function(db, "compress", 1, flags, NULL, sql_compress, NULL, NULL);
+  sqlite3_create_function(db, "compress", 2, flags, NULL, sql_compress, NULL, NULL);
+  sqlite3_create_function(db, "compress", 3, flags, NULL, sql_compress, NULL, NULL);
+  sqlite3_create_function(db, "decompress", 1, flags, NULL, sql_decompress, NULL, NULL);
+  sqlite3_create_module(db, "vec_top_k", &vec_top_k_module, NULL);
+
+  fts5_api *fts5 = fts5_api_from_db(db);
+  if (fts5)
+    fts5->xCreateFunction(fts5, "match_offsets", NULL, fts_match_offsets, NULL);
+}
+
+/* Open the database file PATH for PTR.  If SHARED, the connection of
+   another handle on the same file is used when there is one.  Value
+   is the result code of opening it.  */
+static
+int
+lisp_sqlite_connect(struct Lisp_Sqlite *ptr, const char *path, int flags, bool shared) {
+  /* The same file may be reached through several names, so an
+     existing file is identified by its inode.  */
+  struct stat st;
+  bool exists = shared && stat(path, &st) == 0;
+  struct Shared_Connection *conn = NULL;
+  if (shared) {
+    for (conn = shared_connections; conn; conn = conn->next)
+      if (exists && conn->ino ? (conn->dev == st.st_dev && conn->ino == st.st_ino)
+          : !strcmp(conn->path, path))
+        break;
+  }
+
+  if (!conn) {
+    sqlite3 *sdb;
+    int ret = sqlite3_open_v2 (path, &sdb, flags, NULL);
+    if (ret != SQLITE_OK) {
+      sqlite3_close(sdb);
+      return ret;
+    }
+    register_functions(sdb);
+    if (!shared) {
+      ptr->db = sdb;
+      ptr->cache = calloc(1, sizeof(struct Statement_Cache));
+      return SQLITE_OK;
+    }
+
+    conn = calloc(1, sizeof(struct Shared_Connection));
+    conn->path = strdup(path);
+    if (exists || stat(path, &st) == 0) {
+      conn->dev = st.st_dev;
+      conn->ino = st.st_ino;
+    }
+    conn->db = sdb;
+    conn->cache = calloc(1, sizeof(struct Statement_Cache));
+    conn->next = shared_connections;
+    shared_connections = conn;
+  }
+
+  ptr->db = conn->db;
+  ptr->cache = conn->cache;
+  ptr->shared = conn;
+  conn->refs++;
+  return SQLITE_OK;
+}
+
+static int db_count = 0;
+
+static
+emacs_value
+Fsqlite_open(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  int flags = (SQLITE_OPEN_CREATE  | SQLITE_OPEN_READWRITE);
+#ifdef SQLITE_OPEN_FULLMUTEX
+  flags |= SQLITE_OPEN_FULLMUTEX;
+#endif
+#ifdef SQLITE_OPEN_URI
+  flags |= SQLITE_OPEN_URI;
+#endif
+
+  bool shared = !NILP(keyword_arg(env, nargs, args, 1, ":shared"));
+  emacs_value lazy = keyword_arg(env, nargs, args, 1, ":lazy");
+
+  emacs_value name;
+  if ((nargs > 0) && !NILP(args[0])) {
+    name = call(expand-file-name, args[0], Q(nil));
+  } else {
+#ifdef SQLITE_OPEN_MEMORY
+    /* In-memory database.  These have to have different names to
+       refer to different databases.  */
+    name = call(format, build_string(":memory:%d"), make_int(++db_count));
+    flags |= SQLITE_OPEN_MEMORY;
+    /* In-memory databases are private to their handle.  */
+    shared = false;
+#else
+    xsignal(error, build_string("sqlite in-memory is not available"));
+#endif
+  }
+
+  ptrdiff_t size=0;
+  env->copy_string_contents(env, name, NULL, &size);
+  char *encoded = malloc(size);
+  env->copy_string_contents(env, name, encoded, &size);
+
+  emacs_value value = lisp_sqlite_make(env);
+  struct Lisp_Sqlite *ptr = env->get_user_ptr(env, value);
+  if (!NILP(lazy)) {
+    ptr->lazy = malloc(sizeof(struct Lazy_Open));
+    ptr->lazy->path = encoded;
+    ptr->lazy->flags = flags;
+    ptr->lazy->shared = shared;
+    ptr->lazy->timer = NULL;
+    if (!EQ(lazy, Q(t)))
+      ptr->lazy->timer = env->make_global_ref(env, call(run-with-idle-timer, lazy, Q(nil),
+                                                         Q(sqlite-ensure-open), value));
+    return value;
+  }
+
+  int ret = lisp_sqlite_connect(ptr, encoded, flags, shared);
+  free(encoded);
+  if (ret != SQLITE_OK)
+    return Q(nil);
+  return value;
+}
+
+static
+void
+maintenance_disable(emacs_env *env, struct Lisp_Sqlite *ptr) {
+  if (ptr->maintenance && ptr->maintenance->timer) {
+    call(cancel-timer, ptr->maintenance->timer);
+    env->free_global_ref(env, ptr->maintenance->timer);
+    ptr->maintenance->timer = NULL;
+  }
+}
+
+/* Cancel the idle timer of `sqlite-warmup' on PTR, if any.  */
+static
+void
+warmup_cancel(emacs_env *env, struct Lisp_Sqlite *ptr) {
+  if (ptr->warmup_timer) {
+    call(cancel-timer, ptr->warmup_timer);
+    env->free_global_ref(env, ptr->warmup_timer);
+    ptr->warmup_timer = NULL;
+  }
+}
+
+static
+emacs_value
+Fsqlite_ensure_open(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  /* Opening the database is a side effect of checking it.  */
+  return lisp_sqlite_check(env, args[0]) ? Q(t) : Q(nil);
+}
+
+static
+emacs_value
+Fsqlite_close(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  if (user_ptr_check(env, args[0]) == lisp_shards_free) {
+    struct Lisp_Shards *shards = env->get_user_ptr(env, args[0]);
+    if (shards->dbs) {
+      for (int i = 0; i < shards->count; ++i)
+        sqlite3_close(shards->dbs[i]);
+      free(shards->dbs);
+      shards->dbs = NULL;
+    }
+    return Q(t);
+  }
+
+  /* A lazy database that was never used is not opened now.  */
+  if (user_ptr_check(env, args[0]) == lisp_sqlite_free) {
+    struct Lisp_Sqlite *ptr = env->get_user_ptr(env, args[0]);
+    if (ptr->lazy) {
+      lazy_open_cancel(env, ptr->lazy);
+      lazy_open_free(ptr->lazy);
+      ptr->lazy = NULL;
+      return Q(t);
+    }
+  }
+
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+
+  /* The statement of the query is still in use.  */
+  if (ptr->busy) {
+    xsignal(error, build_string("Database in use by a query"));
+    return Q(nil);
+  }
+
+  /* Buffered writes that cannot be written keep DB open, rather than
+     being lost when it is closed.  */
+  char *errmsg = NULL;
+  if (!kv_flush_all(ptr, &errmsg)) {
+    xsignal(error, build_string(errmsg));
+    free(errmsg);
+    return Q(nil);
+  }
+
+  warmup_cancel(env, ptr);
+  if (ptr->maintenance) {
+    maintenance_disable(env, ptr);
+    maintenance_optimize(ptr->db, ptr->maintenance->analysis_limit);
+    free(ptr->maintenance);
+    ptr->maintenance = NULL;
+  }
+  if (ptr->session) {
+    sqlite3session_delete(ptr->session);
+    ptr->session = NULL;
+  }
+  scheduler_free(ptr->scheduler);
+  ptr->scheduler = NULL;
+  kv_detach_all(ptr);
+  lisp_sqlite_release(ptr);
+  return Q(t);
+}
+
+/* A binary encoding of Lisp values, so that they can be stored in
+   BLOBs without printing and reading them.  An encoded value is a
+   header followed by the value, each value being a tag byte followed
+   by its contents.  Lengths and integers are varints.  */
+
+#define CODEC_MAGIC 0xEC
+#define CODEC_VERSION 1
+#define CODEC_MAX_DEPTH 4096
+
+#define CODEC_NIL 0
+#define CODEC_T 1
+#define CODEC_INTEGER 2         /* Zigzag varint.  */
+#define CODEC_FLOAT 3           /* IEEE double, little-endian.  */
+#define CODEC_STRING 4          /* Length, UTF-8 bytes.  */
+#define CODEC_UNIBYTE 5         /* Length, bytes.  */
+#define CODEC_PROPERTIZED 6     /* String, then its intervals.  */
+#define CODEC_SYMBOL 7          /* Length, UTF-8 name.  */
+#define CODEC_LIST 8            /* Length, elements.  */
+#define CODEC_DOTTED 9          /* Length, elements, tail.  */
+#define CODEC_VECTOR 10         /* Length, elements.  */
+#define CODEC_HASH_TABLE 11     /* Test, count, keys and values.  */
+#define CODEC_PRINTED 12        /* Printed representation.  */
+
+struct Codec_Buffer {
+  unsigned char *data;
+  size_t len;
+  size_t size;
+  int depth;
+};
+
+static
+void
+codec_put(struct Codec_Buffer *buf, const void *data, size_t len) {
+  if (buf->len + len > buf->size) {
+    while (buf->len + len > buf->size)
+      buf->size = buf->size ? buf->size * 2 : 64;
+    buf->data = realloc(buf->data, buf->size);
+  }
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+}
+
+static
+void
+codec_put_byte(struct Codec_Buffer *buf, unsigned char byte) {
+  codec_put(buf, &byte, 1);
+}
+
+static
+void
+codec_put_varint(struct Codec_Buffer *buf, uint64_t n) {
+  unsigned char bytes[10];
+  int len = 0;
+  do {
+    bytes[len] = n & 0x7F;
+    n >>= 7;
+    if (n)
+      bytes[len] |= 0x80;
+    len++;
+  } while (n);
+  codec_put(buf, bytes, len);
+}
+
+/* Store the bytes of the unibyte string VALUE, from its UTF-8 text
+   once decoded as Latin-1, in *LEN bytes of a malloc'ed array.  */
+static
+unsigned char *
+unibyte_bytes(emacs_env *env, emacs_value value, size_t *len) {
+  emacs_value text = call(decode-coding-string, value, Q(latin-1));
+  ptrdiff_t size = 0;
+  env->copy_string_contents(env, text, NULL, &size);
+  unsigned char *out = malloc(size);
+  env->copy_string_contents(env, text, (char *)out, &size);
+  const unsigned char *in = out, *end = out + size - 1;
+  size_t n = 0;
+  while (in < end) {
+    if (*in < 0x80) {
+      out[n++] = *in++;
+    } else {
+      out[n++] = ((in[0] & 0x1F) << 6) | (in[1] & 0x3F);
+      in += 2;
+    }
+  }
+  *len = n;
+  return out;
+}
+
+static bool codec_encode(emacs_env *env, struct Codec_Buffer *buf, emacs_value value);
+
+static
+void
+codec_put_string(emacs_env *env, struct Codec_Buffer *buf, emacs_value value) {
+  if (!NILP(call(multibyte-string-p, value))) {
+    ptrdiff_t size = 0;
+    env->copy_string_contents(env, value, NULL, &size);
+    char *text = malloc(size);
+    env->copy_string_contents(env, value, text, &size);
+    codec_put_byte(buf, CODEC_STRING);
+    codec_put_varint(buf, size - 1);
+    codec_put(buf, text, size - 1);
+    free(text);
+  } else {
+    size_t len;
+    unsigned char *bytes = unibyte_bytes(env, value, &len);
+    codec_put_byte(buf, CODEC_UNIBYTE);
+    codec_put_varint(buf, len);
+    codec_put(buf, bytes, len);
+    free(bytes);
+  }
+}
+
+static
+emacs_value
+codec_hash_entry(emacs_env *env, ptrdiff_t nargs __attribute__((unused)), emacs_value args[], void *data) {
+  struct Codec_Buffer *buf = (struct Codec_Buffer *)data;
+  if (codec_encode(env, buf, args[0]))
+    codec_encode(env, buf, args[1]);
+  return Q(nil);
+}
+
+/* Return the text properties of STRING as a list of (BEG END PLIST),
+   like `object-intervals', which is new in Emacs 28, does.  */
+static
+emacs_value
+string_intervals(emacs_env *env, emacs_value string) {
+  if (!NILP(call(fboundp, Q(object-intervals))))
+    return call(object-intervals, string);
+
+  emacs_value intervals = Q(nil);
+  emacs_value end = call(length, string);
+  intmax_t len = XFIXNUM(end);
+  for (intmax_t pos = 0; pos < len; ) {
+    emacs_value beg = make_int(pos);
+    emacs_value next = call(next-property-change, beg, string, end);
+    emacs_value plist = call(text-properties-at, beg, string);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return)
+      return Q(nil);
+    if (!NILP(plist))
+      intervals = call(cons, call(list, beg, next, plist), intervals);
+    pos = XFIXNUM(next);
+  }
+  return call(nreverse, intervals);
+}
+
+/* Append the encoding of VALUE to BUF.  Value is false, with an error
+   signaled, if VALUE cannot be encoded.  */
+static
+bool
+codec_encode(emacs_env *env, struct Codec_Buffer *buf, emacs_value value) {
+  if (++buf->depth > CODEC_MAX_DEPTH) {
+    xsignal(error, build_string("Value too deeply nested to encode"));
+    return false;
+  }
+
+  emacs_value type = TYPE_OF(value);
+  bool print = false;
+  if (NILP(value)) {
+    codec_put_byte(buf, CODEC_NIL);
+  } else if (EQ(value, Q(t))) {
+    codec_put_byte(buf, CODEC_T);
+  } else if (EQ(type, Q(integer))) {
+    intmax_t n = XFIXNUM(value);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+      /* A bignum.  */
+      env->non_local_exit_clear(env);
+      print = true;
+    } else {
+      codec_put_byte(buf, CODEC_INTEGER);
+      codec_put_varint(buf, ((uint64_t)n << 1) ^ (uint64_t)(n >> 63));
+    }
+  } else if (EQ(type, Q(float))) {
+    double d = env->extract_float(env, value);
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    unsigned char bytes[8];
+    for (int i = 0; i < 8; ++i)
+      bytes[i] = bits >> (8 * i);
+    codec_put_byte(buf, CODEC_FLOAT);
+    codec_put(buf, bytes, 8);
+  } else if (EQ(type, Q(string))) {
+    emacs_value intervals = string_intervals(env, value);
+    if (!NILP(intervals))
+      codec_put_byte(buf, CODEC_PROPERTIZED);
+    codec_put_string(env, buf, value);
+    if (!NILP(intervals) && !codec_encode(env, buf, intervals))
+      return false;
+  } else if (EQ(type, Q(symbol))) {
+    char *name = copy_string(env, call(symbol-name, value));
+    size_t len = strlen(name);
+    codec_put_byte(buf, CODEC_SYMBOL);
+    codec_put_varint(buf, len);
+    codec_put(buf, name, len);
+    free(name);
+  } else if (EQ(type, Q(cons))) {
+    intmax_t count = XFIXNUM(call(safe-length, value));
+    emacs_value tail = value;
+    for (intmax_t i = 0; i < count; ++i)
+      tail = call(cdr, tail);
+    if (TYPEP(tail, cons)) {
+      xsignal(error, build_string("Cannot encode a circular list"));
+      return false;
+    }
+    codec_put_byte(buf, NILP(tail) ? CODEC_LIST : CODEC_DOTTED);
+    codec_put_varint(buf, count);
+    for (intmax_t i = 0; i < count; ++i, value = call(cdr, value))
+      if (!codec_encode(env, buf, call(car, value)))
+        return false;
+    if (!NILP(tail) && !codec_encode(env, buf, tail))
+      return false;
+  } else if (EQ(type, Q(vector))) {
+    ptrdiff_t count = env->vec_size(env, value);
+    codec_put_byte(buf, CODEC_VECTOR);
+    codec_put_varint(buf, count);
+    for (ptrdiff_t i = 0; i < count; ++i)
+      if (!codec_encode(env, buf, env->vec_get(env, value, i)))
+        return false;
+  } else if (EQ(type, Q(hash-table))) {
+    codec_put_byte(buf, CODEC_HASH_TABLE);
+    if (!codec_encode(env, buf, call(hash-table-test, value)))
+      return false;
+    codec_put_varint(buf, XFIXNUM(call(hash-table-count, value)));
+    call(maphash, env->make_function(env, 2, 2, codec_hash_entry, NULL, buf), value);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return)
+      return false;
+  } else {
+    print = true;
+  }
+
+  if (print) {
+    /* Records, bignums, bool-vectors and the like.  */
+    emacs_value printed = call(prin1-to-string, value);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return)
+      return false;
+    char *text = copy_string(env, printed);
+    if (!strncmp(text, "#<", 2)) {
+      free(text);
+      xsignal(error, build_string("Cannot encode value"), value);
+      return false;
+    }
+    size_t len = strlen(text);
+    codec_put_byte(buf, CODEC_PRINTED);
+    codec_put_varint(buf, len);
+    codec_put(buf, text, len);
+    free(text);
+  }
+  buf->depth--;
+  return env->non_local_exit_check(env) == emacs_funcall_exit_return;
+}
+
+/* Encode VALUE into a malloc'ed array of *LEN bytes.  Value is NULL,
+   with an error signaled, if VALUE cannot be encoded.  */
+static
+unsigned char *
+encode_value(emacs_env *env, emacs_value value, size_t *len) {
+  struct Codec_Buffer buf = { NULL, 0, 0, 0 };
+  codec_put_byte(&buf, CODEC_MAGIC);
+  codec_put_byte(&buf, CODEC_VERSION);
+  if (!codec_encode(env, &buf, value)) {
+    free(buf.data);
+    return NULL;
+  }
+  *len = buf.len;
+  return buf.data;
+}
+
+struct Codec_Reader {
+  const unsigned char *data;
+  size_t len;
+  size_t pos;
+  int depth;
+};
+
+static
+bool
+codec_get_varint(struct Codec_Reader *in, uint64_t *n) {
+  *n = 0;
+  for (int shift = 0; shift < 64 && in->pos < in->len; shift += 7) {
+    unsigned char byte = in->data[in->pos++];
+    *n |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+/* Get a length from IN, which must be followed by at least as many
+   bytes.  */
+static
+bool
+codec_get_length(struct Codec_Reader *in, uint64_t *n) {
+  return codec_get_varint(in, n) && *n <= in->len - in->pos;
+}
+
+/* Decode the value at the position of IN.  Value is NULL if the
+   encoding is corrupt, or with an error signaled.  */
+static
+emacs_value
+codec_decode(emacs_env *env, struct Codec_Reader *in) {
+  if (in->pos >= in->len || ++in->depth > CODEC_MAX_DEPTH)
+    return NULL;
+
+  emacs_value value = NULL;
+  uint64_t n;
+  unsigned char tag = in->data[in->pos++];
+  switch (tag) {
+  case CODEC_NIL:
+    value = Q(nil);
+    break;
+  case CODEC_T:
+    value = Q(t);
+    break;
+  case CODEC_INTEGER:
+    if (codec_get_varint(in, &n))
+      value = make_int((intmax_t)(n >> 1) ^ -(intmax_t)(n & 1));
+    break;
+  case CODEC_FLOAT:
+    if (in->len - in->pos >= 8) {
+      uint64_t bits = 0;
+      for (int i = 0; i < 8; ++i)
+        bits |= (uint64_t)in->data[in->pos++] << (8 * i);
+      double d;
+      memcpy(&d, &bits, sizeof(d));
+      value = env->make_float(env, d);
+    }
+    break;
+  case CODEC_STRING:
+  case CODEC_SYMBOL:
+  case CODEC_UNIBYTE:
+  case CODEC_PRINTED:
+    if (!codec_get_length(in, &n))
+      break;
+    const char *bytes = (const char *)in->data + in->pos;
+    in->pos += n;
+    if (tag == CODEC_UNIBYTE) {
+      value = env->make_unibyte_string(env, bytes, n);
+    } else {
+      value = env->make_string(env, bytes, n);
+      if (tag == CODEC_SYMBOL)
+        value = call(intern, value);
+      else if (tag == CODEC_PRINTED)
+        value = call(car, call(read-from-string, value));
+    }
+    break;
+  case CODEC_PROPERTIZED: {
+    emacs_value string = codec_decode(env, in);
+    emacs_value intervals = string ? codec_decode(env, in) : NULL;
+    if (!intervals)
+      break;
+    for (; TYPEP(intervals, cons); intervals = call(cdr, intervals)) {
+      emacs_value interval = call(car, intervals);
+      call(set-text-properties, call(car, interval), call(car, call(cdr, interval)),
+           call(car, call(cdr, call(cdr, interval))), string);
+    }
+    value = string;
+    break;
+  }
+  case CODEC_LIST:
+  case CODEC_DOTTED:
+  case CODEC_VECTOR: {
+    /* Every element takes at least a byte.  */
+    if (!codec_get_length(in, &n))
+      break;
+    emacs_value *elements = malloc((n + 1) * sizeof(emacs_value));
+    uint64_t count = 0;
+    while (count < n && (elements[count] = codec_decode(env, in)))
+      count++;
+    emacs_value tail = Q(nil);
+    if (count == n && tag == CODEC_DOTTED)
+      tail = codec_decode(env, in);
+    if (count == n && tail) {
+      if (tag == CODEC_VECTOR) {
+        value = env->funcall(env, Q(vector), n, elements);
+      } else {
+        value = tail;
+        while (count-- > 0)
+          value = call(cons, elements[count], value);
+      }
+    }
+    free(elements);
+    break;
+  }
+  case CODEC_HASH_TABLE: {
+    emacs_value test = codec_decode(env, in);
+    if (!test || !codec_get_length(in, &n))
+      break;
+    emacs_value table = call(make-hash-table, Q(:test), test, Q(:size), make_int(n));
+    uint64_t i;
+    for (i = 0; i < n; ++i) {
+      emacs_value key = codec_decode(env, in);
+      emacs_value val = key ? codec_decode(env, in) : NULL;
+      if (!val)
+        break;
+      call(puthash, key, val, table);
+    }
+    if (i == n)
+      value = table;
+    break;
+  }
+  }
+
+  in->depth--;
+  if (env->non_local_exit_check(env) != emacs_funcall_exit_return)
+    return NULL;
+  return value;
+}
+
+/* Return whether the LEN bytes at DATA start like an encoded value.  */
+static
+bool
+encoded_value_p(const unsigned char *data, size_t len) {
+  return len > 2 && data[0] == CODEC_MAGIC && data[1] == CODEC_VERSION;
+}
+
+/* Decode the LEN bytes at DATA.  Value is NULL, with an error
+   signaled, if they are not an encoded value.  */
+static
+emacs_value
+decode_value(emacs_env *env, const unsigned char *data, size_t len) {
+  struct Codec_Reader in = { data, len, 2, 0 };
+  emacs_value value = NULL;
+  if (encoded_value_p(data, len))
+    value = codec_decode(env, &in);
+  if (env->non_local_exit_check(env) != emacs_funcall_exit_return)
+    return NULL;
+  if (!value || in.pos != len) {
+    xsignal(error, build_string("Corrupt encoded value"));
+    return NULL;
+  }
+  return value;
+}
+
+/* Bind VALUE to the parameter INDEX of STMT.  Value is NULL on success,
+   or an error message, which is empty if a signal is pending.  */
+static
+const char *
+bind_value(emacs_env *env, sqlite3 *db, sqlite3_stmt *stmt, int index, emacs_value value) {
+  int ret = SQLITE_MISMATCH;
+  emacs_value type = TYPE_OF(value);
+  if (EQ(type, Q(string))) {
+    bool blob = false;
+
+    emacs_value coding_system = call(get-text-property, make_int(0), Q(coding-system), value);
+    if (!NILP(coding_system)) {
+      if (EQ(coding_system, Q(binary))) {
+          blob = true;
+      } else {
+        value = call(encode-coding-string, value, coding_system, Q(nil), Q(nil));
+      }
+    }
+
+    ptrdiff_t size = 0;
+    env->copy_string_contents(env, value, NULL, &size);
+
+    if (blob) {
+      if (size) {
+        if (size != XFIXNUM(call(length, value)) + 1) {
+          xsignal(error, build_string("BLOB values must be unibyte"));
+          return "";
+        }
+
+        char *encoded = malloc(size);
+        env->copy_string_contents(env, value, encoded, &size);
+        ret = sqlite3_bind_blob(stmt, index, encoded, size - 1, free);
+      } else {
+        ret = sqlite3_bind_blob(stmt, index, NULL, 0, NULL);
+      }
+    } else {
+      if (size) {
+        char *encoded = malloc(size);
+        env->copy_string_contents(env, value, encoded, &size);
+        ret = sqlite3_bind_text(stmt, index, encoded, size - 1, free);
+      } else {
+        ret = sqlite3_bind_text(stmt, index, NULL, 0, NULL);
+      }
+    }
+  } else if (EQ(type, Q(integer))) {
+    ret = sqlite3_bind_int64(stmt, index, XFIXNUM(value));
+  } else if (EQ(type, Q(float))) {
+    ret = sqlite3_bind_double(stmt, index, env->extract_float(env, value));
+  } else if (NILP(value)) {
+      ret = sqlite3_bind_null(stmt, index);
+  } else if (EQ(value, Q(t))) {
+    ret = sqlite3_bind_int(stmt, index, 1);
+  } else if (EQ(value, Q(false))) {
+    ret = sqlite3_bind_int(stmt, index, 0);
+  } else {
+    return "invalid argument";
+  }
+
+  if (ret != SQLITE_OK)
+    return sqlite3_errmsg (db);
+  return NULL;
+}
+
+/* Bind VALUE like bind_value, except that values without an SQL
+   counterpart are bound as BLOBs holding their binary encoding.  */
+static
+const char *
+bind_value_encoded(emacs_env *env, sqlite3 *db, sqlite3_stmt *stmt, int index, emacs_value value) {
+  emacs_value type = TYPE_OF(value);
+  if (EQ(type, Q(string)) || EQ(type, Q(integer)) || EQ(type, Q(float))
+      || NILP(value) || EQ(value, Q(t)) || EQ(value, Q(false)))
+    return bind_value(env, db, stmt, index, value);
+
+  size_t len;
+  unsigned char *encoded = encode_value(env, value, &len);
+  if (!encoded)
+    return "";
+  if (sqlite3_bind_blob(stmt, index, encoded, len, free) != SQLITE_OK)
+    return sqlite3_errmsg(db);
+  return NULL;
+}
+
+/* Bind values in a statement like
+   "insert into foo values (?, ?, ?)".  */
+static
+const char *
+bind_values (emacs_env *env, sqlite3 *db, sqlite3_stmt *stmt, emacs_value values) {
+  sqlite3_reset(stmt);
+  bool is_vector = TYPEP(values, vector);
+  int len = (is_vector)?env->vec_size(env, values):XFIXNUM(call(length, values));
+
+  for (int i = 0; i < len; ++i) {
+    emacs_value value;
+    if (is_vector) {
+      value = env->vec_get(env, values, i);
+    } else {
+      value = call(car, values);
+      values = call(cdr, values);
+    }
+
+    const char *errmsg = bind_value(env, db, stmt, i + 1, value);
+    if (errmsg)
+      return errmsg;
+  }
+
+  return NULL;
+}
+
+static
+emacs_value
+Fsqlite_execute(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+
+  if(!CHECK_STRING(env, args[1]))
+    return Q(nil);
+
+  if (nargs > 2) {
+    emacs_value type = TYPE_OF(args[2]);
+    if (!(NILP(args[2]) || EQ(type, Q(cons)) || EQ(type, Q(vector)))) {
+      xsignal(error, build_string ("VALUES must be a list or a vector"));
+      return Q(nil);
+    }
+  }
+
+  const char *errmsg = NULL;
+  char *encoded = copy_string(env, args[1]);
+  int ret;
+
+  /* We only execute the first statement -- if there's several
+     (separated by a semicolon), the subsequent statements won't be
+     done.  */
+  sqlite3_stmt *stmt = statement_cache_prepare(ptr->db, ptr->cache, encoded, &ret);
+  free(encoded);
+
+  if (ret != SQLITE_OK) {
+    errmsg = sqlite3_errmsg(ptr->db);
+    goto exit;
+  }
+  if (!stmt)
+    return make_int(0);
+
+  /* Bind ? values.  */
+  if ((nargs > 2) && !NILP (args[2])) {
+    const char *err = bind_values(env, ptr->db, stmt, args[2]);
+    if (err) {
+      statement_cache_release(ptr->cache, stmt);
+      errmsg = err;
+      goto exit;
+    }
+  }
+
+  ret = sqlite3_step(stmt);
+  if (ret != SQLITE_OK && ret != SQLITE_DONE)
+    errmsg = sqlite3_errmsg(ptr->db);
+  statement_cache_release(ptr->cache, stmt);
+  if (errmsg) {
+    errmsg = sqlite3_errmsg(ptr->db);
+    goto exit;
+  }
+
+  return make_int(sqlite3_changes(ptr->db));
+ exit:
+  if (ret == SQLITE_LOCKED || ret == SQLITE_BUSY) {
+    xsignal(sqlite_locked_error, build_string(errmsg));
+  } else {
+    xsignal(error, build_string(errmsg));
+  }
+
+  return Q(nil);
+}
+
+/* Per-column decoding hints for `row_to_value'.  */
+#define DECODE_NONE 0
+#define DECODE_DECOMPRESS 1
+#define DECODE_LISP 2
+
+/* Parse the :decode argument HINTS, a list or vector with an element
+   for each column, into an array of COLUMNS hints.  Value is NULL if
+   HINTS is nil or invalid, in which case a signal is pending.  */
+static
+unsigned char *
+decode_hints(emacs_env *env, emacs_value hints, int columns) {
+  if (NILP(hints))
+    return NULL;
+
+  unsigned char *decode = calloc(columns + 1, 1);
+  bool is_vector = TYPEP(hints, vector);
+  int len = (is_vector)?env->vec_size(env, hints):XFIXNUM(call(length, hints));
+  for (int i = 0; i < len; ++i) {
+    emacs_value hint;
+    if (is_vector) {
+      hint = env->vec_get(env, hints, i);
+    } else {
+      hint = call(car, hints);
+      hints = call(cdr, hints);
+    }
+    if (NILP(hint))
+      continue;
+    if (i < columns && EQ(hint, Q(decompress))) {
+      decode[i] = DECODE_DECOMPRESS;
+    } else if (i < columns && EQ(hint, Q(lisp))) {
+      decode[i] = DECODE_LISP;
+    } else {
+      free(decode);
+      xsignal(error, build_string("Invalid decode hint"), hint);
+      return NULL;
+    }
+  }
+  return decode;
+}
+
+/* Convert the current row of STMT to a list, decoding columns as
+   DECODE says if non-NULL.  */
+static
+emacs_value
+row_to_value(emacs_env *env, sqlite3_stmt *stmt, const unsigned char *decode) {
+  int len = sqlite3_column_count(stmt);
+  emacs_value values = Q(nil);
+
+  for (int i = 0; i < len; ++i) {
+    emacs_value v;
+
+    if (decode && decode[i] == DECODE_DECOMPRESS && sqlite3_column_type(stmt, i) == SQLITE_BLOB) {
+      unsigned char *out;
+      size_t size;
+      bool text;
+      int ret = decompress_bytes(sqlite3_column_blob(stmt, i), sqlite3_column_bytes(stmt, i), &out, &size, &text);
+      if (ret < 0) {
+        xsignal(error, build_string("zstd compression is not supported in this build"));
+        return Q(nil);
+      }
+      if (ret > 0) {
+        v = text ? env->make_string(env, (const char *)out, size) : env->make_unibyte_string(env, (const char *)out, size);
+        free(out);
+        values = call(cons, v, values);
+        continue;
+      }
+    }
+    if (decode && decode[i] == DECODE_LISP && sqlite3_column_type(stmt, i) == SQLITE_BLOB) {
+      const unsigned char *data = sqlite3_column_blob(stmt, i);
+      int size = sqlite3_column_bytes(stmt, i);
+      /* Other BLOBs are returned as they are.  */
+      if (encoded_value_p(data, size)) {
+        if (!(v = decode_value(env, data, size)))
+          return Q(nil);
+        values = call(cons, v, values);
+        continue;
+      }
+    }
+
+    switch (sqlite3_column_type (stmt, i)) {
+    case SQLITE_INTEGER:
+      v = make_int(sqlite3_column_int64(stmt, i));
+      break;
+    case SQLITE_FLOAT:
+      v = env->make_float(env, sqlite3_column_double(stmt, i));
+      break;
+    case SQLITE_BLOB:
+      v = env->make_unibyte_string(env,
+                                   sqlite3_column_blob(stmt, i),
+                                   sqlite3_column_bytes(stmt, i));
+      break;
+    case SQLITE_TEXT:
+      v = env->make_string(env,
+                           (const char *)sqlite3_column_text(stmt, i),
+                           sqlite3_column_bytes(stmt, i));
+      break;
+    default:
+      v = Q(nil);
+      break;
+    }
+
+    values = call(cons, v, values);
+  }
+
+  return call(nreverse, values);
+}
+
+static
+emacs_value
+column_names(emacs_env *env, sqlite3_stmt *stmt) {
+  emacs_value columns = Q(nil);
+  int count = sqlite3_column_count(stmt);
+  for (int i = 0; i < count; ++i)
+    columns = call(cons, build_string(sqlite3_column_name(stmt, i)), columns);
+
+  return call(nreverse, columns);
+}
+
+static
+emacs_value
+Fsqlite_select(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+
+  if(!CHECK_STRING(env, args[1]))
+    return Q(nil);
+
+  /* Keyword arguments may follow any of the optional ones.  */
+  ptrdiff_t positional = positional_args(env, nargs, args, 2);
+  emacs_value values = (positional > 2) ? args[2] : Q(nil);
+  emacs_value return_type = (positional > 3) ? args[3] : Q(nil);
+
+  emacs_value yield_every = keyword_arg(env, nargs, args, positional, ":yield-every");
+  intmax_t every = NILP(yield_every) ? 0 : XFIXNUM(yield_every);
+
+  const char *errmsg = NULL;
+  char *encoded = copy_string(env, args[1]);
+  sqlite3_stmt *stmt = NULL;
+  unsigned char *decode = NULL;
+  int ret;
+
+  /* Statements handed out as sets are owned by their set object.  */
+  bool set = EQ(return_type, Q(set));
+  if (set)
+    ret = sqlite3_prepare_v2(ptr->db, encoded, -1, &stmt, NULL);
+  else
+    stmt = statement_cache_prepare(ptr->db, ptr->cache, encoded, &ret);
+  free(encoded);
+
+  if (ret != SQLITE_OK) {
+    if (stmt)
+      sqlite3_finalize (stmt);
+    errmsg = sqlite3_errmsg(ptr->db);
+    goto exit;
+  }
+  if (!stmt) {
+    errmsg = "Empty query";
+    goto exit;
+  }
+
+  emacs_value hints = keyword_arg(env, nargs, args, positional, ":decode");
+  if (!NILP(hints) && !(decode = decode_hints(env, hints, sqlite3_column_count(stmt)))) {
+    if (set)
+      sqlite3_finalize (stmt);
+    else
+      statement_cache_release(ptr->cache, stmt);
+    return Q(nil);
+  }
+
+  /* Query with parameters.  */
+  if (!NILP(values)) {
+    const char *err = bind_values(env, ptr->db, stmt, values);
+    if (err) {
+      free(decode);
+      if (set)
+        sqlite3_finalize (stmt);
+      else
+        statement_cache_release(ptr->cache, stmt);
+      errmsg = err;
+      goto exit;
+    }
+  }
+
+  /* Return a handle to get the data.  */
+  if (set)
+    return lisp_statement_make(env, ptr->db, stmt, decode);
+
+  /* Return the data directly.  */
+  emacs_value retval = Q(nil);
+  intmax_t rows = 0;
+
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+    retval = call(cons, row_to_value(env, stmt, decode), retval);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return)
+      break;
+    if (every && ++rows % every == 0 && !lisp_sqlite_yield(env, ptr))
+      break;
+  }
+  free(decode);
+
+  /* The user asked to quit.  */
+  if (ret == SQLITE_ROW && env->non_local_exit_check(env) == emacs_funcall_exit_return) {
+    statement_cache_release(ptr->cache, stmt);
+    return Q(nil);
+  }
+
+  if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+    statement_cache_release(ptr->cache, stmt);
+    return Q(nil);
+  }
+
+  if (ret != SQLITE_DONE) {
+    errmsg = sqlite3_errmsg(ptr->db);
+    statement_cache_release(ptr->cache, stmt);
+    goto exit;
+  }
+
+  retval = call(nreverse, retval);
+
+  if (EQ(return_type, Q(full)))
+    retval = call(cons, column_names(env, stmt), retval);
+
+  statement_cache_release(ptr->cache, stmt);
+  return retval;
+ exit:
+  xsignal(error, build_string(errmsg));
+  return Q(nil);
+}
+
+static
+emacs_value
+Fsqlite_transaction(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  int ret = sqlite3_exec(ptr->db, "begin", NULL, NULL, NULL);
+  if (ret != SQLITE_OK)
+    return Q(nil);
+  return Q(t);
+}
+
+static
+emacs_value
+Fsqlite_commit(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+
+  int ret = sqlite3_exec(ptr->db, "commit", NULL, NULL, NULL);
+  if (ret != SQLITE_OK)
+    return Q(nil);
+  return Q(t);
+}
+
+static
+emacs_value
+Fsqlite_rollback(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+
+  int ret = sqlite3_exec(ptr->db, "rollback", NULL, NULL, NULL);
+  if (ret != SQLITE_OK)
+    return Q(nil);
+  return Q(t);
+}
+
+static
+emacs_value
+Fsqlite_pragma(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+
+  emacs_value pragma = call(concat, build_string("PRAGMA "), args[1]);
+
+  ptrdiff_t size = 0;
+  env->copy_string_contents(env, pragma, NULL, &size);
+  char *encoded = malloc(size);
+  env->copy_string_contents(env, pragma, encoded, &size);
+
+  int ret = sqlite3_exec(ptr->db, encoded, NULL, NULL, NULL);
+  free(encoded);
+  if (ret != SQLITE_OK)
+    return Q(nil);
+  return Q(t);
+}
+
+static
+emacs_value
+Fsqlite_next(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Statement *ptr = lisp_statement_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+
+  int ret = sqlite3_step(ptr->stmt);
+  if (ret != SQLITE_ROW && ret != SQLITE_OK && ret != SQLITE_DONE) {
+    xsignal(error, build_string(sqlite3_errmsg(ptr->db)));
+    return Q(nil);
+  }
+
+  if (ret == SQLITE_DONE) {
+    ptr->eof = true;
+    return Q(nil);
+  }
+
+  return row_to_value(env, ptr->stmt, ptr->decode);
+}
+
+static
+emacs_value
+Fsqlite_columns(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Statement *ptr = lisp_statement_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+
+  return column_names(env, ptr->stmt);
+}
+
+static
+emacs_value
+Fsqlite_more_p(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Statement *ptr = lisp_statement_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+
+  if (!ptr->eof)
+    return Q(t);
+  return Q(nil);
+}
+
+static
+emacs_value
+Fsqlite_finalize(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Statement *ptr = lisp_statement_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+
+  sqlite3_finalize(ptr->stmt);
+  ptr->stmt = NULL;
+  return Q(t);
+}
+
+static
+emacs_value
+value_to_lisp(emacs_env *env, sqlite3_value *value) {
+  switch (sqlite3_value_type(value)) {
+  case SQLITE_INTEGER:
+    return make_int(sqlite3_value_int64(value));
+  case SQLITE_FLOAT:
+    return env->make_float(env, sqlite3_value_double(value));
+  case SQLITE_BLOB:
+    return env->make_unibyte_string(env,
+                                    sqlite3_value_blob(value),
+                                    sqlite3_value_bytes(value));
+  case SQLITE_TEXT:
+    return env->make_string(env,
+                            (const char *)sqlite3_value_text(value),
+                            sqlite3_value_bytes(value));
+  default:
+    return Q(nil);
+  }
+}
+
+/* Set the result of CTX from VALUE, converted like `bind_values'
+   does.  */
+static
+void
+result_from_lisp(emacs_env *env, sqlite3_context *ctx, emacs_value value) {
+  emacs_value type = TYPE_OF(value);
+  if (EQ(type, Q(string))) {
+    bool blob = false;
+
+    emacs_value coding_system = call(get-text-property, make_int(0), Q(coding-system), value);
+    if (!NILP(coding_system)) {
+      if (EQ(coding_system, Q(binary))) {
+        blob = true;
+      } else {
+        value = call(encode-coding-string, value, coding_system, Q(nil), Q(nil));
+      }
+    }
+
+    ptrdiff_t size = 0;
+    env->copy_string_contents(env, value, NULL, &size);
+    char *encoded = malloc(size);
+    env->copy_string_contents(env, value, encoded, &size);
+    if (blob)
+      sqlite3_result_blob(ctx, encoded, size - 1, free);
+    else
+      sqlite3_result_text(ctx, encoded, size - 1, free);
+  } else if (EQ(type, Q(integer))) {
+    sqlite3_result_int64(ctx, XFIXNUM(value));
+  } else if (EQ(type, Q(float))) {
+    sqlite3_result_double(ctx, env->extract_float(env, value));
+  } else if (NILP(value)) {
+    sqlite3_result_null(ctx);
+  } else if (EQ(value, Q(t))) {
+    sqlite3_result_int(ctx, 1);
+  } else if (EQ(value, Q(false))) {
+    sqlite3_result_int(ctx, 0);
+  } else {
+    sqlite3_result_error(ctx, "invalid return value", -1);
+  }
+}
+
+/* A Lisp function registered with `sqlite-create-function'.  FINAL is
+   NULL for scalar functions.  Both are global references.  */
+struct Lisp_Function {
+  emacs_value func;
+  emacs_value final;
+};
+
+static
+void
+lisp_function_destroy(void *arg) {
+  struct Lisp_Function *ptr = (struct Lisp_Function *)arg;
+  stale_ref_push(ptr->func);
+  if (ptr->final)
+    stale_ref_push(ptr->final);
+  free(ptr);
+}
+
+/* Call FUNC with STATE (if non-NULL) followed by the SQL arguments.
+   Returns NULL and sets an error on CTX if Lisp exits non-locally;
+   the pending signal then propagates out of the outer module
+   function.  */
+static
+emacs_value
+lisp_function_funcall(sqlite3_context *ctx, emacs_value func, emacs_value *state, int argc, sqlite3_value **argv) {
+  emacs_env *env = current_env;
+  int nargs = argc + (state ? 1 : 0);
+  emacs_value args[nargs > 0 ? nargs : 1];
+  int n = 0;
+
+  if (state)
+    args[n++] = *state ? *state : Q(nil);
+  for (int i = 0; i < argc; ++i)
+    args[n++] = value_to_lisp(env, argv[i]);
+
+  emacs_value ret = env->funcall(env, func, nargs, args);
+  current_env = env;
+  if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+    sqlite3_result_error(ctx, "Lisp function exited non-locally", -1);
+    return NULL;
+  }
+  return ret;
+}
+
+static
+void
+lisp_function_call(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+  struct Lisp_Function *ptr = sqlite3_user_data(ctx);
+  emacs_value ret = lisp_function_funcall(ctx, ptr->func, NULL, argc, argv);
+  if (ret)
+    result_from_lisp(current_env, ctx, ret);
+}
+
+/* Aggregates keep a global reference to the state returned by the
+   last call of STEP in their aggregate context.  */
+static
+void
+lisp_function_step(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+  struct Lisp_Function *ptr = sqlite3_user_data(ctx);
+  emacs_value *state = sqlite3_aggregate_context(ctx, sizeof(emacs_value));
+  if (!state) {
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+
+  emacs_value ret = lisp_function_funcall(ctx, ptr->func, state, argc, argv);
+  if (ret) {
+    emacs_env *env = current_env;
+    if (*state)
+      env->free_global_ref(env, *state);
+    *state = env->make_global_ref(env, ret);
+  }
+}
+
+static
+void
+lisp_function_final(sqlite3_context *ctx) {
+  struct Lisp_Function *ptr = sqlite3_user_data(ctx);
+  emacs_value *state = sqlite3_aggregate_context(ctx, 0);
+  emacs_value initial = NULL;
+  emacs_value ret = lisp_function_funcall(ctx, ptr->final, state ? state : &initial, 0, NULL);
+  if (ret)
+    result_from_lisp(current_env, ctx, ret);
+  if (state && *state)
+    current_env->free_global_ref(current_env, *state);
+}
+
+static
+emacs_value
+Fsqlite_create_function(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+
+  if(!CHECK_STRING(env, args[1]))
+    return Q(nil);
+
+  int arity = -1;
+  if (!NILP(args[2])) {
+    if (!TYPEP(args[2], integer)) {
+      xsignal(wrong-type-argument, Q(integerp), args[2]);
+      return Q(nil);
+    }
+    arity = XFIXNUM(args[2]);
+  }
+
+  int flags = SQLITE_UTF8;
+  if ((nargs > 4) && !NILP(args[4]))
+    flags |= SQLITE_DETERMINISTIC;
+
+  ptrdiff_t size = 0;
+  env->copy_string_contents(env, args[1], NULL, &size);
+  char *name = malloc(size);
+  env->copy_string_contents(env, args[1], name, &size);
+
+  int ret;
+  if (NILP(args[3])) {
+    /* Remove the function.  */
+    ret = sqlite3_create_function_v2(ptr->db, name, arity, flags, NULL, NULL, NULL, NULL, NULL);
+  } else {
+    struct Lisp_Function *func = malloc(sizeof(struct Lisp_Function));
+    if (TYPEP(args[3], cons)) {
+      func->func = env->make_global_ref(env, call(car, args[3]));
+      func->final = env->make_global_ref(env, call(cdr, args[3]));
+      ret = sqlite3_create_function_v2(ptr->db, name, arity, flags, func,
+                                       NULL, lisp_function_step, lisp_function_final,
+                                       lisp_function_destroy);
+    } else {
+      func->func = env->make_global_ref(env, args[3]);
+      func->final = NULL;
+      ret = sqlite3_create_function_v2(ptr->db, name, arity, flags, func,
+                                       lisp_function_call, NULL, NULL,
+                                       lisp_function_destroy);
+    }
+  }
+  free(name);
+
+  if (ret != SQLITE_OK) {
+    xsignal(error, build_string(sqlite3_errmsg(ptr->db)));
+    return Q(nil);
+  }
+  return Q(t);
+}
+
+/* Open another connection to the database file of DB for use by a
+   worker thread.  Returns NULL for in-memory databases, which no
+   other connection can see.  */
+static
+sqlite3 *
+worker_open(sqlite3 *db) {
+  const char *filename = sqlite3_db_filename(db, "main");
+  if (!filename || !*filename)
+    return NULL;
+
+  sqlite3 *wdb;
+  if (sqlite3_open_v2(filename, &wdb, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+    sqlite3_close(wdb);
+    return NULL;
+  }
+  sqlite3_busy_timeout(wdb, 10000);
+  register_functions(wdb);
+  return wdb;
+}
+
+/* A job run on a worker thread.  RUN returns the result, or sets
+   *ERRMSG to a malloc'ed message.  The job is shared by its Lisp
+   object and the thread; whichever lets go last frees it.  */
+struct Lisp_Job {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int refs;
+  bool done;
+  sqlite3_int64 (*run)(void *arg, char **errmsg);
+  void (*free_arg)(void *arg);
+  void *arg;
+  sqlite3_int64 result;
+  char *errmsg;
+  /* If set, makes the Lisp value of the result from ARG.  */
+  emacs_value (*value)(emacs_env *env, void *arg);
+  /* The write end of the notification channel, or -1.  */
+  int fd;
+  /* Global references used to run the callback, main thread only.  */
+  emacs_value object;
+  emacs_value callback;
+  emacs_value notifier;
+};
+
+static
+void
+lisp_job_unref(struct Lisp_Job *job) {
+  pthread_mutex_lock(&job->mutex);
+  int refs = --job->refs;
+  pthread_mutex_unlock(&job->mutex);
+  if (refs > 0)
+    return;
+
+  if (job->free_arg)
+    job->free_arg(job->arg);
+  if (job->fd >= 0)
+    close(job->fd);
+  free(job->errmsg);
+  pthread_mutex_destroy(&job->mutex);
+  pthread_cond_destroy(&job->cond);
+  free(job);
+}
+
+static
+void
+lisp_job_free(void *arg) {
+  lisp_job_unref((struct Lisp_Job *)arg);
+}
+
+static
+void
+lisp_job_complete(struct Lisp_Job *job) {
+  job->result = job->run(job->arg, &job->errmsg);
+
+  pthread_mutex_lock(&job->mutex);
+  job->done = true;
+  pthread_cond_broadcast(&job->cond);
+  if (job->fd >= 0) {
+    /* Wake up the process filter that runs the callback.  */
+    ssize_t ret __attribute__((unused)) = write(job->fd, "\n", 1);
+    close(job->fd);
+    job->fd = -1;
+  }
+  pthread_mutex_unlock(&job->mutex);
+}
+
+static
+void *
+lisp_job_thread(void *arg) {
+  struct Lisp_Job *job = (struct Lisp_Job *)arg;
+  lisp_job_complete(job);
+  lisp_job_unref(job);
+  return NULL;
+}
+
+/* Run the callback of the job DATA once it is done.  This is both the
+   filter of the notification process and, on Emacs versions without
+   `open_channel', a polling timer function.  */
+static
+emacs_value
+lisp_job_notify(emacs_env *env, ptrdiff_t nargs __attribute__((unused)), emacs_value args[] __attribute__((unused)), void *data) {
+  struct Lisp_Job *job = (struct Lisp_Job *)data;
+  pthread_mutex_lock(&job->mutex);
+  bool done = job->done;
+  pthread_mutex_unlock(&job->mutex);
+  if (!done || !job->object)
+    return Q(nil);
+
+  emacs_value object = job->object;
+  emacs_value callback = job->callback;
+  emacs_value notifier = job->notifier;
+  job->object = job->callback = job->notifier = NULL;
+
+  if (TYPEP(notifier, process))
+    call(delete-process, notifier);
+  else
+    call(cancel-timer, notifier);
+  env->funcall(env, callback, 1, &object);
+
+  env->free_global_ref(env, notifier);
+  env->free_global_ref(env, callback);
+  env->free_global_ref(env, object);
+  return Q(nil);
+}
+
+/* Make a job running RUN with ARG, stored in *JOBP, and return its
+   object.  If CALLBACK is non-nil, it is called with the job object
+   once the job is done.  The job is not started.  */
+static
+emacs_value
+lisp_job_make(emacs_env *env, struct Lisp_Job **jobp, sqlite3_int64 (*run)(void *, char **), void *arg,
+              void (*free_arg)(void *), emacs_value callback) {
+  *jobp = NULL;
+  struct Lisp_Job *job = malloc(sizeof(struct Lisp_Job));
+  memset(job, 0, sizeof(struct Lisp_Job));
+  pthread_mutex_init(&job->mutex, NULL);
+  pthread_cond_init(&job->cond, NULL);
+  job->refs = 1;
+  job->run = run;
+  job->arg = arg;
+  job->free_arg = free_arg;
+  job->fd = -1;
+
+  emacs_value object = env->make_user_ptr(env, lisp_job_free, job);
+
+  if (!NILP(callback)) {
+    emacs_value notify = env->make_function(env, 0, 2, lisp_job_notify, NULL, job);
+    emacs_value notifier;
+    if (env->size >= (ptrdiff_t)sizeof(struct emacs_env_28)) {
+      notifier = call(make-pipe-process,
+                      Q(:name), build_string("sqlite-job"),
+                      Q(:noquery), Q(t),
+                      Q(:filter), notify,
+                      Q(:sentinel), Q(ignore));
+      job->fd = env->open_channel(env, notifier);
+    } else {
+      emacs_value interval = env->make_float(env, 0.1);
+      emacs_value args[] = { interval, interval, notify };
+      notifier = env->funcall(env, Q(run-with-timer), 3, args);
+    }
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+      lisp_job_complete(job);
+      return Q(nil);
+    }
+    job->object = env->make_global_ref(env, object);
+    job->callback = env->make_global_ref(env, callback);
+    job->notifier = env->make_global_ref(env, notifier);
+  }
+
+  *jobp = job;
+  return object;
+}
+
+/* Start a job running RUN with ARG, as `lisp_job_make'.  If THREADED
+   is false, the job runs to completion right away, but the callback
+   is still called asynchronously.  */
+static
+emacs_value
+lisp_job_start(emacs_env *env, sqlite3_int64 (*run)(void *, char **), void *arg, void (*free_arg)(void *),
+               emacs_value callback, bool threaded) {
+  struct Lisp_Job *job;
+  emacs_value object = lisp_job_make(env, &job, run, arg, free_arg, callback);
+  if (!job)
+    return Q(nil);
+
+  pthread_t thread;
+  if (threaded) {
+    job->refs++;
+    if (pthread_create(&thread, NULL, lisp_job_thread, job) == 0) {
+      pthread_detach(thread);
+      return object;
+    }
+    job->refs--;
+  }
+
+  lisp_job_complete(job);
+  return object;
+}
+
+static
+struct Lisp_Job *
+lisp_job_check(emacs_env *env, emacs_value job) {
+  if (user_ptr_check(env, job) == lisp_job_free)
+    return env->get_user_ptr(env, job);
+  xsignal(wrong-type-argument, Q(sqlite-job-p), job);
+  return NULL;
+}
+
+static
+emacs_value
+Fsqlite_job_done_p(emacs_env *env, ptrdiff_t nargs __attribute__((unused)), emacs_value args[], void *data __attribute__((unused))) {
+  struct Lisp_Job *job = lisp_job_check(env, args[0]);
+  if (!job)
+    return Q(nil);
+
+  pthread_mutex_lock(&job->mutex);
+  bool done = job->done;
+  pthread_mutex_unlock(&job->mutex);
+  return done ? Q(t) : Q(nil);
+}
+
+static
+emacs_value
+Fsqlite_job_wait(emacs_env *env, ptrdiff_t nargs __attribute__((unused)), emacs_value args[], void *data __attribute__((unused))) {
+  struct Lisp_Job *job = lisp_job_check(env, args[0]);
+  if (!job)
+    return Q(nil);
+
+  pthread_mutex_lock(&job->mutex);
+  while (!job->done)
+    pthread_cond_wait(&job->cond, &job->mutex);
+  pthread_mutex_unlock(&job->mutex);
+
+  if (job->errmsg) {
+    xsignal(error, build_string(job->errmsg));
+    return Q(nil);
+  }
+  if (job->value)
+    return job->value(env, job->arg);
+  return make_int(job->result);
+}
+
+/* Asynchronous queries.  Each connection has a scheduler with two
+   lanes, interactive and background, each with a queue of jobs, a
+   worker thread and a connection of its own.  Queued interactive jobs
+   thus never wait for background ones, and a running background
+   statement pauses at progress handler boundaries while interactive
+   jobs run.  */
+
+#define LANE_INTERACTIVE 0
+#define LANE_BACKGROUND 1
+
+/* VM instructions between calls of the progress handler.  */
+#define SCHEDULER_PROGRESS_STEPS 1000
+/* The longest a background statement pauses at a time, so that the
+   locks it holds cannot stall interactive jobs for good.  */
+#define SCHEDULER_PAUSE_NSEC 50000000
+
+struct Query_Job {
+  struct Lisp_Job *job;
+  struct Query_Job *next;
+  char *sql;
+  char *token;                  /* Printed representation, or NULL.  */
+  int nparams;
+  sqlite3_value **params;
+  sqlite3 *db;                  /* Set by the lane running the job.  */
+  bool cancelled;               /* Guarded by the job's mutex.  */
+  int columns;
+  size_t rows;
+  size_t size;
+  sqlite3_value **values;       /* ROWS * COLUMNS, row-major.  */
+  sqlite3_int64 changes;
+};
+
+struct Scheduler_Lane {
+  struct Scheduler *scheduler;
+  int priority;
+  sqlite3 *db;
+  pthread_t thread;
+  bool started;
+  struct Query_Job *head;
+  struct Query_Job *tail;
+  struct Query_Job *running;
+};
+
+struct Scheduler {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool shutdown;
+  /* A private connection used to convert bound values.  */
+  sqlite3 *binder;
+  struct Scheduler_Lane lanes[2];
+};
+
+static
+void
+query_job_free(void *arg) {
+  struct Query_Job *query = (struct Query_Job *)arg;
+  for (int i = 0; i < query->nparams; ++i)
+    sqlite3_value_free(query->params[i]);
+  for (size_t i = 0; i < query->rows * query->columns; ++i)
+    sqlite3_value_free(query->values[i]);
+  free(query->params);
+  free(query->values);
+  free(query->sql);
+  free(query->token);
+  free(query);
+}
+
+static
+bool
+query_job_cancelled(struct Query_Job *query) {
+  if (!query->job)
+    return false;
+  pthread_mutex_lock(&query->job->mutex);
+  bool cancelled = query->cancelled;
+  pthread_mutex_unlock(&query->job->mutex);
+  return cancelled;
+}
+
+static
+sqlite3_int64
+query_job_run(void *arg, char **errmsg) {
+  struct Query_Job *query = (struct Query_Job *)arg;
+  if (query_job_cancelled(query)) {
+    *errmsg = strdup("Cancelled");
+    return 0;
+  }
+
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(query->db, query->sql, -1, &stmt, NULL) != SQLITE_OK) {
+    *errmsg = strdup(sqlite3_errmsg(query->db));
+    return 0;
+  }
+  for (int i = 0; i < query->nparams; ++i)
+    sqlite3_bind_value(stmt, i + 1, query->params[i]);
+
+  int ret;
+  query->columns = sqlite3_column_count(stmt);
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+    if (query->rows == query->size) {
+      query->size = query->size ? query->size * 2 : 64;
+      query->values = realloc(query->values, query->size * query->columns * sizeof(sqlite3_value *));
+    }
+    sqlite3_value **row = query->values + query->rows * query->columns;
+    for (int i = 0; i < query->columns; ++i)
+      row[i] = sqlite3_value_dup(sqlite3_column_value(stmt, i));
+    query->rows++;
+  }
+  if (ret != SQLITE_DONE)
+    *errmsg = strdup(query_job_cancelled(query) ? "Cancelled" : sqlite3_errmsg(query->db));
+  sqlite3_finalize(stmt);
+  query->changes = sqlite3_changes(query->db);
+  return query->columns ? (sqlite3_int64)query->rows : query->changes;
+}
+
+/* The result of a query job: its rows, or the number of affected rows
+   for statements without any.  */
+static
+emacs_value
+query_job_value(emacs_env *env, void *arg) {
+  struct Query_Job *query = (struct Query_Job *)arg;
+  if (!query->columns)
+    return make_int(query->changes);
+
+  emacs_value rows = Q(nil);
+  for (size_t i = query->rows; i-- > 0; ) {
+    sqlite3_value **row = query->values + i * query->columns;
+    emacs_value values = Q(nil);
+    for (int j = query->columns - 1; j >= 0; --j)
+      values = call(cons, value_to_lisp(env, row[j]), values);
+    rows = call(cons, values, rows);
+  }
+  return rows;
+}
+
+/* Pause a background statement while interactive jobs are queued or
+   running, and stop statements that were cancelled.  A statement that
+   holds a write transaction is not paused, as the interactive job may
+   be waiting for its lock.  */
+static
+int
+scheduler_progress(void *arg) {
+  struct Scheduler_Lane *lane = (struct Scheduler_Lane *)arg;
+  struct Scheduler *scheduler = lane->scheduler;
+  struct Scheduler_Lane *interactive = &scheduler->lanes[LANE_INTERACTIVE];
+
+  bool writing = sqlite3_txn_state(lane->db, NULL) == SQLITE_TXN_WRITE;
+  pthread_mutex_lock(&scheduler->mutex);
+  if (lane->priority == LANE_BACKGROUND && !writing
+      && (interactive->head || interactive->running)) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += SCHEDULER_PAUSE_NSEC;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    while ((interactive->head || interactive->running) && !scheduler->shutdown)
+      if (pthread_cond_timedwait(&scheduler->cond, &scheduler->mutex, &deadline) == ETIMEDOUT)
+        break;
+  }
+  struct Query_Job *query = lane->running;
+  bool stop = scheduler->shutdown;
+  pthread_mutex_unlock(&scheduler->mutex);
+
+  return stop || (query && query_job_cancelled(query));
+}
+
+static
+void *
+scheduler_lane_run(void *arg) {
+  struct Scheduler_Lane *lane = (struct Scheduler_Lane *)arg;
+  struct Scheduler *scheduler = lane->scheduler;
+
+  pthread_mutex_lock(&scheduler->mutex);
+  for (;;) {
+    while (!lane->head && !scheduler->shutdown)
+      pthread_cond_wait(&scheduler->cond, &scheduler->mutex);
+    if (!lane->head)
+      break;
+
+    struct Query_Job *query = lane->head;
+    lane->head = query->next;
+    if (!lane->head)
+      lane->tail = NULL;
+    lane->running = query;
+    pthread_mutex_unlock(&scheduler->mutex);
+
+    query->db = lane->db;
+    lisp_job_complete(query->job);
+
+    pthread_mutex_lock(&scheduler->mutex);
+    lane->running = NULL;
+    /* Resume paused background statements.  */
+    pthread_cond_broadcast(&scheduler->cond);
+    pthread_mutex_unlock(&scheduler->mutex);
+    lisp_job_unref(query->job);
+    pthread_mutex_lock(&scheduler->mutex);
+  }
+  pthread_mutex_unlock(&scheduler->mutex);
+  return NULL;
+}
+
+/* Make the scheduler of connection DB.  Its lanes have no connection,
+   and jobs run right away, if DB is an in-memory database.  */
+static
+struct Scheduler *
+scheduler_make(sqlite3 *db) {
+  struct Scheduler *scheduler = calloc(1, sizeof(struct Scheduler));
+  pthread_mutex_init(&scheduler->mutex, NULL);
+  pthread_cond_init(&scheduler->cond, NULL);
+  sqlite3_open_v2(":memory:", &scheduler->binder, SQLITE_OPEN_READWRITE | SQLITE_OPEN_MEMORY, NULL);
+
+  for (int i = 0; i < 2; ++i) {
+    struct Scheduler_Lane *lane = &scheduler->lanes[i];
+    lane->scheduler = scheduler;
+    lane->priority = i;
+    lane->db = worker_open(db);
+    if (!lane->db)
+      continue;
+    sqlite3_progress_handler(lane->db, SCHEDULER_PROGRESS_STEPS, scheduler_progress, lane);
+    lane->started = pthread_create(&lane->thread, NULL, scheduler_lane_run, lane) == 0;
+    if (!lane->started) {
+      sqlite3_close(lane->db);
+      lane->db = NULL;
+    }
+  }
+  return scheduler;
+}
+
+/* Cancel the jobs of SCHEDULER, stop its threads and free it.  */
+static
+void
+scheduler_free(struct Scheduler *scheduler) {
+  if (!scheduler)
+    return;
+
+  struct Query_Job *queued = NULL;
+  pthread_mutex_lock(&scheduler->mutex);
+  scheduler->shutdown = true;
+  for (int i = 0; i < 2; ++i) {
+    struct Scheduler_Lane *lane = &scheduler->lanes[i];
+    if (lane->tail) {
+      lane->tail->next = queued;
+      queued = lane->head;
+      lane->head = lane->tail = NULL;
+    }
+    if (lane->running)
+      sqlite3_interrupt(lane->db);
+  }
+  pthread_cond_broadcast(&scheduler->cond);
+  pthread_mutex_unlock(&scheduler->mutex);
+
+  while (queued) {
+    struct Query_Job *query = queued;
+    queued = query->next;
+    pthread_mutex_lock(&query->job->mutex);
+    query->cancelled = true;
+    pthread_mutex_unlock(&query->job->mutex);
+    lisp_job_complete(query->job);
+    lisp_job_unref(query->job);
+  }
+
+  for (int i = 0; i < 2; ++i) {
+    struct Scheduler_Lane *lane = &scheduler->lanes[i];
+    if (lane->started)
+      pthread_join(lane->thread, NULL);
+    if (lane->db)
+      sqlite3_close(lane->db);
+  }
+  sqlite3_close(scheduler->binder);
+  pthread_mutex_destroy(&scheduler->mutex);
+  pthread_cond_destroy(&scheduler->cond);
+  free(scheduler);
+}
+
+/* Convert VALUES into SQLite values the way `sqlite-execute' binds
+   them, by selecting them through a statement of BINDER.  */
+static
+const char *
+scheduler_convert_values(emacs_env *env, sqlite3 *binder, emacs_value values, struct Query_Job *query) {
+  bool is_vector = TYPEP(values, vector);
+  int count = (is_vector)?env->vec_size(env, values):XFIXNUM(call(length, values));
+  if (!count)
+    return NULL;
+
+  char *sql = malloc(7 + 2 * count);
+  strcpy(sql, "SELECT ?");
+  for (int i = 1; i < count; ++i)
+    strcat(sql, ",?");
+  sqlite3_stmt *stmt;
+  int ret = sqlite3_prepare_v2(binder, sql, -1, &stmt, NULL);
+  free(sql);
+  if (ret != SQLITE_OK)
+    return sqlite3_errmsg(binder);
+
+  const char *errmsg = bind_values(env, binder, stmt, values);
+  if (!errmsg && sqlite3_step(stmt) == SQLITE_ROW) {
+    query->params = malloc(count * sizeof(sqlite3_value *));
+    query->nparams = count;
+    for (int i = 0; i < count; ++i)
+      query->params[i] = sqlite3_value_dup(sqlite3_column_value(stmt, i));
+  }
+  sqlite3_finalize(stmt);
+  return errmsg;
+}
+
+static
+emacs_value
+Fsqlite_submit(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+
+  if (!CHECK_STRING(env, args[1]))
+    return Q(nil);
+
+  ptrdiff_t positional = positional_args(env, nargs, args, 2);
+  emacs_value values = (positional > 2) ? args[2] : Q(nil);
+  emacs_value priority = keyword_arg(env, nargs, args, positional, ":priority");
+  emacs_value callback = keyword_arg(env, nargs, args, positional, ":callback");
+  emacs_value token = keyword_arg(env, nargs, args, positional, ":token");
+
+  int lane_index;
+  if (NILP(priority) || EQ(priority, Q(interactive))) {
+    lane_index = LANE_INTERACTIVE;
+  } else if (EQ(priority, Q(background))) {
+    lane_index = LANE_BACKGROUND;
+  } else {
+    xsignal(error, build_string("PRIORITY must be interactive or background"), priority);
+    return Q(nil);
+  }
+
+  if (!ptr->scheduler)
+    ptr->scheduler = scheduler_make(ptr->db);
+  struct Scheduler *scheduler = ptr->scheduler;
+
+  struct Query_Job *query = calloc(1, sizeof(struct Query_Job));
+  query->sql = copy_string(env, args[1]);
+  if (!NILP(token))
+    query->token = copy_string(env, call(format, build_string("%S"), token));
+  const char *errmsg = NILP(values) ? NULL : scheduler_convert_values(env, scheduler->binder, values, query);
+  if (errmsg) {
+    query_job_free(query);
+    xsignal(error, build_string(errmsg));
+    return Q(nil);
+  }
+
+  /* Jobs that cannot be queued run on DB itself.  */
+  query->db = ptr->db;
+  struct Lisp_Job *job;
+  emacs_value object = lisp_job_make(env, &job, query_job_run, query, query_job_free, callback);
+  if (!job)
+    return Q(nil);
+  job->value = query_job_value;
+  query->job = job;
+
+  struct Scheduler_Lane *lane = &scheduler->lanes[lane_index];
+  if (!lane->db) {
+    /* Nothing else can see an in-memory database.  */
+    lisp_job_complete(job);
+    return object;
+  }
+
+  pthread_mutex_lock(&scheduler->mutex);
+  job->refs++;
+  if (lane->tail)
+    lane->tail->next = query;
+  else
+    lane->head = query;
+  lane->tail = query;
+  pthread_cond_broadcast(&scheduler->cond);
+  pthread_mutex_unlock(&scheduler->mutex);
+  return object;
+}
+
+/* Cancel QUERY, which must be queued or running.  */
+static
+void
+scheduler_cancel_query(struct Query_Job *query) {
+  pthread_mutex_lock(&query->job->mutex);
+  query->cancelled = true;
+  pthread_mutex_unlock(&query->job->mutex);
+}
+
+static
+emacs_value
+Fsqlite_cancel(emacs_env *env, ptrdiff_t nargs __attribute__((unused)), emacs_value args[], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+  struct Scheduler *scheduler = ptr->scheduler;
+  if (!scheduler)
+    return make_int(0);
+
+  struct Lisp_Job *target = NULL;
+  char *token = NULL;
+  if (user_ptr_check(env, args[1]) == lisp_job_free)
+    target = env->get_user_ptr(env, args[1]);
+  else
+    token = copy_string(env, call(format, build_string("%S"), args[1]));
+
+  int count = 0;
+  struct Query_Job *removed = NULL;
+  pthread_mutex_lock(&scheduler->mutex);
+  for (int i = 0; i < 2; ++i) {
+    struct Scheduler_Lane *lane = &scheduler->lanes[i];
+    struct Query_Job **link = &lane->head;
+    lane->tail = NULL;
+    while (*link) {
+      struct Query_Job *query = *link;
+      if (query->job == target || (token && query->token && !strcmp(query->token, token))) {
+        *link = query->next;
+        query->next = removed;
+        removed = query;
+        count++;
+      } else {
+        lane->tail = query;
+        link = &query->next;
+      }
+    }
+
+    struct Query_Job *query = lane->running;
+    if (query && (query->job == target || (token && query->token && !strcmp(query->token, token)))) {
+      scheduler_cancel_query(query);
+      count++;
+    }
+  }
+  pthread_mutex_unlock(&scheduler->mutex);
+  free(token);
+
+  while (removed) {
+    struct Query_Job *query = removed;
+    removed = query->next;
+    scheduler_cancel_query(query);
+    lisp_job_complete(query->job);
+    lisp_job_unref(query->job);
+  }
+  return make_int(count);
+}
+
+/* Bulk full-text indexing.  Files are read, split into chunks at
+   line boundaries and inserted as (path, content) rows into an FTS
+   table, replacing the rows previously indexed for the same paths.
+   Each batch of files is written in one transaction, or in one
+   savepoint inside a transaction of the user.  */
+
+#define FTS_BATCH_FILES 256
+
+static int write_group_begin(sqlite3 *db, bool *own);
+static int write_group_end(sqlite3 *db, bool own, bool commit);
+
+struct Fts_Index {
+  /* The connection to use, and whether it belongs to the job.  */
+  sqlite3 *db;
+  bool own_db;
+  char *table;
+  int chunk_size;
+  ptrdiff_t count;
+  char **paths;
+  /* The text of each path, or NULL to read it from the file.  */
+  char **texts;
+};
+
+static
+void
+fts_index_free(void *arg) {
+  struct Fts_Index *index = (struct Fts_Index *)arg;
+  if (index->own_db)
+    sqlite3_close(index->db);
+  for (ptrdiff_t i = 0; i < index->count; ++i) {
+    free(index->paths[i]);
+    if (index->texts)
+      free(index->texts[i]);
+  }
+  free(index->paths);
+  free(index->texts);
+  free(index->table);
+  free(index);
+}
+
+static
+char *
+read_file(const char *path, size_t *size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  char *text = NULL;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    text = malloc(st.st_size + 1);
+    size_t len = 0;
+    ssize_t n;
+    while (len < (size_t)st.st_size && (n = read(fd, text + len, st.st_size - len)) > 0)
+      len += n;
+    text[len] = '\0';
+    *size = len;
+  }
+  close(fd);
+  return text;
+}
+
+/* Insert TEXT in chunks of about CHUNK_SIZE bytes, broken after a
+   newline where possible and never inside a UTF-8 sequence.  */
+static
+int
+fts_insert_chunks(sqlite3_stmt *insert, const char *path, const char *text, size_t size, int chunk_size) {
+  size_t start = 0;
+  do {
+    size_t end = size;
+    if (chunk_size > 0 && size - start > (size_t)chunk_size) {
+      end = start + chunk_size;
+      const char *nl = NULL;
+      for (const char *p = text + end - 1; p > text + start; --p) {
+        if (*p == '\n') {
+          nl = p;
+          break;
+        }
+      }
+      if (nl)
+        end = nl - text + 1;
+      else
+        while (end > start + 1 && (text[end] & 0xC0) == 0x80)
+          --end;
+    }
+
+    sqlite3_reset(insert);
+    sqlite3_bind_text(insert, 1, path, -1, SQLITE_STATIC);
+    sqlite3_bind_text(insert, 2, text + start, end - start, SQLITE_STATIC);
+    if (sqlite3_step(insert) != SQLITE_DONE)
+      return SQLITE_ERROR;
+    start = end;
+  } while (start < size);
+  return SQLITE_OK;
+}
+
+static
+sqlite3_int64
+fts_index_run(void *arg, char **errmsg) {
+  struct Fts_Index *index = (struct Fts_Index *)arg;
+  sqlite3 *db = index->db;
+  sqlite3_stmt *insert = NULL, *remove = NULL, *remember = NULL;
+  sqlite3_int64 indexed = 0;
+  bool in_transaction = false;
+  bool own = true;
+
+  char *sql = sqlite3_mprintf("INSERT INTO \"%w\"(path, content) VALUES (?, ?)", index->table);
+  int ret = sqlite3_prepare_v2(db, sql, -1, &insert, NULL);
+  sqlite3_free(sql);
+  if (ret == SQLITE_OK)
+    ret = sqlite3_exec(db, "CREATE TEMP TABLE IF NOT EXISTS fts_index_paths (path TEXT PRIMARY KEY)", NULL, NULL, NULL);
+  if (ret == SQLITE_OK)
+    ret = sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO temp.fts_index_paths VALUES (?)", -1, &remember, NULL);
+  if (ret == SQLITE_OK) {
+    sql = sqlite3_mprintf("DELETE FROM \"%w\" WHERE path IN temp.fts_index_paths", index->table);
+    ret = sqlite3_prepare_v2(db, sql, -1, &remove, NULL);
+    sqlite3_free(sql);
+  }
+
+  for (ptrdiff_t batch = 0; ret == SQLITE_OK && batch < index->count; batch += FTS_BATCH_FILES) {
+    ptrdiff_t end = batch + FTS_BATCH_FILES < index->count ? batch + FTS_BATCH_FILES : index->count;
+
+    ret = write_group_begin(db, &own);
+    if (ret != SQLITE_OK)
+      break;
+    in_transaction = true;
+
+    /* Drop the old rows of the whole batch in one pass over the
+       table, rather than one pass per file.  */
+    sqlite3_exec(db, "DELETE FROM temp.fts_index_paths", NULL, NULL, NULL);
+    for (ptrdiff_t i = batch; ret == SQLITE_OK && i < end; ++i) {
+      sqlite3_reset(remember);
+      sqlite3_bind_text(remember, 1, index->paths[i], -1, SQLITE_STATIC);
+      ret = sqlite3_step(remember) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+    }
+    if (ret == SQLITE_OK) {
+      sqlite3_reset(remove);
+      ret = sqlite3_step(remove) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+    }
+
+    for (ptrdiff_t i = batch; ret == SQLITE_OK && i < end; ++i) {
+      size_t size;
+      char *text;
+      if (index->texts) {
+        text = index->texts[i];
+        size = strlen(text);
+      } else if (!(text = read_file(index->paths[i], &size))) {
+        /* Unreadable files are skipped, their old rows stay deleted.  */
+        continue;
+      }
+
+      ret = fts_insert_chunks(insert, index->paths[i], text, size, index->chunk_size);
+      if (!index->texts)
+        free(text);
+      if (ret == SQLITE_OK)
+        ++indexed;
+    }
+
+    if (ret == SQLITE_OK) {
+      ret = write_group_end(db, own, true);
+      in_transaction = ret != SQLITE_OK;
+    }
+  }
+
+  if (ret != SQLITE_OK)
+    *errmsg = strdup(sqlite3_errmsg(db));
+  if (in_transaction)
+    write_group_end(db, own, false);
+  sqlite3_finalize(insert);
+  sqlite3_finalize(remove);
+  sqlite3_finalize(remember);
+  return indexed;
+}
+
+/* Start indexing INDEX on DB as described by the keyword arguments in
+   ARGS[START..NARGS).  */
+static
+emacs_value
+fts_index_start(emacs_env *env, sqlite3 *db, struct Fts_Index *index, ptrdiff_t nargs, emacs_value *args, ptrdiff_t start) {
+  emacs_value chunk_size = keyword_arg(env, nargs, args, start, ":chunk-size");
+  index->chunk_size = NILP(chunk_size) ? 4096 : XFIXNUM(chunk_size);
+  if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+    fts_index_free(index);
+    return Q(nil);
+  }
+
+  bool async = !NILP(keyword_arg(env, nargs, args, start, ":async"));
+  emacs_value callback = keyword_arg(env, nargs, args, start, ":callback");
+  if (async) {
+    index->db = worker_open(db);
+    index->own_db = index->db != NULL;
+  }
+  if (!index->db)
+    index->db = db;
+
+  if (!async) {
+    char *errmsg = NULL;
+    sqlite3_int64 indexed = fts_index_run(index, &errmsg);
+    fts_index_free(index);
+    if (errmsg) {
+      xsignal(error, build_string(errmsg));
+      free(errmsg);
+      return Q(nil);
+    }
+    return make_int(indexed);
+  }
+
+  return lisp_job_start(env, fts_index_run, index, fts_index_free, callback, index->own_db);
+}
+
+static
+emacs_value
+Fsqlite_fts_index_files(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+
+  if(!CHECK_STRING(env, args[1]))
+    return Q(nil);
+
+  emacs_value files = args[2];
+  bool is_vector = TYPEP(files, vector);
+  ptrdiff_t count = (is_vector)?env->vec_size(env, files):XFIXNUM(call(length, files));
+
+  struct Fts_Index *index = malloc(sizeof(struct Fts_Index));
+  memset(index, 0, sizeof(struct Fts_Index));
+  index->table = copy_string(env, args[1]);
+  index->paths = malloc(count * sizeof(char *));
+
+  for (ptrdiff_t i = 0; i < count; ++i) {
+    emacs_value file;
+    if (is_vector) {
+      file = env->vec_get(env, files, i);
+    } else {
+      file = call(car, files);
+      files = call(cdr, files);
+    }
+    if (!CHECK_STRING(env, file)) {
+      fts_index_free(index);
+      return Q(nil);
+    }
+    index->paths[index->count++] = copy_string(env, call(expand-file-name, file, Q(nil)));
+  }
+
+  return fts_index_start(env, ptr->db, index, nargs, args, 3);
+}
+
+static
+emacs_value
+Fsqlite_fts_index_buffer(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+
+  if(!CHECK_STRING(env, args[1]))
+    return Q(nil);
+
+  emacs_value buffer = call(get-buffer, args[2]);
+  if (NILP(buffer)) {
+    xsignal(error, build_string("No such buffer"), args[2]);
+    return Q(nil);
+  }
+
+  emacs_value path = keyword_arg(env, nargs, args, 3, ":path");
+  emacs_value old = call0(current-buffer);
+  call(set-buffer, buffer);
+  if (NILP(path))
+    path = call0(buffer-file-name);
+  if (NILP(path))
+    path = call0(buffer-name);
+  emacs_value text = call(buffer-substring-no-properties, call0(point-min), call0(point-max));
+  restore_buffer(env, old);
+  if (env->non_local_exit_check(env) != emacs_funcall_exit_return)
+    return Q(nil);
+
+  struct Fts_Index *index = malloc(sizeof(struct Fts_Index));
+  memset(index, 0, sizeof(struct Fts_Index));
+  index->table = copy_string(env, args[1]);
+  index->count = 1;
+  index->paths = malloc(sizeof(char *));
+  index->texts = malloc(sizeof(char *));
+  index->paths[0] = copy_string(env, path);
+  index->texts[0] = copy_string(env, text);
+
+  return fts_index_start(env, ptr->db, index, nargs, args, 3);
+}
+
+static
+emacs_value
+Fsqlite_fts_offsets(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+
+  if(!CHECK_STRING(env, args[1]) || !CHECK_STRING(env, args[2]))
+    return Q(nil);
+
+  emacs_value limit = keyword_arg(env, nargs, args, 3, ":limit");
+
+  char *table = copy_string(env, args[1]);
+  char *sql = sqlite3_mprintf("SELECT rowid, match_offsets(\"%w\") FROM \"%w\" WHERE \"%w\" MATCH ?"
+                              " ORDER BY rank LIMIT ?",
+                              table, table, table);
+  free(table);
+
+  sqlite3_stmt *stmt = NULL;
+  int ret = sqlite3_prepare_v2(ptr->db, sql, -1, &stmt, NULL);
+  sqlite3_free(sql);
+  if (ret != SQLITE_OK) {
+    xsignal(error, build_string(sqlite3_errmsg(ptr->db)));
+    return Q(nil);
+  }
+
+  char *query = copy_string(env, args[2]);
+  sqlite3_bind_text(stmt, 1, query, -1, free);
+  sqlite3_bind_int64(stmt, 2, NILP(limit) ? -1 : XFIXNUM(limit));
+
+  emacs_value retval = Q(nil);
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const int32_t *offsets = sqlite3_column_blob(stmt, 1);
+    int len = sqlite3_column_bytes(stmt, 1) / sizeof(int32_t);
+    emacs_value vector = call(make-vector, make_int(len), make_int(0));
+    for (int i = 0; i < len; ++i)
+      env->vec_set(env, vector, i, make_int(offsets[i]));
+    retval = call(cons, call(cons, make_int(sqlite3_column_int64(stmt, 0)), vector), retval);
+  }
+
+  if (ret != SQLITE_DONE) {
+    xsignal(error, build_string(sqlite3_errmsg(ptr->db)));
+    sqlite3_finalize(stmt);
+    return Q(nil);
+  }
+
+  sqlite3_finalize(stmt);
+  return call(nreverse, retval);
+}
+
+/* Directory indexing.  A tree is walked with fts(3) on a worker
+   thread and the path, size, modification time and inode of its
+   regular files are upserted into a table.  The rows already in the
+   table for the tree are loaded first, so unchanged files cost no
+   write and rows of files that disappeared are deleted.  */
+
+struct File_Entry {
+  char *path;
+  uint64_t hash;
+  double mtime;
+  sqlite3_int64 size;
+  sqlite3_int64 inode;
+  bool seen;
+};
+
+struct File_Table {
+  size_t count;
+  size_t size;                  /* A power of two.  */
+  struct File_Entry *entries;
+};
+
+static
+struct File_Entry *
+file_table_lookup(struct File_Table *table, const char *path, bool insert) {
+  if (insert && (table->count + 1) * 2 > table->size) {
+    struct File_Table grown = { 0, table->size ? table->size * 2 : 1024, NULL };
+    grown.entries = calloc(grown.size, sizeof(struct File_Entry));
+    for (size_t i = 0; i < table->size; ++i) {
+      struct File_Entry *old = &table->entries[i];
+      if (!old->path)
+        continue;
+      size_t j = old->hash & (grown.size - 1);
+      while (grown.entries[j].path)
+        j = (j + 1) & (grown.size - 1);
+      grown.entries[j] = *old;
+      grown.count++;
+    }
+    free(table->entries);
+    *table = grown;
+  }
+  if (table->size == 0)
+    return NULL;
+
+  uint64_t hash = hash_bytes(path, strlen(path));
+  size_t i = hash & (table->size - 1);
+  while (table->entries[i].path) {
+    if (table->entries[i].hash == hash && strcmp(table->entries[i].path, path) == 0)
+      return &table->entries[i];
+    i = (i + 1) & (table->size - 1);
+  }
+  if (!insert)
+    return NULL;
+
+  table->entries[i].path = strdup(path);
+  table->entries[i].hash = hash;
+  table->count++;
+  return &table->entries[i];
+}
+
+static
+void
+file_table_free(struct File_Table *table) {
+  for (size_t i = 0; i < table->size; ++i)
+    free(table->entries[i].path);
+  free(table->entries);
+}
+
+struct Directory_Index {
+  sqlite3 *db;
+  bool own_db;
+  char *dir;
+  char *table;
+  regex_t *match;
+  regex_t *exclude;
+};
+
+static
+void
+directory_index_free(void *arg) {
+  struct Directory_Index *index = (struct Directory_Index *)arg;
+  if (index->own_db)
+    sqlite3_close(index->db);
+  if (index->match)
+    regexp_free(index->match);
+  if (index->exclude)
+    regexp_free(index->exclude);
+  free(index->dir);
+  free(index->table);
+  free(index);
+}
+
+#define DIRECTORY_BATCH_ROWS 1000
+
+static
+sqlite3_int64
+directory_index_run(void *arg, char **errmsg) {
+  struct Directory_Index *index = (struct Directory_Index *)arg;
+  sqlite3 *db = index->db;
+  sqlite3_stmt *select = NULL, *upsert = NULL, *remove = NULL;
+  struct File_Table files = { 0, 0, NULL };
+  sqlite3_int64 changes = 0;
+  int batch = 0;
+  FTS *fts = NULL;
+  char *unreadable = NULL;
+
+  char *sql = sqlite3_mprintf("CREATE TABLE IF NOT EXISTS \"%w\" "
+                              "(path TEXT PRIMARY KEY, size INTEGER, mtime REAL, inode INTEGER)",
+                              index->table);
+  int ret = sqlite3_exec(db, sql, NULL, NULL, NULL);
+  sqlite3_free(sql);
+
+  /* The rows under DIR sort between "DIR/" and "DIR0", where DIR has
+     no trailing slash, which only "/" can still have here.  */
+  int dir_len = strlen(index->dir);
+  while (dir_len > 0 && index->dir[dir_len - 1] == '/')
+    --dir_len;
+  char *low = sqlite3_mprintf("%.*s/", dir_len, index->dir);
+  char *high = sqlite3_mprintf("%.*s0", dir_len, index->dir);
+  if (ret == SQLITE_OK) {
+    sql = sqlite3_mprintf("SELECT path, size, mtime, inode FROM \"%w\" WHERE path >= ? AND path < ?", index->table);
+    ret = sqlite3_prepare_v2(db, sql, -1, &select, NULL);
+    sqlite3_free(sql);
+  }
+  if (ret == SQLITE_OK) {
+    sqlite3_bind_text(select, 1, low, -1, SQLITE_STATIC);
+    sqlite3_bind_text(select, 2, high, -1, SQLITE_STATIC);
+    while ((ret = sqlite3_step(select)) == SQLITE_ROW) {
+      struct File_Entry *entry = file_table_lookup(&files, (const char *)sqlite3_column_text(select, 0), true);
+      entry->size = sqlite3_column_int64(select, 1);
+      entry->mtime = sqlite3_column_double(select, 2);
+      entry->inode = sqlite3_column_int64(select, 3);
+    }
+    ret = (ret == SQLITE_DONE) ? SQLITE_OK : ret;
+  }
+  if (ret == SQLITE_OK) {
+    sql = sqlite3_mprintf("INSERT INTO \"%w\"(path, size, mtime, inode) VALUES (?, ?, ?, ?) "
+                          "ON CONFLICT(path) DO UPDATE SET "
+                          "size = excluded.size, mtime = excluded.mtime, inode = excluded.inode",
+                          index->table);
+    ret = sqlite3_prepare_v2(db, sql, -1, &upsert, NULL);
+    sqlite3_free(sql);
+  }
+  if (ret == SQLITE_OK) {
+    sql = sqlite3_mprintf("DELETE FROM \"%w\" WHERE path = ?", index->table);
+    ret = sqlite3_prepare_v2(db, sql, -1, &remove, NULL);
+    sqlite3_free(sql);
+  }
+
+  if (ret == SQLITE_OK) {
+    char *roots[] = { index->dir, NULL };
+    fts = fts_open(roots, FTS_PHYSICAL | FTS_NOCHDIR, NULL);
+    if (!fts) {
+      *errmsg = strdup(strerror(errno));
+      goto exit;
+    }
+  }
+
+  FTSENT *ent;
+  while (ret == SQLITE_OK && fts && (ent = fts_read(fts))) {
+    /* A DIR that cannot be read is not empty: its rows are kept.  */
+    if (ent->fts_level == 0 && ent->fts_info != FTS_D && ent->fts_info != FTS_DP) {
+      int error = (ent->fts_info == FTS_NS || ent->fts_info == FTS_DNR || ent->fts_info == FTS_ERR)
+        ? ent->fts_errno : ENOTDIR;
+      char *message = sqlite3_mprintf("%s: %s", index->dir, strerror(error));
+      *errmsg = strdup(message);
+      sqlite3_free(message);
+      goto exit;
+    }
+    if (ent->fts_info == FTS_D) {
+      if (ent->fts_level > 0 && index->exclude
+          && regexec(index->exclude, ent->fts_name, 0, NULL, 0) == 0)
+        fts_set(fts, ent, FTS_SKIP);
+      continue;
+    }
+    /* Neither are the files under a directory that cannot be read, or
+       a file that cannot be stat'ed: their rows are kept, and the job
+       fails once the rest is indexed.  */
+    if (ent->fts_info == FTS_DNR || ent->fts_info == FTS_ERR || ent->fts_info == FTS_NS) {
+      if (index->exclude && regexec(index->exclude, ent->fts_name, 0, NULL, 0) == 0)
+        continue;
+      size_t len = ent->fts_pathlen;
+      for (size_t i = 0; i < files.size; ++i) {
+        struct File_Entry *entry = &files.entries[i];
+        if (entry->path && strncmp(entry->path, ent->fts_path, len) == 0
+            && (entry->path[len] == '\0' || entry->path[len] == '/'))
+          entry->seen = true;
+      }
+      if (!unreadable)
+        unreadable = sqlite3_mprintf("%s: %s", ent->fts_path, strerror(ent->fts_errno));
+      continue;
+    }
+    if (ent->fts_info != FTS_F)
+      continue;
+    if (index->match && regexec(index->match, ent->fts_name, 0, NULL, 0) != 0)
+      continue;
+    if (index->exclude && regexec(index->exclude, ent->fts_name, 0, NULL, 0) == 0)
+      continue;
+
+    const struct stat *st = ent->fts_statp;
+    double mtime = st->st_mtim.tv_sec + st->st_mtim.tv_nsec / 1e9;
+    struct File_Entry *entry = file_table_lookup(&files, ent->fts_path, false);
+    if (entry) {
+      entry->seen = true;
+      if (entry->mtime == mtime && entry->size == st->st_size && entry->inode == (sqlite3_int64)st->st_ino)
+        continue;
+    }
+
+    if (batch == 0)
+      ret = sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+    if (ret != SQLITE_OK)
+      break;
+    sqlite3_reset(upsert);
+    sqlite3_bind_text(upsert, 1, ent->fts_path, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(upsert, 2, st->st_size);
+    sqlite3_bind_double(upsert, 3, mtime);
+    sqlite3_bind_int64(upsert, 4, st->st_ino);
+    if (sqlite3_step(upsert) != SQLITE_DONE) {
+      ret = SQLITE_ERROR;
+      break;
+    }
+    ++changes;
+    if (++batch == DIRECTORY_BATCH_ROWS) {
+      ret = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+      batch = 0;
+    }
+  }
+
+  /* Whatever was not seen is gone.  */
+  for (size_t i = 0; ret == SQLITE_OK && i < files.size; ++i) {
+    struct File_Entry *entry = &files.entries[i];
+    if (!entry->path || entry->seen)
+      continue;
+
+    if (batch == 0)
+      ret = sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+    if (ret != SQLITE_OK)
+      break;
+    sqlite3_reset(remove);
+    sqlite3_bind_text(remove, 1, entry->path, -1, SQLITE_STATIC);
+    if (sqlite3_step(remove) != SQLITE_DONE) {
+      ret = SQLITE_ERROR;
+      break;
+    }
+    ++changes;
+    if (++batch == DIRECTORY_BATCH_ROWS) {
+      ret = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+      batch = 0;
+    }
+  }
+
+  if (ret == SQLITE_OK && batch > 0) {
+    ret = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    batch = 0;
+  }
+
+  if (ret != SQLITE_OK)
+    *errmsg = strdup(sqlite3_errmsg(db));
+  else if (unreadable)
+    *errmsg = strdup(unreadable);
+ exit:
+  sqlite3_free(unreadable);
+  if (batch > 0)
+    sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+  if (fts)
+    fts_close(fts);
+  file_table_free(&files);
+  sqlite3_finalize(select);
+  sqlite3_finalize(upsert);
+  sqlite3_finalize(remove);
+  sqlite3_free(low);
+  sqlite3_free(high);
+  return changes;
+}
+
+/* Compile the Emacs regexp REGEXP, or signal an error.  */
+static
+regex_t *
+compile_regexp(emacs_env *env, emacs_value regexp) {
+  char *pattern = copy_string(env, regexp);
+  char *posix = emacs_regexp_to_posix(pattern, strlen(pattern));
+  free(pattern);
+  if (!posix) {
+    xsignal(error, build_string("Unsupported regexp construct"), regexp);
+    return NULL;
+  }
+
+  regex_t *re = malloc(sizeof(regex_t));
+  int ret = regcomp(re, posix, REG_EXTENDED | REG_NOSUB);
+  free(posix);
+  if (ret) {
+    char errbuf[256];
+    regerror(ret, re, errbuf, sizeof(errbuf));
+    free(re);
+    xsignal(invalid-regexp, build_string(errbuf));
+    return NULL;
+  }
+  return re;
+}
+
+static
+emacs_value
+Fsqlite_index_directory(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+
+  if(!CHECK_STRING(env, args[1]) || !CHECK_STRING(env, args[2]))
+    return Q(nil);
+
+  struct Directory_Index *index = malloc(sizeof(struct Directory_Index));
+  memset(index, 0, sizeof(struct Directory_Index));
+  index->dir = copy_string(env, call(directory-file-name, call(expand-file-name, args[1], Q(nil))));
+  index->table = copy_string(env, args[2]);
+
+  emacs_value match = keyword_arg(env, nargs, args, 3, ":match");
+  emacs_value exclude = keyword_arg(env, nargs, args, 3, ":exclude");
+  if ((!NILP(match) && !(index->match = compile_regexp(env, match)))
+      || (!NILP(exclude) && !(index->exclude = compile_regexp(env, exclude)))) {
+    directory_index_free(index);
+    return Q(nil);
+  }
+
+  index->db = worker_open(ptr->db);
+  index->own_db = index->db != NULL;
+  if (!index->db)
+    index->db = ptr->db;
+
+  return lisp_job_start(env, directory_index_run, index, directory_index_free,
+                        keyword_arg(env, nargs, args, 3, ":callback"), index->own_db);
+}
+
+/* Sharded queries.  The same statement is run on every shard by a
+   thread of its own.  Rows are copied out as protected values so the
+   threads never touch Lisp, then concatenated in shard order or
+   merged on a key column by the main thread.  */
+
+struct Shard_Query {
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  int columns;
+  size_t rows;
+  size_t size;
+  sqlite3_value **values;       /* ROWS * COLUMNS, row-major.  */
+  char *errmsg;
+  pthread_t thread;
+  bool started;
+};
+
+static
+void *
+shard_query_run(void *arg) {
+  struct Shard_Query *query = (struct Shard_Query *)arg;
+  int ret;
+  while ((ret = sqlite3_step(query->stmt)) == SQLITE_ROW) {
+    if (query->rows == query->size) {
+      query->size = query->size ? query->size * 2 : 64;
+      query->values = realloc(query->values, query->size * query->columns * sizeof(sqlite3_value *));
+    }
+    sqlite3_value **row = query->values + query->rows * query->columns;
+    for (int i = 0; i < query->columns; ++i)
+      row[i] = sqlite3_value_dup(sqlite3_column_value(query->stmt, i));
+    query->rows++;
+  }
+  if (ret != SQLITE_DONE)
+    query->errmsg = strdup(sqlite3_errmsg(query->db));
+  return NULL;
+}
+
+/* Compare values the way ORDER BY does with the BINARY collation.  */
+static
+int
+compare_values(sqlite3_value *a, sqlite3_value *b) {
+  int ta = sqlite3_value_type(a), tb = sqlite3_value_type(b);
+  int ra = (ta == SQLITE_NULL) ? 0 : (ta == SQLITE_INTEGER || ta == SQLITE_FLOAT) ? 1 : (ta == SQLITE_TEXT) ? 2 : 3;
+  int rb = (tb == SQLITE_NULL) ? 0 : (tb == SQLITE_INTEGER || tb == SQLITE_FLOAT) ? 1 : (tb == SQLITE_TEXT) ? 2 : 3;
+  if (ra != rb)
+    return ra - rb;
+
+  switch (ra) {
+  case 0:
+    return 0;
+  case 1:
+    if (ta == SQLITE_INTEGER && tb == SQLITE_INTEGER) {
+      sqlite3_int64 x = sqlite3_value_int64(a), y = sqlite3_value_int64(b);
+      return (x > y) - (x < y);
+    } else {
+      double x = sqlite3_value_double(a), y = sqlite3_value_double(b);
+      return (x > y) - (x < y);
+    }
+  default: {
+    const void *x = (ra == 2) ? (const void *)sqlite3_value_text(a) : sqlite3_value_blob(a);
+    const void *y = (rb == 2) ? (const void *)sqlite3_value_text(b) : sqlite3_value_blob(b);
+    int lx = sqlite3_value_bytes(a), ly = sqlite3_value_bytes(b);
+    int ret = memcmp(x, y, lx < ly ? lx : ly);
+    return ret ? ret : lx - ly;
+  }
+  }
+}
+
+static
+emacs_value
+shard_row_to_value(emacs_env *env, sqlite3_value **row, int columns) {
+  emacs_value values = Q(nil);
+  for (int i = columns - 1; i >= 0; --i)
+    values = call(cons, value_to_lisp(env, row[i]), values);
+  return values;
+}
+
+static
+emacs_value
+Fsqlite_open_shards(emacs_env *env, ptrdiff_t nargs __attribute__((unused)), emacs_value args[], void *data __attribute__((unused))) {
+  int flags = (SQLITE_OPEN_CREATE  | SQLITE_OPEN_READWRITE);
+#ifdef SQLITE_OPEN_FULLMUTEX
+  flags |= SQLITE_OPEN_FULLMUTEX;
+#endif
+#ifdef SQLITE_OPEN_URI
+  flags |= SQLITE_OPEN_URI;
+#endif
+
+  emacs_value files = args[0];
+  bool is_vector = TYPEP(files, vector);
+  int count = (is_vector)?env->vec_size(env, files):XFIXNUM(call(length, files));
+
+  struct Lisp_Shards *ptr = malloc(sizeof(struct Lisp_Shards));
+  ptr->count = 0;
+  ptr->dbs = malloc(count * sizeof(sqlite3 *));
+
+  for (int i = 0; i < count; ++i) {
+    emacs_value file;
+    if (is_vector) {
+      file = env->vec_get(env, files, i);
+    } else {
+      file = call(car, files);
+      files = call(cdr, files);
+    }
+    if (!CHECK_STRING(env, file)) {
+      lisp_shards_free(ptr);
+      return Q(nil);
+    }
+
+    char *encoded = copy_string(env, call(expand-file-name, file, Q(nil)));
+    int ret = sqlite3_open_v2(encoded, &ptr->dbs[i], flags, NULL);
+    free(encoded);
+    if (ret != SQLITE_OK) {
+      sqlite3_close(ptr->dbs[i]);
+      lisp_shards_free(ptr);
+      xsignal(error, build_string("Could not open shard"), file);
+      return Q(nil);
+    }
+    ptr->count++;
+    register_functions(ptr->dbs[i]);
+  }
+
+  return env->make_user_ptr(env, lisp_shards_free, ptr);
+}
+
+static
+emacs_value
+Fsqlite_shards_p(emacs_env *env, ptrdiff_t nargs __attribute__((unused)), emacs_value args[], void *data __attribute__((unused))) {
+  return (user_ptr_check(env, args[0]) == lisp_shards_free) ? Q(t) : Q(nil);
+}
+
+static
+emacs_value
+Fsqlite_shards_select(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  if (user_ptr_check(env, args[0]) != lisp_shards_free) {
+    xsignal(wrong-type-argument, Q(sqlite-shards-p), args[0]);
+    return Q(nil);
+  }
+  struct Lisp_Shards *ptr = env->get_user_ptr(env, args[0]);
+  if (!ptr->dbs) {
+    xsignal(error, build_string("Database closed"));
+    return Q(nil);
+  }
+  enter_env(env);
+
+  if(!CHECK_STRING(env, args[1]))
+    return Q(nil);
+
+  emacs_value values = (nargs > 2) ? args[2] : Q(nil);
+  emacs_value order_by = keyword_arg(env, nargs, args, 3, ":order-by");
+  bool descending = !NILP(keyword_arg(env, nargs, args, 3, ":descending"));
+  emacs_value limit = keyword_arg(env, nargs, args, 3, ":limit");
+
+  char *sql = copy_string(env, args[1]);
+  struct Shard_Query *queries = calloc(ptr->count, sizeof(struct Shard_Query));
+  const char *errmsg = NULL;
+  int i;
+
+  for (i = 0; i < ptr->count; ++i) {
+    queries[i].db = ptr->dbs[i];
+    if (sqlite3_prepare_v2(ptr->dbs[i], sql, -1, &queries[i].stmt, NULL) != SQLITE_OK) {
+      errmsg = sqlite3_errmsg(ptr->dbs[i]);
+      break;
+    }
+    queries[i].columns = sqlite3_column_count(queries[i].stmt);
+    if (!NILP(values) && (errmsg = bind_values(env, ptr->dbs[i], queries[i].stmt, values)))
+      break;
+  }
+  free(sql);
+
+  /* Step the shards in parallel, the first one in this thread.  */
+  for (int j = 1; !errmsg && j < ptr->count; ++j)
+    queries[j].started = pthread_create(&queries[j].thread, NULL, shard_query_run, &queries[j]) == 0;
+  if (!errmsg && ptr->count > 0)
+    shard_query_run(&queries[0]);
+  for (int j = 1; j < ptr->count; ++j) {
+    if (queries[j].started)
+      pthread_join(queries[j].thread, NULL);
+    else if (!errmsg && queries[j].stmt)
+      shard_query_run(&queries[j]);
+  }
+  for (int j = 0; !errmsg && j < ptr->count; ++j)
+    if (queries[j].errmsg)
+      errmsg = queries[j].errmsg;
+
+  int key = -1;
+  if (!errmsg && !NILP(order_by) && ptr->count > 0) {
+    if (TYPEP(order_by, integer)) {
+      key = XFIXNUM(order_by);
+    } else if (TYPEP(order_by, string)) {
+      char *name = copy_string(env, order_by);
+      for (int c = 0; c < queries[0].columns; ++c)
+        if (strcmp(sqlite3_column_name(queries[0].stmt, c), name) == 0)
+          key = c;
+      free(name);
+    }
+    if (key < 0 || key >= queries[0].columns)
+      errmsg = "Invalid ORDER-BY column";
+  }
+
+  emacs_value retval = Q(nil);
+  if (!errmsg) {
+    intmax_t remaining = NILP(limit) ? -1 : XFIXNUM(limit);
+    if (key < 0) {
+      for (int j = 0; j < ptr->count; ++j)
+        for (size_t r = 0; r < queries[j].rows && remaining != 0; ++r, --remaining)
+          retval = call(cons, shard_row_to_value(env, queries[j].values + r * queries[j].columns, queries[j].columns), retval);
+    } else {
+      /* K-way merge of the shard results, each sorted on KEY.  */
+      size_t *next = calloc(ptr->count, sizeof(size_t));
+      for (; remaining != 0; --remaining) {
+        int best = -1;
+        sqlite3_value **best_row = NULL;
+        for (int j = 0; j < ptr->count; ++j) {
+          if (next[j] >= queries[j].rows)
+            continue;
+          sqlite3_value **row = queries[j].values + next[j] * queries[j].columns;
+          if (best < 0) {
+            best = j;
+            best_row = row;
+          } else {
+            int cmp = compare_values(row[key], best_row[key]);
+            if (descending ? cmp > 0 : cmp < 0) {
+              best = j;
+              best_row = row;
+            }
+          }
+        }
+        if (best < 0)
+          break;
+        retval = call(cons, shard_row_to_value(env, best_row, queries[best].columns), retval);
+        next[best]++;
+      }
+      free(next);
+    }
+    retval = call(nreverse, retval);
+  } else {
+    xsignal(error, build_string(errmsg));
+  }
+
+  for (int j = 0; j < ptr->count; ++j) {
+    for (size_t v = 0; v < queries[j].rows * queries[j].columns; ++v)
+      sqlite3_value_free(queries[j].values[v]);
+    free(queries[j].values);
+    free(queries[j].errmsg);
+    sqlite3_finalize(queries[j].stmt);
+  }
+  free(queries);
+  return retval;
+}
+
+/* Sessions.  A connection records at most one session, which is
+   deleted when the connection is closed.  The session functions are
+   weak, so they are NULL if SQLite was built without them.  */
+
+static
+bool
+session_check(emacs_env *env) {
+  if (sqlite3session_create)
+    return true;
+  xsignal(error, build_string("SQLite was built without the session extension"));
+  return false;
+}
+
+static
+emacs_value
+Fsqlite_session_start(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+  if (!session_check(env))
+    return Q(nil);
+  /* It would record the changes of every handle.  */
+  if (ptr->shared) {
+    xsignal(error, build_string("Sessions are not available on shared connections"));
+    return Q(nil);
+  }
+
+  if (ptr->session) {
+    sqlite3session_delete(ptr->session);
+    ptr->session = NULL;
+  }
+
+  sqlite3_session *session;
+  if (sqlite3session_create(ptr->db, "main", &session) != SQLITE_OK) {
+    xsignal(error, build_string(sqlite3_errmsg(ptr->db)));
+    return Q(nil);
+  }
+
+  emacs_value tables = (nargs > 1) ? args[1] : Q(nil);
+  int ret = SQLITE_OK;
+  if (NILP(tables)) {
+    ret = sqlite3session_attach(session, NULL);
+  } else {
+    bool is_vector = TYPEP(tables, vector);
+    int len = (is_vector)?env->vec_size(env, tables):XFIXNUM(call(length, tables));
+    for (int i = 0; ret == SQLITE_OK && i < len; ++i) {
+      emacs_value table;
+      if (is_vector) {
+        table = env->vec_get(env, tables, i);
+      } else {
+        table = call(car, tables);
+        tables = call(cdr, tables);
+      }
+      if (!CHECK_STRING(env, table)) {
+        sqlite3session_delete(session);
+        return Q(nil);
+      }
+      char *name = copy_string(env, table);
+      ret = sqlite3session_attach(session, name);
+      free(name);
+    }
+  }
+
+  if (ret != SQLITE_OK) {
+    sqlite3session_delete(session);
+    xsignal(error, build_string(sqlite3_errstr(ret)));
+    return Q(nil);
+  }
+
+  ptr->session = session;
+  return Q(t);
+}
+
+static
+emacs_value
+Fsqlite_session_changeset(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+  if (!ptr->session) {
+    xsignal(error, build_string("No session started"));
+    return Q(nil);
+  }
+
+  int size = 0;
+  void *changeset = NULL;
+  int ret = sqlite3session_changeset(ptr->session, &size, &changeset);
+  if (ret != SQLITE_OK) {
+    xsignal(error, build_string(sqlite3_errstr(ret)));
+    return Q(nil);
+  }
+
+  emacs_value retval = env->make_unibyte_string(env, changeset, size);
+  sqlite3_free(changeset);
+
+  if (nargs > 1 && !NILP(args[1])) {
+    sqlite3session_delete(ptr->session);
+    ptr->session = NULL;
+  }
+  return retval;
+}
+
+struct Changeset_Apply {
+  emacs_env *env;
+  emacs_value handler;
+  bool failed;
+};
+
+static
+emacs_value
+changeset_row(emacs_env *env, sqlite3_changeset_iter *iter, int columns) {
+  emacs_value values = Q(nil);
+  for (int i = columns - 1; i >= 0; --i) {
+    sqlite3_value *value = NULL;
+    sqlite3changeset_conflict(iter, i, &value);
+    values = call(cons, value ? value_to_lisp(env, value) : Q(nil), values);
+  }
+  return values;
+}
+
+static
+int
+changeset_conflict(void *arg, int type, sqlite3_changeset_iter *iter) {
+  struct Changeset_Apply *apply = (struct Changeset_Apply *)arg;
+  emacs_env *env = apply->env;
+  if (apply->failed)
+    return SQLITE_CHANGESET_ABORT;
+  if (NILP(apply->handler))
+    return SQLITE_CHANGESET_OMIT;
+
+  const char *table;
+  int columns, op, indirect;
+  sqlite3changeset_op(iter, &table, &columns, &op, &indirect);
+
+  emacs_value kind;
+  switch (type) {
+  case SQLITE_CHANGESET_DATA: kind = Q(data); break;
+  case SQLITE_CHANGESET_NOTFOUND: kind = Q(notfound); break;
+  case SQLITE_CHANGESET_CONFLICT: kind = Q(conflict); break;
+  case SQLITE_CHANGESET_CONSTRAINT: kind = Q(constraint); break;
+  default: kind = Q(foreign-key); break;
+  }
+  emacs_value operation = (op == SQLITE_INSERT) ? Q(insert) : (op == SQLITE_DELETE) ? Q(delete) : Q(update);
+  emacs_value row = (type == SQLITE_CHANGESET_DATA || type == SQLITE_CHANGESET_CONFLICT) ? changeset_row(env, iter, columns) : Q(nil);
+
+  emacs_env *saved_env = current_env;
+  emacs_value action = call(funcall, apply->handler, kind, build_string(table), operation, row);
+  current_env = saved_env;
+
+  if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+    apply->failed = true;
+    return SQLITE_CHANGESET_ABORT;
+  }
+  if (EQ(action, Q(replace)) && (type == SQLITE_CHANGESET_DATA || type == SQLITE_CHANGESET_CONFLICT))
+    return SQLITE_CHANGESET_REPLACE;
+  if (EQ(action, Q(abort)))
+    return SQLITE_CHANGESET_ABORT;
+  return SQLITE_CHANGESET_OMIT;
+}
+
+static
+emacs_value
+Fsqlite_changeset_apply(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+  if (!session_check(env))
+    return Q(nil);
+  if (!CHECK_STRING(env, args[1]))
+    return Q(nil);
+  if (!NILP(call(multibyte-string-p, args[1]))) {
+    xsignal(error, build_string("Changesets must be unibyte strings"));
+    return Q(nil);
+  }
+
+  ptrdiff_t size = 0;
+  env->copy_string_contents(env, args[1], NULL, &size);
+  char *changeset = malloc(size);
+  env->copy_string_contents(env, args[1], changeset, &size);
+
+  struct Changeset_Apply apply = {
+    env, keyword_arg(env, nargs, args, 2, ":conflict-handler"), false
+  };
+  int ret = sqlite3changeset_apply(ptr->db, size - 1, changeset, NULL, changeset_conflict, &apply);
+  free(changeset);
+
+  if (apply.failed)
+    return Q(nil);
+  if (ret != SQLITE_OK) {
+    xsignal(error, build_string((ret == SQLITE_ABORT) ? "Changeset aborted" : sqlite3_errmsg(ptr->db)));
+    return Q(nil);
+  }
+  return Q(t);
+}
+
+/* Result digests for `sqlite-select-diff'.  A digest maps the key of
+   each row of a result to a hash of the whole row.  */
+
+struct Digest_Entry {
+  sqlite3_value *key;
+  uint64_t hash;                /* Of the key.  */
+  uint64_t row;
+};
+
+struct Lisp_Digest {
+  size_t count;
+  size_t size;                  /* A power of two.  */
+  struct Digest_Entry *entries;
+};
+
+static
+void
+lisp_digest_free(void *arg) {
+  struct Lisp_Digest *digest = (struct Lisp_Digest *)arg;
+  for (size_t i = 0; i < digest->size; ++i)
+    if (digest->entries[i].key)
+      sqlite3_value_free(digest->entries[i].key);
+  free(digest->entries);
+  free(digest);
+}
+
+/* Hash VALUE into HASH.  Integral floats hash like integers, so that
+   keys equal under `compare_values' hash the same.  */
+static
+uint64_t
+hash_value(uint64_t hash, sqlite3_value *value) {
+  int type = sqlite3_value_type(value);
+  const void *data = NULL;
+  size_t len = 0;
+  sqlite3_int64 i;
+  double d;
+
+  if (type == SQLITE_FLOAT) {
+    d = sqlite3_value_double(value);
+    /* The cast is only defined for values in range, and not for NaN.  */
+    if (d >= -0x1p63 && d < 0x1p63 && d == (double)(sqlite3_int64)d) {
+      type = SQLITE_INTEGER;
+      i = (sqlite3_int64)d;
+    } else {
+      data = &d;
+      len = sizeof(d);
+    }
+  } else if (type == SQLITE_INTEGER) {
+    i = sqlite3_value_int64(value);
+  } else if (type != SQLITE_NULL) {
+    data = (type == SQLITE_TEXT) ? (const void *)sqlite3_value_text(value) : sqlite3_value_blob(value);
+    len = sqlite3_value_bytes(value);
+  }
+  if (type == SQLITE_INTEGER) {
+    data = &i;
+    len = sizeof(i);
+  }
+
+  hash ^= (uint64_t)type;
+  hash *= 0x100000001b3ULL;
+  const unsigned char *s = data;
+  for (size_t j = 0; j < len; ++j) {
+    hash ^= s[j];
+    hash *= 0x100000001b3ULL;
+  }
+  /* Separate adjacent values.  */
+  hash ^= len;
+  hash *= 0x100000001b3ULL;
+  return hash;
+}
+
+static
+struct Digest_Entry *
+digest_lookup(struct Lisp_Digest *digest, sqlite3_value *key, uint64_t hash, bool insert) {
+  if (insert && (digest->count + 1) * 2 > digest->size) {
+    struct Lisp_Digest grown = { 0, digest->size ? digest->size * 2 : 64, NULL };
+    grown.entries = calloc(grown.size, sizeof(struct Digest_Entry));
+    for (size_t i = 0; i < digest->size; ++i) {
+      struct Digest_Entry *old = &digest->entries[i];
+      if (!old->key)
+        continue;
+      size_t j = old->hash & (grown.size - 1);
+      while (grown.entries[j].key)
+        j = (j + 1) & (grown.size - 1);
+      grown.entries[j] = *old;
+      grown.count++;
+    }
+    free(digest->entries);
+    *digest = grown;
+  }
+  if (digest->size == 0)
+    return NULL;
+
+  size_t i = hash & (digest->size - 1);
+  while (digest->entries[i].key) {
+    if (digest->entries[i].hash == hash && compare_values(digest->entries[i].key, key) == 0)
+      return &digest->entries[i];
+    i = (i + 1) & (digest->size - 1);
+  }
+  if (!insert)
+    return NULL;
+
+  digest->entries[i].key = sqlite3_value_dup(key);
+  digest->entries[i].hash = hash;
+  digest->count++;
+  return &digest->entries[i];
+}
+
+static
+emacs_value
+Fsqlite_select_diff(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+
+  if(!CHECK_STRING(env, args[1]))
+    return Q(nil);
+
+  struct Lisp_Digest *previous = NULL;
+  if (nargs > 3 && !NILP(args[3])) {
+    if (user_ptr_check(env, args[3]) != lisp_digest_free) {
+      xsignal(wrong-type-argument, Q(sqlite-diff-token-p), args[3]);
+      return Q(nil);
+    }
+    previous = env->get_user_ptr(env, args[3]);
+  }
+  emacs_value key_arg = keyword_arg(env, nargs, args, 4, ":key");
+
+  char *sql = copy_string(env, args[1]);
+  sqlite3_stmt *stmt = NULL;
+  int ret = sqlite3_prepare_v2(ptr->db, sql, -1, &stmt, NULL);
+  free(sql);
+  if (ret != SQLITE_OK) {
+    xsignal(error, build_string(sqlite3_errmsg(ptr->db)));
+    return Q(nil);
+  }
+
+  const char *errmsg = NULL;
+  if (nargs > 2 && !NILP(args[2]))
+    errmsg = bind_values(env, ptr->db, stmt, args[2]);
+
+  int columns = sqlite3_column_count(stmt);
+  int key = 0;
+  if (TYPEP(key_arg, integer)) {
+    key = XFIXNUM(key_arg);
+  } else if (TYPEP(key_arg, string)) {
+    char *name = copy_string(env, key_arg);
+    key = -1;
+    for (int c = 0; c < columns; ++c)
+      if (strcmp(sqlite3_column_name(stmt, c), name) == 0)
+        key = c;
+    free(name);
+  }
+  if (!errmsg && (key < 0 || key >= columns))
+    errmsg = "Invalid KEY column";
+
+  struct Lisp_Digest *digest = calloc(1, sizeof(struct Lisp_Digest));
+  emacs_value inserted = Q(nil), updated = Q(nil), deleted = Q(nil);
+
+  while (!errmsg && (ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+    sqlite3_value *key_value = sqlite3_column_value(stmt, key);
+    uint64_t hash = hash_value(0xcbf29ce484222325ULL, key_value);
+    uint64_t row = 0xcbf29ce484222325ULL;
+    for (int c = 0; c < columns; ++c) {
+      sqlite3_value *value = sqlite3_column_value(stmt, c);
+      /* Unlike keys, a column changing from 1 to 1.0 is an update.  */
+      row ^= (uint64_t)sqlite3_value_type(value);
+      row *= 0x100000001b3ULL;
+      row = hash_value(row, value);
+    }
+
+    struct Digest_Entry *entry = digest_lookup(digest, key_value, hash, true);
+    if (entry->row != 0) {
+      errmsg = "Duplicate KEY in result";
+      break;
+    }
+    entry->row = row | 1;
+
+    struct Digest_Entry *old = previous ? digest_lookup(previous, key_value, hash, false) : NULL;
+    if (!old)
+      inserted = call(cons, row_to_value(env, stmt, NULL), inserted);
+    else if (old->row != entry->row)
+      updated = call(cons, row_to_value(env, stmt, NULL), updated);
+  }
+  if (!errmsg && ret != SQLITE_DONE)
+    errmsg = sqlite3_errmsg(ptr->db);
+
+  if (errmsg) {
+    xsignal(error, build_string(errmsg));
+    sqlite3_finalize(stmt);
+    lisp_digest_free(digest);
+    return Q(nil);
+  }
+  sqlite3_finalize(stmt);
+
+  if (previous) {
+    for (size_t i = previous->size; i-- > 0;) {
+      struct Digest_Entry *old = &previous->entries[i];
+      if (old->key && !digest_lookup(digest, old->key, old->hash, false))
+        deleted = call(cons, value_to_lisp(env, old->key), deleted);
+    }
+  }
+
+  return call(list,
+              env->make_user_ptr(env, lisp_digest_free, digest),
+              call(nreverse, inserted),
+              call(nreverse, updated),
+              deleted);
+}
+
+/* Keyset pagination.  A cursor wraps QUERY as
+
+     SELECT * FROM (QUERY) WHERE (k1, k2) > (?, ?) ORDER BY k1, k2 LIMIT ?
+
+   and remembers the keys of the first and last rows of the current
+   page, so every page is a seek in an index instead of a scan past
+   OFFSET rows.  The statements come from the connection's cache.  */
+
+struct Lisp_Cursor {
+  emacs_value db;               /* Global reference.  */
+  emacs_value values;           /* Global reference.  */
+  int keys;
+  int *key_columns;
+  int page_size;
+  char *sql_first;
+  char *sql_next;
+  char *sql_prev;
+  sqlite3_value **first;        /* KEYS values, or NULL.  */
+  sqlite3_value **last;
+};
+
+static
+void
+cursor_keys_free(sqlite3_value **keys, int count) {
+  if (!keys)
+    return;
+  for (int i = 0; i < count; ++i)
+    sqlite3_value_free(keys[i]);
+  free(keys);
+}
+
+static
+void
+lisp_cursor_free(void *arg) {
+  struct Lisp_Cursor *cursor = (struct Lisp_Cursor *)arg;
+  if (cursor->db) {
+    stale_ref_push(cursor->db);
+    stale_ref_push(cursor->values);
+  }
+  sqlite3_free(cursor->sql_first);
+  sqlite3_free(cursor->sql_next);
+  sqlite3_free(cursor->sql_prev);
+  free(cursor->key_columns);
+  cursor_keys_free(cursor->first, cursor->keys);
+  cursor_keys_free(cursor->last, cursor->keys);
+  free(cursor);
+}
+
+/* Store the SQL of the first, next and previous page queries of
+   CURSOR over QUERY, ordered by the column names in KEYS.  */
+static
+bool
+cursor_build_sql(emacs_env *env, struct Lisp_Cursor *cursor, const char *query, emacs_value keys, bool descending) {
+  sqlite3_str *columns = sqlite3_str_new(NULL);
+  sqlite3_str *params = sqlite3_str_new(NULL);
+  sqlite3_str *order = sqlite3_str_new(NULL);
+  sqlite3_str *reverse = sqlite3_str_new(NULL);
+
+  for (int i = 0; i < cursor->keys; ++i) {
+    emacs_value key = call(car, keys);
+    keys = call(cdr, keys);
+    if (!CHECK_STRING(env, key))
+      break;
+    char *name = copy_string(env, key);
+    const char *sep = i ? ", " : "";
+    sqlite3_str_appendf(columns, "%s\"%w\"", sep, name);
+    sqlite3_str_appendf(params, "%s?", sep);
+    sqlite3_str_appendf(order, "%s\"%w\"%s", sep, name, descending ? " DESC" : "");
+    sqlite3_str_appendf(reverse, "%s\"%w\"%s", sep, name, descending ? "" : " DESC");
+    free(name);
+  }
+
+  char *c = sqlite3_str_finish(columns);
+  char *p = sqlite3_str_finish(params);
+  char *o = sqlite3_str_finish(order);
+  char *r = sqlite3_str_finish(reverse);
+  bool ok = env->non_local_exit_check(env) == emacs_funcall_exit_return;
+  if (ok) {
+    cursor->sql_first = sqlite3_mprintf("SELECT * FROM (%s) ORDER BY %s LIMIT ?", query, o);
+    cursor->sql_next = sqlite3_mprintf("SELECT * FROM (%s) WHERE (%s) %s (%s) ORDER BY %s LIMIT ?",
+                                       query, c, descending ? "<" : ">", p, o);
+    cursor->sql_prev = sqlite3_mprintf("SELECT * FROM (%s) WHERE (%s) %s (%s) ORDER BY %s LIMIT ?",
+                                       query, c, descending ? ">" : "<", p, r);
+  }
+  sqlite3_free(c);
+  sqlite3_free(p);
+  sqlite3_free(o);
+  sqlite3_free(r);
+  return ok;
+}
+
+static
+struct Lisp_Cursor *
+lisp_cursor_check(emacs_env *env, emacs_value cursor) {
+  if (user_ptr_check(env, cursor) != lisp_cursor_free) {
+    xsignal(wrong-type-argument, Q(sqlite-cursor-p), cursor);
+    return NULL;
+  }
+  return env->get_user_ptr(env, cursor);
+}
+
+/* Fetch a page after the last row (if FORWARD) or before the first row
+   of the current page of CURSOR.  */
+static
+emacs_value
+cursor_page(emacs_env *env, emacs_value object, bool forward) {
+  struct Lisp_Cursor *cursor = lisp_cursor_check(env, object);
+  if (!cursor)
+    return Q(nil);
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, cursor->db);
+  if (!ptr)
+    return Q(nil);
+
+  sqlite3_value **from = forward ? cursor->last : cursor->first;
+  if (!forward && !from)
+    return Q(nil);
+  const char *sql = !from ? cursor->sql_first : forward ? cursor->sql_next : cursor->sql_prev;
+
+  int ret;
+  sqlite3_stmt *stmt = statement_cache_prepare(ptr->db, ptr->cache, sql, &ret);
+  if (ret != SQLITE_OK) {
+    xsignal(error, build_string(sqlite3_errmsg(ptr->db)));
+    return Q(nil);
+  }
+
+  const char *errmsg = NULL;
+  if (!NILP(cursor->values))
+    errmsg = bind_values(env, ptr->db, stmt, cursor->values);
+
+  /* The key and limit parameters follow those of the query.  */
+  int param = sqlite3_bind_parameter_count(stmt) - (from ? cursor->keys : 0);
+  for (int i = 0; !errmsg && from && i < cursor->keys; ++i)
+    if (sqlite3_bind_value(stmt, param + i, from[i]) != SQLITE_OK)
+      errmsg = sqlite3_errmsg(ptr->db);
+  if (!errmsg && sqlite3_bind_int(stmt, sqlite3_bind_parameter_count(stmt), cursor->page_size) != SQLITE_OK)
+    errmsg = sqlite3_errmsg(ptr->db);
+
+  emacs_value rows = Q(nil);
+  sqlite3_value **first = NULL, **last = NULL;
+  while (!errmsg && (ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+    rows = call(cons, row_to_value(env, stmt, NULL), rows);
+    sqlite3_value ***keys = forward ? &last : &first;
+    if (!*keys)
+      *keys = calloc(cursor->keys, sizeof(sqlite3_value *));
+    for (int i = 0; i < cursor->keys; ++i) {
+      sqlite3_value_free((*keys)[i]);
+      (*keys)[i] = sqlite3_value_dup(sqlite3_column_value(stmt, cursor->key_columns[i]));
+    }
+    if (!(forward ? first : last)) {
+      sqlite3_value **other = calloc(cursor->keys, sizeof(sqlite3_value *));
+      for (int i = 0; i < cursor->keys; ++i)
+        other[i] = sqlite3_value_dup(sqlite3_column_value(stmt, cursor->key_columns[i]));
+      if (forward)
+        first = other;
+      else
+        last = other;
+    }
+  }
+  if (!errmsg && ret != SQLITE_DONE)
+    errmsg = sqlite3_errmsg(ptr->db);
+  statement_cache_release(ptr->cache, stmt);
+
+  if (errmsg) {
+    cursor_keys_free(first, cursor->keys);
+    cursor_keys_free(last, cursor->keys);
+    xsignal(error, build_string(errmsg));
+    return Q(nil);
+  }
+
+  /* At either end, stay on the current page.  */
+  if (first) {
+    cursor_keys_free(cursor->first, cursor->keys);
+    cursor_keys_free(cursor->last, cursor->keys);
+    cursor->first = first;
+    cursor->last = last;
+  }
+  return forward ? call(nreverse, rows) : rows;
+}
+
+static
+emacs_value
+Fsqlite_cursor(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+  if (!CHECK_STRING(env, args[1]))
+    return Q(nil);
+
+  emacs_value keys = args[3];
+  if (TYPEP(keys, string))
+    keys = call(list, keys);
+  int count = XFIXNUM(call(length, keys));
+  if (count == 0) {
+    xsignal(error, build_string("A cursor needs at least one key column"));
+    return Q(nil);
+  }
+  emacs_value page_size = keyword_arg(env, nargs, args, 4, ":page-size");
+  bool descending = !NILP(keyword_arg(env, nargs, args, 4, ":descending"));
+  /* A page of no rows would never advance, and a negative LIMIT has
+     none.  */
+  intmax_t rows = NILP(page_size) ? 100 : XFIXNUM(page_size);
+  if (env->non_local_exit_check(env) != emacs_funcall_exit_return)
+    return Q(nil);
+  if (rows < 1 || rows > INT_MAX) {
+    xsignal(error, build_string("PAGE-SIZE must be a positive integer"), page_size);
+    return Q(nil);
+  }
+
+  struct Lisp_Cursor *cursor = calloc(1, sizeof(struct Lisp_Cursor));
+  cursor->keys = count;
+  cursor->page_size = rows;
+
+  /* Strip a trailing semicolon, which would end the subquery.  */
+  char *query = copy_string(env, args[1]);
+  size_t len = strlen(query);
+  while (len > 0 && (query[len - 1] == ';' || query[len - 1] == ' ' || query[len - 1] == '\n'))
+    query[--len] = '\0';
+  bool ok = cursor_build_sql(env, cursor, query, keys, descending);
+  free(query);
+
+  /* Check the query and the key names now rather than on the first
+     page.  */
+  sqlite3_stmt *stmt = NULL;
+  if (ok && sqlite3_prepare_v2(ptr->db, cursor->sql_next, -1, &stmt, NULL) != SQLITE_OK) {
+    xsignal(error, build_string(sqlite3_errmsg(ptr->db)));
+    ok = false;
+  }
+  if (ok) {
+    cursor->key_columns = malloc(count * sizeof(int));
+    for (int i = 0; i < count; ++i, keys = call(cdr, keys)) {
+      emacs_value key = call(car, keys);
+      char *name = copy_string(env, key);
+      cursor->key_columns[i] = -1;
+      for (int c = 0; c < sqlite3_column_count(stmt); ++c)
+        if (strcmp(sqlite3_column_name(stmt, c), name) == 0)
+          cursor->key_columns[i] = c;
+      free(name);
+      if (cursor->key_columns[i] < 0) {
+        xsignal(error, build_string("No such key column"), key);
+        ok = false;
+        break;
+      }
+    }
+  }
+  sqlite3_finalize(stmt);
+
+  if (!ok) {
+    lisp_cursor_free(cursor);
+    return Q(nil);
+  }
+  cursor->db = env->make_global_ref(env, args[0]);
+  cursor->values = env->make_global_ref(env, args[2]);
+  return env->make_user_ptr(env, lisp_cursor_free, cursor);
+}
+
+static
+emacs_value
+Fsqlite_cursor_next_page(emacs_env *env, ptrdiff_t nargs __attribute__((unused)), emacs_value args[], void *data __attribute__((unused))) {
+  return cursor_page(env, args[0], true);
+}
+
+static
+emacs_value
+Fsqlite_cursor_prev_page(emacs_env *env, ptrdiff_t nargs __attribute__((unused)), emacs_value args[], void *data __attribute__((unused))) {
+  return cursor_page(env, args[0], false);
+}
+
+/* The extensions `sqlite-load-extension' agrees to load, as in Emacs
+   29, plus a few that are commonly built alongside them.  */
+static const char *extension_allowlist[] = {
+  "base64", "cksumvfs", "compress", "csv", "csvtable", "fts3", "icu",
+  "math", "pcre", "percentile", "regexp", "rot13", "rtree", "sha1",
+  "spellfix", "spellfix1", "uuid", "vec0", "vector0", "vfslog", "vss0",
+  "zipfile", NULL
+};
+
+static
+bool
+extension_allowed(const char *file) {
+  const char *base = strrchr(file, '/');
+  base = base ? base + 1 : file;
+  if (strncmp(base, "libsqlite3_mod_", 15) == 0)
+    base += 15;
+  else if (strncmp(base, "lib", 3) == 0)
+    base += 3;
+
+  for (const char **name = extension_allowlist; *name; ++name) {
+    size_t len = strlen(*name);
+    if (strncmp(base, *name, len) == 0 && (base[len] == '\0' || base[len] == '.'))
+      return true;
+  }
+  return false;
+}
+
+static
+emacs_value
+Fsqlite_load_extension(emacs_env *env, ptrdiff_t nargs __attribute__((unused)), emacs_value args[], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+  if (!CHECK_STRING(env, args[1]))
+    return Q(nil);
+
+  char *file = copy_string(env, call(expand-file-name, args[1], Q(nil)));
+  if (!extension_allowed(file)) {
+    free(file);
+    xsignal(error, build_string("Module name not on allowlist"), args[1]);
+    return Q(nil);
+  }
+
+  /* Only allow the C interface, and only while loading, so SQL cannot
+     call load_extension().  */
+  int ret = sqlite3_db_config(ptr->db, SQLITE_DBCONFIG_ENABLE_LOAD_EXTENSION, 1, NULL);
+  if (ret == SQLITE_OK) {
+    ret = sqlite3_load_extension(ptr->db, file, NULL, NULL);
+    sqlite3_db_config(ptr->db, SQLITE_DBCONFIG_ENABLE_LOAD_EXTENSION, 0, NULL);
+  }
+  free(file);
+  return (ret == SQLITE_OK) ? Q(t) : Q(nil);
+}
+
+/* EXPLAIN ANALYZE.  The plan tree comes from EXPLAIN QUERY PLAN; the
+   statement is then run to completion and its loops are annotated
+   with the counters of `sqlite3_stmt_scanstatus', when SQLite was
+   built with SQLITE_ENABLE_STMT_SCANSTATUS.  */
+
+struct Plan_Node {
+  int id;
+  int parent;
+  char *detail;
+  bool measured;
+  sqlite3_int64 loops;
+  sqlite3_int64 rows;
+  double estimate;
+  sqlite3_int64 cycles;         /* -1 if unknown.  */
+};
+
+static
+emacs_value
+plist_cons(emacs_env *env, const char *key, emacs_value value, emacs_value plist) {
+  return call(cons, env->intern(env, key), call(cons, value, plist));
+}
+
+static
+emacs_value
+plan_tree(emacs_env *env, struct Plan_Node *nodes, int count, int parent) {
+  emacs_value children = Q(nil);
+  for (int i = count - 1; i >= 0; --i) {
+    if (nodes[i].parent != parent)
+      continue;
+    struct Plan_Node *node = &nodes[i];
+    emacs_value plist = plist_cons(env, ":children", plan_tree(env, nodes, count, node->id), Q(nil));
+    if (node->measured) {
+      if (node->cycles >= 0)
+        plist = plist_cons(env, ":cycles", make_int(node->cycles), plist);
+      plist = plist_cons(env, ":estimate", env->make_float(env, node->estimate), plist);
+      plist = plist_cons(env, ":rows", make_int(node->rows), plist);
+      plist = plist_cons(env, ":loops", make_int(node->loops), plist);
+    }
+    plist = plist_cons(env, ":detail", build_string(node->detail), plist);
+    plist = plist_cons(env, ":id", make_int(node->id), plist);
+    children = call(cons, plist, children);
+  }
+  return children;
+}
+
+/* Attach the scan counters of STMT to the matching NODES.  */
+static
+void
+plan_scanstatus(sqlite3_stmt *stmt, struct Plan_Node *nodes, int count) {
+  if (!sqlite3_stmt_scanstatus)
+    return;
+
+  for (int idx = 0; ; ++idx) {
+    sqlite3_int64 loops, rows;
+    double estimate;
+    const char *explain = NULL;
+    if (sqlite3_stmt_scanstatus(stmt, idx, SQLITE_SCANSTAT_NLOOP, &loops) != 0)
+      break;
+    sqlite3_stmt_scanstatus(stmt, idx, SQLITE_SCANSTAT_NVISIT, &rows);
+    sqlite3_stmt_scanstatus(stmt, idx, SQLITE_SCANSTAT_EST, &estimate);
+    sqlite3_stmt_scanstatus(stmt, idx, SQLITE_SCANSTAT_EXPLAIN, &explain);
+    sqlite3_int64 cycles = -1;
+    struct Plan_Node *node = NULL;
+
+#ifdef SQLITE_SCANSTAT_NCYCLE
+    /* Since 3.42 the select id is the EXPLAIN QUERY PLAN id.  */
+    if (sqlite3_stmt_scanstatus_v2) {
+      int id = -1;
+      sqlite3_stmt_scanstatus_v2(stmt, idx, SQLITE_SCANSTAT_SELECTID, SQLITE_SCANSTAT_COMPLEX, &id);
+      sqlite3_stmt_scanstatus_v2(stmt, idx, SQLITE_SCANSTAT_NCYCLE, SQLITE_SCANSTAT_COMPLEX, &cycles);
+      for (int i = 0; !node && i < count; ++i)
+        if (nodes[i].id == id)
+          node = &nodes[i];
+    }
+#endif
+    for (int i = 0; !node && explain && i < count; ++i)
+      if (!nodes[i].measured && strcmp(nodes[i].detail, explain) == 0)
+        node = &nodes[i];
+    if (!node)
+      continue;
+
+    node->measured = true;
+    node->loops = loops;
+    node->rows = rows;
+    node->estimate = estimate;
+    node->cycles = cycles;
+  }
+}
+
+static
+emacs_value
+Fsqlite_explain_analyze(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+  if (!CHECK_STRING(env, args[1]))
+    return Q(nil);
+  emacs_value values = (nargs > 2) ? args[2] : Q(nil);
+
+  char *sql = copy_string(env, args[1]);
+  char *eqp = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", sql);
+  sqlite3_stmt *plan = NULL, *stmt = NULL;
+  const char *errmsg = NULL;
+  struct Plan_Node *nodes = NULL;
+  int count = 0, size = 0, ret;
+
+  if (sqlite3_prepare_v2(ptr->db, eqp, -1, &plan, NULL) != SQLITE_OK
+      || sqlite3_prepare_v2(ptr->db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    errmsg = sqlite3_errmsg(ptr->db);
+  sqlite3_free(eqp);
+  free(sql);
+  if (!errmsg && !stmt)
+    errmsg = "Empty query";
+
+  if (!errmsg && !NILP(values))
+    errmsg = bind_values(env, ptr->db, plan, values);
+  while (!errmsg && (ret = sqlite3_step(plan)) == SQLITE_ROW) {
+    if (count == size) {
+      size = size ? size * 2 : 16;
+      nodes = realloc(nodes, size * sizeof(struct Plan_Node));
+    }
+    struct Plan_Node *node = &nodes[count++];
+    memset(node, 0, sizeof(struct Plan_Node));
+    node->id = sqlite3_column_int(plan, 0);
+    node->parent = sqlite3_column_int(plan, 1);
+    node->detail = strdup((const char *)sqlite3_column_text(plan, 3));
+  }
+  if (!errmsg && ret != SQLITE_DONE)
+    errmsg = sqlite3_errmsg(ptr->db);
+
+  /* Run the statement, discarding the rows.  */
+  sqlite3_int64 rows = 0;
+  struct timespec start, end;
+  if (!errmsg && !NILP(values))
+    errmsg = bind_values(env, ptr->db, stmt, values);
+  if (!errmsg) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+      ++rows;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (ret != SQLITE_DONE)
+      errmsg = sqlite3_errmsg(ptr->db);
+  }
+
+  emacs_value retval = Q(nil);
+  if (!errmsg) {
+    plan_scanstatus(stmt, nodes, count);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    retval = plist_cons(env, ":plan", plan_tree(env, nodes, count, 0), Q(nil));
+    retval = plist_cons(env, ":autoindex", make_int(sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 0)), retval);
+    retval = plist_cons(env, ":sorts", make_int(sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 0)), retval);
+    retval = plist_cons(env, ":fullscan-steps", make_int(sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 0)), retval);
+    retval = plist_cons(env, ":vm-steps", make_int(sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 0)), retval);
+    retval = plist_cons(env, ":time", env->make_float(env, elapsed), retval);
+    retval = plist_cons(env, ":rows", make_int(rows), retval);
+  } else {
+    xsignal(error, build_string(errmsg));
+  }
+
+  for (int i = 0; i < count; ++i)
+    free(nodes[i].detail);
+  free(nodes);
+  sqlite3_finalize(plan);
+  sqlite3_finalize(stmt);
+  return retval;
+}
+
+/* Index advisor, after the sqlite3expert extension of SQLite.  The
+   schema is copied into two in-memory databases.  In the probe
+   database every table is a virtual table whose xBestIndex records the
+   constraints and ORDER BY terms the planner would like an index for;
+   preparing each statement there yields candidate indexes.  They are
+   created in the other copy, and those its query plans then use are
+   proposed.  */
+
+struct Advisor {
+  char **candidates;            /* CREATE INDEX statements.  */
+  char **names;
+  char **keys;                  /* Table and columns, as "t"(a, b.  */
+  int count;
+  int size;
+};
+
+struct Advisor_Vtab {
+  sqlite3_vtab base;
+  struct Advisor *advisor;
+  char *table;
+  char **columns;
+  int ncolumns;
+};
+
+static
+void
+advisor_add(struct Advisor *advisor, struct Advisor_Vtab *tab, const int *columns, int count) {
+  if (count == 0)
+    return;
+
+  sqlite3_str *name = sqlite3_str_new(NULL);
+  sqlite3_str *list = sqlite3_str_new(NULL);
+  sqlite3_str_appendf(name, "%s_idx", tab->table);
+  for (int i = 0; i < count; ++i) {
+    sqlite3_str_appendf(name, "_%s", tab->columns[columns[i]]);
+    sqlite3_str_appendf(list, "%s\"%w\"", i ? ", " : "", tab->columns[columns[i]]);
+  }
+  char *n = sqlite3_str_finish(name);
+  char *l = sqlite3_str_finish(list);
+  char *key = sqlite3_mprintf("\"%w\"(%s", tab->table, l);
+  sqlite3_free(l);
+
+  for (int i = 0; i < advisor->count; ++i) {
+    if (strcmp(advisor->keys[i], key) == 0) {
+      sqlite3_free(key);
+      sqlite3_free(n);
+      return;
+    }
+  }
+  if (advisor->count == advisor->size) {
+    advisor->size = advisor->size ? advisor->size * 2 : 16;
+    advisor->candidates = realloc(advisor->candidates, advisor->size * sizeof(char *));
+    advisor->names = realloc(advisor->names, advisor->size * sizeof(char *));
+    advisor->keys = realloc(advisor->keys, advisor->size * sizeof(char *));
+  }
+  advisor->candidates[advisor->count] = sqlite3_mprintf("CREATE INDEX \"%w\" ON %s)", n, key);
+  advisor->names[advisor->count] = n;
+  advisor->keys[advisor->count] = key;
+  advisor->count++;
+}
+
+static
+int
+advisor_vtab_connect(sqlite3 *db, void *aux, int argc, const char *const *argv,
+                     sqlite3_vtab **vtab, char **errmsg __attribute__((unused))) {
+  struct Advisor_Vtab *tab = sqlite3_malloc(sizeof(struct Advisor_Vtab));
+  if (!tab)
+    return SQLITE_NOMEM;
+  memset(tab, 0, sizeof(struct Advisor_Vtab));
+  tab->advisor = (struct Advisor *)aux;
+  tab->table = sqlite3_mprintf("%s", argv[2]);
+
+  /* The arguments are the column definitions of the real table.  */
+  sqlite3_str *schema = sqlite3_str_new(NULL);
+  sqlite3_str_appendall(schema, "CREATE TABLE x(");
+  tab->ncolumns = argc - 3;
+  tab->columns = sqlite3_malloc((tab->ncolumns + 1) * sizeof(char *));
+  for (int i = 3; i < argc; ++i) {
+    /* Undo the quoting of `advisor_copy_schema'.  */
+    const char *arg = argv[i];
+    size_t len = strlen(arg);
+    sqlite3_str *column = sqlite3_str_new(NULL);
+    for (size_t j = 1; j + 1 < len; ++j) {
+      sqlite3_str_appendchar(column, 1, arg[j]);
+      if (arg[j] == '"')
+        ++j;
+    }
+    tab->columns[i - 3] = sqlite3_str_finish(column);
+    sqlite3_str_appendf(schema, "%s\"%w\"", (i > 3) ? ", " : "", tab->columns[i - 3]);
+  }
+  sqlite3_str_appendall(schema, ")");
+  char *sql = sqlite3_str_finish(schema);
+  int ret = sqlite3_declare_vtab(db, sql);
+  sqlite3_free(sql);
+
+  *vtab = &tab->base;
+  return ret;
+}
+
+static
+int
+advisor_vtab_disconnect(sqlite3_vtab *vtab) {
+  struct Advisor_Vtab *tab = (struct Advisor_Vtab *)vtab;
+  for (int i = 0; i < tab->ncolumns; ++i)
+    sqlite3_free(tab->columns[i]);
+  sqlite3_free(tab->columns);
+  sqlite3_free(tab->table);
+  sqlite3_free(tab);
+  return SQLITE_OK;
+}
+
+static
+int
+advisor_vtab_best_index(sqlite3_vtab *vtab, sqlite3_index_info *info) {
+  struct Advisor_Vtab *tab = (struct Advisor_Vtab *)vtab;
+  int *columns = malloc((tab->ncolumns + info->nOrderBy + 1) * sizeof(int));
+  int eq = 0, range = -1;
+
+  for (int i = 0; i < info->nConstraint; ++i) {
+    const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+    if (!c->usable || c->iColumn < 0)
+      continue;
+    if (c->op == SQLITE_INDEX_CONSTRAINT_EQ || c->op == SQLITE_INDEX_CONSTRAINT_IS) {
+      bool seen = false;
+      for (int j = 0; j < eq; ++j)
+        seen |= columns[j] == c->iColumn;
+      if (!seen)
+        columns[eq++] = c->iColumn;
+    } else if (range < 0 && (c->op == SQLITE_INDEX_CONSTRAINT_GT || c->op == SQLITE_INDEX_CONSTRAINT_GE
+                             || c->op == SQLITE_INDEX_CONSTRAINT_LT || c->op == SQLITE_INDEX_CONSTRAINT_LE)) {
+      range = c->iColumn;
+    }
+  }
+
+  /* Equality columns, then either a range or the sort order.  */
+  int n = eq;
+  if (range >= 0) {
+    columns[n++] = range;
+    advisor_add(tab->advisor, tab, columns, n);
+  }
+  n = eq;
+  for (int i = 0; i < info->nOrderBy && info->aOrderBy[i].iColumn >= 0; ++i) {
+    bool seen = false;
+    for (int j = 0; j < n; ++j)
+      seen |= columns[j] == info->aOrderBy[i].iColumn;
+    if (!seen)
+      columns[n++] = info->aOrderBy[i].iColumn;
+  }
+  advisor_add(tab->advisor, tab, columns, n);
+  free(columns);
+
+  info->estimatedCost = 1000000.0 / (1 + eq);
+  return SQLITE_OK;
+}
+
+static
+int
+advisor_vtab_open(sqlite3_vtab *vtab __attribute__((unused)), sqlite3_vtab_cursor **cursor) {
+  *cursor = sqlite3_malloc(sizeof(sqlite3_vtab_cursor));
+  return *cursor ? SQLITE_OK : SQLITE_NOMEM;
+}
+
+static
+int
+advisor_vtab_close(sqlite3_vtab_cursor *cursor) {
+  sqlite3_free(cursor);
+  return SQLITE_OK;
+}
+
+static
+int
+advisor_vtab_filter(sqlite3_vtab_cursor *cursor __attribute__((unused)), int idx_num __attribute__((unused)),
+                    const char *idx_str __attribute__((unused)), int argc __attribute__((unused)),
+                    sqlite3_value **argv __attribute__((unused))) {
+  return SQLITE_OK;
+}
+
+static
+int
+advisor_vtab_eof(sqlite3_vtab_cursor *cursor __attribute__((unused))) {
+  return 1;
+}
+
+static
+int
+advisor_vtab_noop(sqlite3_vtab_cursor *cursor __attribute__((unused))) {
+  return SQLITE_OK;
+}
+
+static
+int
+advisor_vtab_column(sqlite3_vtab_cursor *cursor __attribute__((unused)), sqlite3_context *ctx __attribute__((unused)),
+                    int column __attribute__((unused))) {
+  return SQLITE_OK;
+}
+
+static
+int
+advisor_vtab_rowid(sqlite3_vtab_cursor *cursor __attribute__((unused)), sqlite3_int64 *rowid) {
+  *rowid = 0;
+  return SQLITE_OK;
+}
+
+/* Let UPDATE and DELETE statements prepare.  */
+static
+int
+advisor_vtab_update(sqlite3_vtab *vtab __attribute__((unused)), int argc __attribute__((unused)),
+                    sqlite3_value **argv __attribute__((unused)), sqlite3_int64 *rowid __attribute__((unused))) {
+  return SQLITE_READONLY;
+}
+
+static sqlite3_module advisor_module = {
+  .iVersion = 0,
+  .xCreate = advisor_vtab_connect,
+  .xConnect = advisor_vtab_connect,
+  .xBestIndex = advisor_vtab_best_index,
+  .xDisconnect = advisor_vtab_disconnect,
+  .xDestroy = advisor_vtab_disconnect,
+  .xOpen = advisor_vtab_open,
+  .xClose = advisor_vtab_close,
+  .xFilter = advisor_vtab_filter,
+  .xNext = advisor_vtab_noop,
+  .xEof = advisor_vtab_eof,
+  .xColumn = advisor_vtab_column,
+  .xRowid = advisor_vtab_rowid,
+  .xUpdate = advisor_vtab_update,
+};
+
+/* Copy the schema of the main database of DB into the in-memory COPY
+   and PROBE databases, the latter with tables replaced by probes.  */
+static
+void
+advisor_copy_schema(sqlite3 *db, sqlite3 *copy, sqlite3 *probe) {
+  sqlite3_stmt *stmt = NULL;
+  if (sqlite3_prepare_v2(db, "SELECT type, name, sql FROM main.sqlite_schema "
+                         "WHERE sql IS NOT NULL AND name NOT LIKE 'sqlite_%' ORDER BY rowid",
+                         -1, &stmt, NULL) != SQLITE_OK)
+    return;
+
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    const char *type = (const char *)sqlite3_column_text(stmt, 0);
+    const char *name = (const char *)sqlite3_column_text(stmt, 1);
+    const char *sql = (const char *)sqlite3_column_text(stmt, 2);
+    if (strcmp(type, "trigger") == 0)
+      continue;
+    /* Shadow tables of virtual tables fail here, which is fine.  */
+    sqlite3_exec(copy, sql, NULL, NULL, NULL);
+
+    if (strcmp(type, "view") == 0) {
+      sqlite3_exec(probe, sql, NULL, NULL, NULL);
+    } else if (strcmp(type, "table") == 0 && strncmp(sql, "CREATE VIRTUAL", 14) != 0) {
+      sqlite3_str *create = sqlite3_str_new(NULL);
+      sqlite3_str_appendf(create, "CREATE VIRTUAL TABLE \"%w\" USING advisor_probe(", name);
+      sqlite3_stmt *columns = NULL;
+      sqlite3_prepare_v2(db, "SELECT name FROM pragma_table_info(?)", -1, &columns, NULL);
+      sqlite3_bind_text(columns, 1, name, -1, SQLITE_TRANSIENT);
+      for (int i = 0; sqlite3_step(columns) == SQLITE_ROW; ++i)
+        sqlite3_str_appendf(create, "%s\"%w\"", i ? ", " : "", sqlite3_column_text(columns, 0));
+      sqlite3_finalize(columns);
+      sqlite3_str_appendall(create, ")");
+      char *probe_sql = sqlite3_str_finish(create);
+      sqlite3_exec(probe, probe_sql, NULL, NULL, NULL);
+      sqlite3_free(probe_sql);
+    }
+  }
+  sqlite3_finalize(stmt);
+
+  /* The planner needs the statistics to weigh the indexes.  */
+  if (sqlite3_prepare_v2(db, "SELECT tbl, idx, stat FROM main.sqlite_stat1", -1, &stmt, NULL) == SQLITE_OK) {
+    sqlite3_exec(copy, "ANALYZE sqlite_schema", NULL, NULL, NULL);
+    sqlite3_stmt *insert = NULL;
+    sqlite3_prepare_v2(copy, "INSERT INTO sqlite_stat1 VALUES (?, ?, ?)", -1, &insert, NULL);
+    while (insert && sqlite3_step(stmt) == SQLITE_ROW) {
+      for (int i = 0; i < 3; ++i)
+        sqlite3_bind_value(insert, i + 1, sqlite3_column_value(stmt, i));
+      sqlite3_step(insert);
+      sqlite3_reset(insert);
+    }
+    sqlite3_finalize(insert);
+    sqlite3_exec(copy, "ANALYZE sqlite_schema", NULL, NULL, NULL);
+  }
+  sqlite3_finalize(stmt);
+}
+
+/* Value is the EXPLAIN QUERY PLAN of SQL on DB as a list of strings,
+   indented by depth, and marks the candidates of ADVISOR it uses in
+   USED if non-NULL.  */
+static
+emacs_value
+advisor_plan(emacs_env *env, sqlite3 *db, const char *sql, struct Advisor *advisor, bool *used) {
+  char *eqp = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", sql);
+  sqlite3_stmt *stmt = NULL;
+  int ret = sqlite3_prepare_v2(db, eqp, -1, &stmt, NULL);
+  sqlite3_free(eqp);
+  if (ret != SQLITE_OK)
+    return Q(nil);
+
+  int ids[64], depth = 0;
+  emacs_value plan = Q(nil);
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    int id = sqlite3_column_int(stmt, 0), parent = sqlite3_column_int(stmt, 1);
+    const char *detail = (const char *)sqlite3_column_text(stmt, 3);
+    while (depth > 0 && ids[depth - 1] != parent)
+      --depth;
+    char *line = sqlite3_mprintf("%*s%s", depth * 2, "", detail);
+    plan = call(cons, build_string(line), plan);
+    sqlite3_free(line);
+    if (depth < 64)
+      ids[depth++] = id;
+
+    const char *index = strstr(detail, " INDEX ");
+    for (int i = 0; used && index && i < advisor->count; ++i) {
+      size_t len = strlen(advisor->names[i]);
+      if (strncmp(index + 7, advisor->names[i], len) == 0 && (index[7 + len] == ' ' || index[7 + len] == '\0'))
+        used[i] = true;
+    }
+  }
+  sqlite3_finalize(stmt);
+  return call(nreverse, plan);
+}
+
+static
+emacs_value
+Fsqlite_suggest_indexes(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+
+  /* Without SQL-LIST, take the queries in the statement cache.  */
+  emacs_value statements = (nargs > 1) ? args[1] : Q(nil);
+  if (NILP(statements)) {
+    static const char *const keywords[] = { "SELECT", "WITH", "UPDATE", "DELETE", "INSERT", "REPLACE", NULL };
+    for (int i = ptr->cache->count - 1; i >= 0; --i) {
+      const char *sql = ptr->cache->entries[i].sql;
+      while (*sql == ' ' || *sql == '\n' || *sql == '\t' || *sql == '(')
+        ++sql;
+      for (const char *const *keyword = keywords; *keyword; ++keyword) {
+        if (sqlite3_strnicmp(sql, *keyword, strlen(*keyword)) == 0) {
+          statements = call(cons, build_string(ptr->cache->entries[i].sql), statements);
+          break;
+        }
+      }
+    }
+  } else if (TYPEP(statements, vector)) {
+    statements = call(append, statements, Q(nil));
+  }
+
+  struct Advisor advisor = { NULL, NULL, NULL, 0, 0 };
+  sqlite3 *copy = NULL, *probe = NULL;
+  sqlite3_open(":memory:", &copy);
+  sqlite3_open(":memory:", &probe);
+  register_functions(copy);
+  register_functions(probe);
+  sqlite3_create_module(probe, "advisor_probe", &advisor_module, &advisor);
+  advisor_copy_schema(ptr->db, copy, probe);
+
+  int count = XFIXNUM(call(length, statements));
+  char **sqls = calloc(count + 1, sizeof(char *));
+  emacs_value *before = calloc(count + 1, sizeof(emacs_value));
+  emacs_value list = statements;
+  for (int i = 0; i < count; ++i, list = call(cdr, list)) {
+    emacs_value sql = call(car, list);
+    if (!CHECK_STRING(env, sql))
+      break;
+    sqls[i] = copy_string(env, sql);
+    before[i] = advisor_plan(env, copy, sqls[i], &advisor, NULL);
+
+    /* Preparing is enough to call xBestIndex.  */
+    sqlite3_stmt *stmt = NULL;
+    sqlite3_prepare_v2(probe, sqls[i], -1, &stmt, NULL);
+    sqlite3_finalize(stmt);
+  }
+
+  emacs_value retval = Q(nil);
+  if (env->non_local_exit_check(env) == emacs_funcall_exit_return) {
+    bool *used = calloc(advisor.count + 1, sizeof(bool));
+    for (int i = 0; i < advisor.count; ++i)
+      sqlite3_exec(copy, advisor.candidates[i], NULL, NULL, NULL);
+
+    for (int i = 0; i < count; ++i)
+      advisor_plan(env, copy, sqls[i], &advisor, used);
+
+    /* Drop the indexes that are a prefix of another used one, and plan
+       again with just the remaining ones.  */
+    for (int i = 0; i < advisor.count; ++i) {
+      size_t len = strlen(advisor.keys[i]);
+      for (int j = 0; used[i] && j < advisor.count; ++j)
+        if (j != i && used[j] && strncmp(advisor.keys[j], advisor.keys[i], len) == 0 && advisor.keys[j][len] == ',')
+          used[i] = false;
+      char *drop = sqlite3_mprintf("DROP INDEX IF EXISTS \"%w\"", advisor.names[i]);
+      sqlite3_exec(copy, drop, NULL, NULL, NULL);
+      sqlite3_free(drop);
+    }
+    for (int i = 0; i < advisor.count; ++i)
+      if (used[i])
+        sqlite3_exec(copy, advisor.candidates[i], NULL, NULL, NULL);
+
+    emacs_value plans = Q(nil);
+    for (int i = 0; i < count; ++i) {
+      emacs_value after = advisor_plan(env, copy, sqls[i], &advisor, NULL);
+      plans = call(cons, call(list, build_string(sqls[i]), before[i], after), plans);
+    }
+    emacs_value indexes = Q(nil);
+    for (int i = advisor.count - 1; i >= 0; --i)
+      if (used[i])
+        indexes = call(cons, build_string(advisor.candidates[i]), indexes);
+    free(used);
+    retval = call(list, env->intern(env, ":indexes"), indexes,
+                  env->intern(env, ":statements"), call(nreverse, plans));
+  }
+
+  for (int i = 0; i < count; ++i)
+    free(sqls[i]);
+  free(sqls);
+  free(before);
+  for (int i = 0; i < advisor.count; ++i) {
+    sqlite3_free(advisor.candidates[i]);
+    sqlite3_free(advisor.names[i]);
+    sqlite3_free(advisor.keys[i]);
+  }
+  free(advisor.candidates);
+  free(advisor.names);
+  free(advisor.keys);
+  sqlite3_close(probe);
+  sqlite3_close(copy);
+  return retval;
+}
+
+static
+double
+monotonic_time(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static
+emacs_value
+Fsqlite_maintenance(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+  /* Each handle would maintain the connection on its own.  */
+  if (ptr->shared && !NILP(args[1])) {
+    xsignal(error, build_string("Maintenance is not available on shared connections"));
+    return Q(nil);
+  }
+
+  maintenance_disable(env, ptr);
+  if (NILP(args[1])) {
+    free(ptr->maintenance);
+    ptr->maintenance = NULL;
+    return Q(nil);
+  }
+
+  emacs_value analysis_limit = keyword_arg(env, nargs, args, 2, ":analysis-limit");
+  emacs_value vacuum_pages = keyword_arg(env, nargs, args, 2, ":vacuum-pages");
+  emacs_value idle = keyword_arg(env, nargs, args, 2, ":idle");
+  emacs_value min_interval = keyword_arg(env, nargs, args, 2, ":min-interval");
+
+  if (!ptr->maintenance) {
+    ptr->maintenance = calloc(1, sizeof(struct Maintenance));
+    ptr->maintenance->last_run = monotonic_time();
+  }
+  struct Maintenance *maintenance = ptr->maintenance;
+  maintenance->analysis_limit = NILP(analysis_limit) ? 400 : XFIXNUM(analysis_limit);
+  maintenance->vacuum_pages = NILP(vacuum_pages) ? 100 : XFIXNUM(vacuum_pages);
+  maintenance->min_interval = NILP(min_interval) ? 3600 : XFIXNUM(call(round, min_interval));
+
+  if (NILP(idle))
+    idle = make_int(30);
+  emacs_value timer = call(run-with-idle-timer, idle, Q(t), Q(sqlite-maintenance-run), args[0]);
+  if (env->non_local_exit_check(env) != emacs_funcall_exit_return)
+    return Q(nil);
+  maintenance->timer = env->make_global_ref(env, timer);
+  return Q(t);
+}
+
+static
+emacs_value
+Fsqlite_maintenance_run(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+  bool force = (nargs > 1) && !NILP(args[1]);
+
+  struct Maintenance *maintenance = ptr->maintenance;
+  if (!maintenance && !force)
+    return Q(nil);
+
+  /* Never run inside a transaction or more often than allowed.  */
+  double now = monotonic_time();
+  if (!sqlite3_get_autocommit(ptr->db))
+    return Q(nil);
+  if (!force && now - maintenance->last_run < maintenance->min_interval)
+    return Q(nil);
+
+  int analysis_limit = maintenance ? maintenance->analysis_limit : 400;
+  int vacuum_pages = maintenance ? maintenance->vacuum_pages : 100;
+  if (maintenance)
+    maintenance->last_run = now;
+
+  maintenance_optimize(ptr->db, analysis_limit);
+
+  /* Return some free pages to the file system, if the database was
+     created with auto_vacuum=incremental.  */
+  sqlite3_stmt *stmt = NULL;
+  int auto_vacuum = 0;
+  if (sqlite3_prepare_v2(ptr->db, "PRAGMA auto_vacuum", -1, &stmt, NULL) == SQLITE_OK
+      && sqlite3_step(stmt) == SQLITE_ROW)
+    auto_vacuum = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+  if (auto_vacuum == 2) {
+    char *sql = sqlite3_mprintf("PRAGMA incremental_vacuum(%d)", vacuum_pages);
+    sqlite3_exec(ptr->db, sql, NULL, NULL, NULL);
+    sqlite3_free(sql);
+  }
+  return Q(t);
+}
+
+/* Read every page of the b-tree behind TABLE and its indexes into the
+   page cache of DB.  Value is false, with the error in DB, if TABLE
+   cannot be read.  */
+static
+bool
+warmup_table(sqlite3 *db, const char *table) {
+  char *sql = sqlite3_mprintf("SELECT name FROM pragma_index_list(%Q)", table);
+  sqlite3_stmt *indexes = NULL;
+  int ret = sqlite3_prepare_v2(db, sql, -1, &indexes, NULL);
+  sqlite3_free(sql);
+  if (ret != SQLITE_OK)
+    return false;
+
+  /* Counting rows walks the whole b-tree, which is the table itself
+     unless an index is named.  */
+  sql = sqlite3_mprintf("SELECT count(*) FROM \"%w\" NOT INDEXED", table);
+  ret = sqlite3_exec(db, sql, NULL, NULL, NULL);
+  sqlite3_free(sql);
+  while (ret == SQLITE_OK && sqlite3_step(indexes) == SQLITE_ROW) {
+    sql = sqlite3_mprintf("SELECT count(*) FROM \"%w\" INDEXED BY \"%w\"",
+                          table, (const char *)sqlite3_column_text(indexes, 0));
+    ret = sqlite3_exec(db, sql, NULL, NULL, NULL);
+    sqlite3_free(sql);
+  }
+  sqlite3_finalize(indexes);
+  return ret == SQLITE_OK;
+}
+
+/* Ask the kernel to read the file of DB ahead, which is where its
+   pages come from when it is memory-mapped.  */
+static
+void
+warmup_mmap(sqlite3 *db) {
+  const char *file = sqlite3_db_filename(db, "main");
+  if (!file || !*file)
+    return;
+  int fd = open(file, O_RDONLY);
+  if (fd < 0)
+    return;
+#ifdef POSIX_FADV_WILLNEED
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+  close(fd);
+}
+
+static
+emacs_value
+Fsqlite_warmup(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+
+  emacs_value statements = keyword_arg(env, nargs, args, 1, ":statements");
+  emacs_value tables = keyword_arg(env, nargs, args, 1, ":tables");
+  emacs_value idle = keyword_arg(env, nargs, args, 1, ":idle");
+
+  if (!NILP(idle)) {
+    warmup_cancel(env, ptr);
+    emacs_value timer = call(run-with-idle-timer, idle, Q(nil), Q(sqlite-warmup), args[0],
+                             Q(:statements), statements, Q(:tables), tables);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return)
+      return Q(nil);
+    /* Kept so that closing DB cancels it.  */
+    ptr->warmup_timer = env->make_global_ref(env, timer);
+    return Q(nil);
+  }
+
+  int current, highwater;
+  int misses = 0;
+  sqlite3_db_status(ptr->db, SQLITE_DBSTATUS_CACHE_MISS, &misses, &highwater, 0);
+
+  const char *errmsg = NULL;
+  int count = XFIXNUM(call(length, statements));
+  emacs_value list = statements;
+  for (int i = 0; i < count && !errmsg; ++i, list = call(cdr, list)) {
+    emacs_value sql = call(car, list);
+    if (!CHECK_STRING(env, sql))
+      return Q(nil);
+    char *encoded = copy_string(env, sql);
+    int ret;
+    sqlite3_stmt *stmt = statement_cache_prepare(ptr->db, ptr->cache, encoded, &ret);
+    free(encoded);
+    if (ret != SQLITE_OK)
+      errmsg = sqlite3_errmsg(ptr->db);
+    else if (stmt)
+      statement_cache_release(ptr->cache, stmt);
+  }
+
+  sqlite3_int64 mmap_size = 0;
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(ptr->db, "PRAGMA mmap_size", -1, &stmt, NULL) == SQLITE_OK) {
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+      mmap_size = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+  }
+
+  count = XFIXNUM(call(length, tables));
+  list = tables;
+  if (count && mmap_size > 0)
+    warmup_mmap(ptr->db);
+  else {
+    for (int i = 0; i < count && !errmsg; ++i, list = call(cdr, list)) {
+      emacs_value table = call(car, list);
+      if (!CHECK_STRING(env, table))
+        return Q(nil);
+      char *encoded = copy_string(env, table);
+      if (!warmup_table(ptr->db, encoded))
+        errmsg = sqlite3_errmsg(ptr->db);
+      free(encoded);
+    }
+  }
+
+  if (errmsg) {
+    xsignal(error, build_string(errmsg));
+    return Q(nil);
+  }
+
+  sqlite3_db_status(ptr->db, SQLITE_DBSTATUS_CACHE_MISS, &current, &highwater, 0);
+  return make_int(current - misses);
+}
+
+static
+emacs_value
+Fsqlite_select_map(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[1]);
+  if (!ptr)
+    return Q(nil);
+
+  if (!CHECK_STRING(env, args[2]))
+    return Q(nil);
+
+  ptrdiff_t positional = positional_args(env, nargs, args, 3);
+  emacs_value values = (positional > 3) ? args[3] : Q(nil);
+  emacs_value hints = keyword_arg(env, nargs, args, positional, ":decode");
+  emacs_value yield_every = keyword_arg(env, nargs, args, positional, ":yield-every");
+  intmax_t every = NILP(yield_every) ? 0 : XFIXNUM(yield_every);
+
+  char *encoded = copy_string(env, args[2]);
+  int ret;
+  sqlite3_stmt *stmt = statement_cache_prepare(ptr->db, ptr->cache, encoded, &ret);
+  free(encoded);
+  if (ret != SQLITE_OK) {
+    xsignal(error, build_string(sqlite3_errmsg(ptr->db)));
+    return Q(nil);
+  }
+  if (!stmt) {
+    xsignal(error, build_string("Empty query"));
+    return Q(nil);
+  }
+
+  unsigned char *decode = NULL;
+  if (!NILP(hints) && !(decode = decode_hints(env, hints, sqlite3_column_count(stmt)))) {
+    statement_cache_release(ptr->cache, stmt);
+    return Q(nil);
+  }
+  if (!NILP(values)) {
+    const char *errmsg = bind_values(env, ptr->db, stmt, values);
+    if (errmsg) {
+      free(decode);
+      statement_cache_release(ptr->cache, stmt);
+      xsignal(error, build_string(errmsg));
+      return Q(nil);
+    }
+  }
+
+  intmax_t rows = 0;
+  ptr->busy++;
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+    emacs_value row = row_to_value(env, stmt, decode);
+    env->funcall(env, args[0], 1, &row);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return)
+      break;
+    rows++;
+    if (every && rows % every == 0 && !lisp_sqlite_yield(env, ptr))
+      break;
+  }
+  ptr->busy--;
+  free(decode);
+
+  const char *errmsg = (ret == SQLITE_ROW || ret == SQLITE_DONE) ? NULL : sqlite3_errmsg(ptr->db);
+  if (errmsg && env->non_local_exit_check(env) == emacs_funcall_exit_return)
+    xsignal(error, build_string(errmsg));
+  statement_cache_release(ptr->cache, stmt);
+  if (env->non_local_exit_check(env) != emacs_funcall_exit_return || ret == SQLITE_ROW)
+    return Q(nil);
+  return make_int(rows);
+}
+
+/* Key-value stores over a table with the columns key (the primary
+   key) and value.  A store keeps its statements prepared for the life
+   of the connection, a cache of recently used keys, and, with
+   write-behind, the writes not yet flushed to the table.  */
+
+#define KV_CACHE_SIZE 1024
+#define KV_CACHE_MAX (1 << 24)
+
+struct Kv_Entry {
+  sqlite3_value *key;
+  sqlite3_value *value;         /* NULL if KEY has no value.  */
+  uint64_t hash;
+  bool dirty;                   /* Not written to the table yet.  */
+  struct Kv_Entry *chain;       /* Next entry in the same bucket.  */
+  struct Kv_Entry *newer;
+  struct Kv_Entry *older;
+};
+
+struct Lisp_Kv {
+  struct Lisp_Sqlite *owner;    /* NULL once the database is closed.  */
+  struct Lisp_Kv *next;         /* The next store of OWNER.  */
+  sqlite3_stmt *get;
+  sqlite3_stmt *put;
+  sqlite3_stmt *delete;
+  sqlite3_stmt *convert;
+  char *map_sql;
+  size_t capacity;
+  size_t count;
+  size_t buckets;               /* A power of two.  */
+  struct Kv_Entry **table;
+  struct Kv_Entry *newest;
+  struct Kv_Entry *oldest;
+  size_t dirty;
+  double flush_interval;        /* Seconds, or 0 to write through.  */
+  bool flush_scheduled;
+};
+
+static
+void
+kv_unlink(struct Lisp_Kv *kv, struct Kv_Entry *entry) {
+  struct Kv_Entry **link = &kv->table[entry->hash & (kv->buckets - 1)];
+  while (*link != entry)
+    link = &(*link)->chain;
+  *link = entry->chain;
+
+  if (entry->newer)
+    entry->newer->older = entry->older;
+  else
+    kv->newest = entry->older;
+  if (entry->older)
+    entry->older->newer = entry->newer;
+  else
+    kv->oldest = entry->newer;
+  kv->count--;
+
+  sqlite3_value_free(entry->key);
+  if (entry->value)
+    sqlite3_value_free(entry->value);
+  free(entry);
+}
+
+static
+void
+kv_touch(struct Lisp_Kv *kv, struct Kv_Entry *entry) {
+  if (kv->newest == entry)
+    return;
+  if (entry->newer)
+    entry->newer->older = entry->older;
+  if (entry->older)
+    entry->older->newer = entry->newer;
+  else
+    kv->oldest = entry->newer;
+  entry->newer = NULL;
+  entry->older = kv->newest;
+  kv->newest->newer = entry;
+  kv->newest = entry;
+}
+
+static
+struct Kv_Entry *
+kv_lookup(struct Lisp_Kv *kv, sqlite3_value *key, uint64_t hash) {
+  for (struct Kv_Entry *entry = kv->table[hash & (kv->buckets - 1)]; entry; entry = entry->chain)
+    if (entry->hash == hash && !compare_values(entry->key, key)) {
+      kv_touch(kv, entry);
+      return entry;
+    }
+  return NULL;
+}
+
+/* Write the pending writes of KV to its table in one transaction.
+   Value is the number of keys written, or -1 with a malloc'ed message
+   in *ERRMSG, if ERRMSG is non-NULL.  Inside a transaction of the
+   user, the writes stay pending, since it may still be rolled back;
+   writing them again later is harmless.  */
+static
+int
+kv_flush(struct Lisp_Kv *kv, char **errmsg) {
+  if (!kv->dirty)
+    return 0;
+
+  sqlite3 *db = kv->owner->db;
+  /* Inside a transaction of the user, the writes become part of it.  */
+  bool own = sqlite3_get_autocommit(db);
+  int ret = own ? sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL) : SQLITE_OK;
+  if (ret == SQLITE_OK)
+    ret = SQLITE_DONE;
+
+  int count = 0;
+  for (struct Kv_Entry *entry = kv->oldest; entry && ret == SQLITE_DONE; entry = entry->newer) {
+    if (!entry->dirty)
+      continue;
+    sqlite3_stmt *stmt = entry->value ? kv->put : kv->delete;
+    sqlite3_bind_value(stmt, 1, entry->key);
+    if (entry->value)
+      sqlite3_bind_value(stmt, 2, entry->value);
+    ret = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    count++;
+  }
+
+  if (ret == SQLITE_DONE && own && sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+    ret = SQLITE_ERROR;
+  if (ret != SQLITE_DONE) {
+    if (errmsg)
+      *errmsg = strdup(sqlite3_errmsg(db));
+    if (own && !sqlite3_get_autocommit(db))
+      sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+    return -1;
+  }
+
+  if (own) {
+    for (struct Kv_Entry *entry = kv->oldest; entry; entry = entry->newer)
+      entry->dirty = false;
+    kv->dirty = 0;
+  }
+  return count;
+}
+
+/* Add KEY, which KV takes over, to the cache of KV.  */
+static
+struct Kv_Entry *
+kv_insert(struct Lisp_Kv *kv, sqlite3_value *key, uint64_t hash) {
+  if (kv->count >= kv->capacity) {
+    struct Kv_Entry *victim = kv->oldest;
+    while (victim && victim->dirty)
+      victim = victim->newer;
+    /* Entries stay dirty when flushed inside a transaction.  */
+    if (!victim && kv_flush(kv, NULL) >= 0)
+      for (victim = kv->oldest; victim && victim->dirty; victim = victim->newer)
+        ;
+    if (victim)
+      kv_unlink(kv, victim);
+  }
+
+  struct Kv_Entry *entry = calloc(1, sizeof(struct Kv_Entry));
+  entry->key = key;
+  entry->hash = hash;
+  struct Kv_Entry **bucket = &kv->table[hash & (kv->buckets - 1)];
+  entry->chain = *bucket;
+  *bucket = entry;
+  entry->older = kv->newest;
+  if (kv->newest)
+    kv->newest->newer = entry;
+  else
+    kv->oldest = entry;
+  kv->newest = entry;
+  kv->count++;
+  return entry;
+}
+
+/* Flush KV and let go of its connection.  */
+static
+void
+kv_detach(struct Lisp_Kv *kv) {
+  kv_flush(kv, NULL);
+  while (kv->oldest)
+    kv_unlink(kv, kv->oldest);
+  sqlite3_finalize(kv->get);
+  sqlite3_finalize(kv->put);
+  sqlite3_finalize(kv->delete);
+  sqlite3_finalize(kv->convert);
+  kv->get = kv->put = kv->delete = kv->convert = NULL;
+  kv->owner = NULL;
+}
+
+/* Flush the stores of PTR.  Value is false, with a malloc'ed message
+   in *ERRMSG, if one of them could not be written.  */
+static
+bool
+kv_flush_all(struct Lisp_Sqlite *ptr, char **errmsg) {
+  for (struct Lisp_Kv *kv = ptr->kv_stores; kv; kv = kv->next)
+    if (kv_flush(kv, errmsg) < 0)
+      return false;
+  return true;
+}
+
+static
+void
+kv_detach_all(struct Lisp_Sqlite *ptr) {
+  while (ptr->kv_stores) {
+    struct Lisp_Kv *kv = ptr->kv_stores;
+    ptr->kv_stores = kv->next;
+    kv_detach(kv);
+  }
+}
+
+static
+void
+lisp_kv_free(void *arg) {
+  struct Lisp_Kv *kv = (struct Lisp_Kv *)arg;
+  if (kv->owner) {
+    struct Lisp_Kv **link = &kv->owner->kv_stores;
+    while (*link != kv)
+      link = &(*link)->next;
+    *link = kv->next;
+    kv_detach(kv);
+  }
+  free(kv->table);
+  sqlite3_free(kv->map_sql);
+  free(kv);
+}
+
+static
+struct Lisp_Kv *
+lisp_kv_check(emacs_env *env, emacs_value value) {
+  if (user_ptr_check(env, value) != lisp_kv_free) {
+    xsignal(wrong-type-argument, Q(sqlite-kv-p), value);
+    return NULL;
+  }
+  struct Lisp_Kv *kv = env->get_user_ptr(env, value);
+  if (!kv->owner) {
+    xsignal(error, build_string("Database closed"));
+    return NULL;
+  }
+  enter_env(env);
+  return kv;
+}
+
+/* Convert VALUE, a key or value of a store, to Lisp, decoding the
+   values that `sqlite-execute' binds in their binary encoding.  */
+static
+emacs_value
+kv_value_to_lisp(emacs_env *env, sqlite3_value *value) {
+  if (sqlite3_value_type(value) == SQLITE_BLOB) {
+    const unsigned char *data = sqlite3_value_blob(value);
+    int size = sqlite3_value_bytes(value);
+    if (encoded_value_p(data, size)) {
+      emacs_value decoded = decode_value(env, data, size);
+      return decoded ? decoded : Q(nil);
+    }
+  }
+  return value_to_lisp(env, value);
+}
+
+/* Convert VALUE into an SQLite value the way `sqlite-execute' binds
+   it, or into its binary encoding if it has no SQL counterpart.  Value
+   is NULL, with an error signaled, if that fails.  */
+static
+sqlite3_value *
+kv_convert(emacs_env *env, struct Lisp_Kv *kv, emacs_value value) {
+  sqlite3_value *result = NULL;
+  sqlite3_reset(kv->convert);
+  const char *errmsg = bind_value_encoded(env, kv->owner->db, kv->convert, 1, value);
+  if (!errmsg && sqlite3_step(kv->convert) == SQLITE_ROW)
+    result = sqlite3_value_dup(sqlite3_column_value(kv->convert, 0));
+  else if (!errmsg)
+    errmsg = sqlite3_errmsg(kv->owner->db);
+  sqlite3_reset(kv->convert);
+  sqlite3_clear_bindings(kv->convert);
+  if (errmsg)
+    xsignal(error, build_string(errmsg));
+  return result;
+}
+
+static
+emacs_value
+Fsqlite_kv_open(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+  if (!CHECK_STRING(env, args[1]))
+    return Q(nil);
+
+  emacs_value cache_size = keyword_arg(env, nargs, args, 2, ":cache-size");
+  emacs_value flush_interval = keyword_arg(env, nargs, args, 2, ":flush-interval");
+  intmax_t capacity = NILP(cache_size) ? KV_CACHE_SIZE : XFIXNUM(cache_size);
+  if (env->non_local_exit_check(env) != emacs_funcall_exit_return)
+    return Q(nil);
+  if (capacity < 1 || capacity > KV_CACHE_MAX) {
+    xsignal(error, build_string("CACHE-SIZE must be between 1 and 16777216"), cache_size);
+    return Q(nil);
+  }
+
+  char *table = copy_string(env, args[1]);
+  char *create = sqlite3_mprintf("CREATE TABLE IF NOT EXISTS \"%w\" (key PRIMARY KEY, value) WITHOUT ROWID",
+                                 table);
+  int ret = sqlite3_exec(ptr->db, create, NULL, NULL, NULL);
+  sqlite3_free(create);
+
+  struct Lisp_Kv *kv = calloc(1, sizeof(struct Lisp_Kv));
+  const char *sql[] = {
+    "SELECT value FROM \"%w\" WHERE key = ?1",
+    "INSERT OR REPLACE INTO \"%w\" (key, value) VALUES (?1, ?2)",
+    "DELETE FROM \"%w\" WHERE key = ?1",
+    "SELECT ?1",
+  };
+  sqlite3_stmt **stmts[] = { &kv->get, &kv->put, &kv->delete, &kv->convert };
+  for (int i = 0; i < 4 && ret == SQLITE_OK; ++i) {
+    char *query = sqlite3_mprintf(sql[i], table);
+    ret = sqlite3_prepare_v3(ptr->db, query, -1, SQLITE_PREPARE_PERSISTENT, stmts[i], NULL);
+    sqlite3_free(query);
+  }
+  kv->map_sql = sqlite3_mprintf("SELECT key, value FROM \"%w\"", table);
+  free(table);
+
+  if (ret != SQLITE_OK) {
+    xsignal(error, build_string(sqlite3_errmsg(ptr->db)));
+    kv_detach(kv);
+    lisp_kv_free(kv);
+    return Q(nil);
+  }
+
+  kv->capacity = capacity;
+  for (kv->buckets = 16; kv->buckets < kv->capacity * 2; kv->buckets *= 2)
+    ;
+  kv->table = calloc(kv->buckets, sizeof(struct Kv_Entry *));
+  if (!NILP(flush_interval))
+    kv->flush_interval = env->extract_float(env, call(float, flush_interval));
+
+  kv->owner = ptr;
+  kv->next = ptr->kv_stores;
+  ptr->kv_stores = kv;
+  return env->make_user_ptr(env, lisp_kv_free, kv);
+}
+
+static
+emacs_value
+Fsqlite_kv_get(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Kv *kv = lisp_kv_check(env, args[0]);
+  if (!kv)
+    return Q(nil);
+  emacs_value fallback = (nargs > 2) ? args[2] : Q(nil);
+
+  sqlite3_value *key = kv_convert(env, kv, args[1]);
+  if (!key)
+    return Q(nil);
+  uint64_t hash = hash_value(0, key);
+  struct Kv_Entry *entry = kv_lookup(kv, key, hash);
+  /* Inside a transaction of the user, the table may have uncommitted
+     changes, which are not cached since they may be rolled back.  */
+  bool cache = sqlite3_get_autocommit(kv->owner->db);
+  if (entry && (cache || entry->dirty)) {
+    sqlite3_value_free(key);
+    return entry->value ? kv_value_to_lisp(env, entry->value) : fallback;
+  }
+
+  sqlite3_bind_value(kv->get, 1, key);
+  int ret = sqlite3_step(kv->get);
+  if (ret != SQLITE_ROW && ret != SQLITE_DONE) {
+    xsignal(error, build_string(sqlite3_errmsg(kv->owner->db)));
+    sqlite3_reset(kv->get);
+    sqlite3_value_free(key);
+    return Q(nil);
+  }
+  emacs_value value = fallback;
+  if (ret == SQLITE_ROW)
+    value = kv_value_to_lisp(env, sqlite3_column_value(kv->get, 0));
+  if (cache) {
+    entry = kv_insert(kv, key, hash);
+    if (ret == SQLITE_ROW)
+      entry->value = sqlite3_value_dup(sqlite3_column_value(kv->get, 0));
+  } else {
+    sqlite3_value_free(key);
+  }
+  sqlite3_reset(kv->get);
+  return value;
+}
+
+/* Set KEY of the store KV to VALUE, or remove it if VALUE is NULL.  */
+static
+emacs_value
+kv_store(emacs_env *env, emacs_value object, struct Lisp_Kv *kv, emacs_value key_value, sqlite3_value *value) {
+  sqlite3_value *key = kv_convert(env, kv, key_value);
+  if (!key) {
+    if (value)
+      sqlite3_value_free(value);
+    return Q(nil);
+  }
+
+  if (!kv->flush_interval) {
+    sqlite3_stmt *stmt = value ? kv->put : kv->delete;
+    sqlite3_bind_value(stmt, 1, key);
+    if (value)
+      sqlite3_bind_value(stmt, 2, value);
+    int ret = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if (ret != SQLITE_DONE) {
+      xsignal(error, build_string(sqlite3_errmsg(kv->owner->db)));
+      sqlite3_value_free(key);
+      if (value)
+        sqlite3_value_free(value);
+      return Q(nil);
+    }
+  }
+
+  uint64_t hash = hash_value(0, key);
+  struct Kv_Entry *entry = kv_lookup(kv, key, hash);
+  /* A write through inside a transaction of the user is not cached,
+     since it may be rolled back.  */
+  if (!kv->flush_interval && !sqlite3_get_autocommit(kv->owner->db)) {
+    if (entry)
+      kv_unlink(kv, entry);
+    sqlite3_value_free(key);
+    if (value)
+      sqlite3_value_free(value);
+    return Q(t);
+  }
+  if (entry)
+    sqlite3_value_free(key);
+  else
+    entry = kv_insert(kv, key, hash);
+  if (entry->value)
+    sqlite3_value_free(entry->value);
+  entry->value = value;
+
+  if (kv->flush_interval && !entry->dirty) {
+    entry->dirty = true;
+    kv->dirty++;
+  }
+  if (kv->dirty && !kv->flush_scheduled) {
+    call(run-with-timer, env->make_float(env, kv->flush_interval), Q(nil), Q(sqlite-kv-flush), object);
+    kv->flush_scheduled = true;
+  }
+  return Q(t);
+}
+
+static
+emacs_value
+Fsqlite_kv_put(emacs_env *env, ptrdiff_t nargs __attribute__((unused)), emacs_value args[], void *data __attribute__((unused))) {
+  struct Lisp_Kv *kv = lisp_kv_check(env, args[0]);
+  if (!kv)
+    return Q(nil);
+  sqlite3_value *value = kv_convert(env, kv, args[2]);
+  if (!value)
+    return Q(nil);
+  return kv_store(env, args[0], kv, args[1], value);
+}
+
+static
+emacs_value
+Fsqlite_kv_delete(emacs_env *env, ptrdiff_t nargs __attribute__((unused)), emacs_value args[], void *data __attribute__((unused))) {
+  struct Lisp_Kv *kv = lisp_kv_check(env, args[0]);
+  if (!kv)
+    return Q(nil);
+  return kv_store(env, args[0], kv, args[1], NULL);
+}
+
+static
+emacs_value
+Fsqlite_kv_flush(emacs_env *env, ptrdiff_t nargs __attribute__((unused)), emacs_value args[], void *data __attribute__((unused))) {
+  /* The flush timer may fire after the database was closed.  */
+  if (user_ptr_check(env, args[0]) == lisp_kv_free
+      && !((struct Lisp_Kv *)env->get_user_ptr(env, args[0]))->owner)
+    return make_int(0);
+
+  struct Lisp_Kv *kv = lisp_kv_check(env, args[0]);
+  if (!kv)
+    return Q(nil);
+  kv->flush_scheduled = false;
+  char *errmsg = NULL;
+  int count = kv_flush(kv, &errmsg);
+  if (count < 0) {
+    xsignal(error, build_string(errmsg));
+    free(errmsg);
+    return Q(nil);
+  }
+  return make_int(count);
+}
+
+static
+emacs_value
+Fsqlite_kv_map(emacs_env *env, ptrdiff_t nargs __attribute__((unused)), emacs_value args[], void *data __attribute__((unused))) {
+  struct Lisp_Kv *kv = lisp_kv_check(env, args[1]);
+  if (!kv)
+    return Q(nil);
+  char *errmsg = NULL;
+  if (kv_flush(kv, &errmsg) < 0) {
+    xsignal(error, build_string(errmsg));
+    free(errmsg);
+    return Q(nil);
+  }
+
+  struct Lisp_Sqlite *ptr = kv->owner;
+  int ret;
+  sqlite3_stmt *stmt = statement_cache_prepare(ptr->db, ptr->cache, kv->map_sql, &ret);
+  if (ret != SQLITE_OK) {
+    xsignal(error, build_string(sqlite3_errmsg(ptr->db)));
+    return Q(nil);
+  }
+  ptr->busy++;
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+    emacs_value pair[] = {
+      kv_value_to_lisp(env, sqlite3_column_value(stmt, 0)),
+      kv_value_to_lisp(env, sqlite3_column_value(stmt, 1)),
+    };
+    env->funcall(env, args[0], 2, pair);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return)
+      break;
+  }
+  ptr->busy--;
+  if (ret != SQLITE_ROW && ret != SQLITE_DONE)
+    xsignal(error, build_string(sqlite3_errmsg(ptr->db)));
+  statement_cache_release(ptr->cache, stmt);
+  return Q(nil);
+}
+
+static
+emacs_value
+Fsqlite_encode_value(emacs_env *env, ptrdiff_t nargs __attribute__((unused)), emacs_value args[], void *data __attribute__((unused))) {
+  size_t len;
+  unsigned char *encoded = encode_value(env, args[0], &len);
+  if (!encoded)
+    return Q(nil);
+  emacs_value value = env->make_unibyte_string(env, (const char *)encoded, len);
+  free(encoded);
+  return call(propertize, value, Q(coding-system), Q(binary));
+}
+
+static
+emacs_value
+Fsqlite_decode_value(emacs_env *env, ptrdiff_t nargs __attribute__((unused)), emacs_value args[], void *data __attribute__((unused))) {
+  if (!CHECK_STRING(env, args[0]))
+    return Q(nil);
+  size_t len;
+  unsigned char *bytes = unibyte_bytes(env, args[0], &len);
+  emacs_value value = decode_value(env, bytes, len);
+  free(bytes);
+  return value ? value : Q(nil);
+}
+
+/* Start a group of writes to DB that is applied as a whole: in a
+   transaction of its own, or in a savepoint inside a transaction of
+   the user.  *OWN is set to whether the transaction is its own.  */
+static
+int
+write_group_begin(sqlite3 *db, bool *own) {
+  *own = sqlite3_get_autocommit(db);
+  return sqlite3_exec(db, *own ? "BEGIN IMMEDIATE" : "SAVEPOINT write_group", NULL, NULL, NULL);
+}
+
+/* End the group of writes to DB started by write_group_begin, keeping
+   them if COMMIT, and undoing them otherwise.  */
+static
+int
+write_group_end(sqlite3 *db, bool own, bool commit) {
+  if (commit)
+    return sqlite3_exec(db, own ? "COMMIT" : "RELEASE write_group", NULL, NULL, NULL);
+  if (!own)
+    sqlite3_exec(db, "ROLLBACK TO write_group; RELEASE write_group", NULL, NULL, NULL);
+  else if (!sqlite3_get_autocommit(db))
+    sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+  return SQLITE_OK;
+}
+
+/* The columns of a record of `sqlite-upsert' and the statement that
+   writes them.  */
+struct Upsert {
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  char **names;
+  int count;
+  int capacity;
+  int bound;
+  const char *errmsg;
+};
+
+/* Add the column named by KEY, a string or a symbol, to UPSERT.  A
+   leading colon of keywords is dropped.  */
+static
+bool
+upsert_add_column(emacs_env *env, struct Upsert *upsert, emacs_value key) {
+  char *name;
+  if (TYPEP(key, string)) {
+    name = copy_string(env, key);
+  } else if (TYPEP(key, symbol) && !NILP(key)) {
+    name = copy_string(env, call(symbol-name, key));
+    if (name[0] == ':')
+      memmove(name, name + 1, strlen(name));
+  } else {
+    xsignal(error, build_string("Invalid column name"), key);
+    return false;
+  }
+
+  if (upsert->count == upsert->capacity) {
+    upsert->capacity = upsert->capacity ? upsert->capacity * 2 : 8;
+    upsert->names = realloc(upsert->names, upsert->capacity * sizeof(char *));
+  }
+  upsert->names[upsert->count++] = name;
+  return true;
+}
+
+static
+void
+upsert_clear_columns(struct Upsert *upsert) {
+  for (int i = 0; i < upsert->count; ++i)
+    free(upsert->names[i]);
+  upsert->count = 0;
+}
+
+/* Whether UPSERT has the columns of LAST, in the same order.  */
+static
+bool
+upsert_same_columns(struct Upsert *upsert, struct Upsert *last) {
+  if (upsert->count != last->count)
+    return false;
+  for (int i = 0; i < upsert->count; ++i)
+    if (strcmp(upsert->names[i], last->names[i]))
+      return false;
+  return true;
+}
+
+/* Make LAST a copy of the columns of UPSERT.  */
+static
+void
+upsert_copy_columns(struct Upsert *upsert, struct Upsert *last) {
+  upsert_clear_columns(last);
+  if (last->capacity < upsert->count) {
+    last->capacity = upsert->capacity;
+    last->names = realloc(last->names, last->capacity * sizeof(char *));
+  }
+  for (int i = 0; i < upsert->count; ++i)
+    last->names[i] = strdup(upsert->names[i]);
+  last->count = upsert->count;
+}
+
+static
+emacs_value
+upsert_hash_column(emacs_env *env, ptrdiff_t nargs __attribute__((unused)), emacs_value args[], void *data) {
+  upsert_add_column(env, (struct Upsert *)data, args[0]);
+  return Q(nil);
+}
+
+static
+emacs_value
+upsert_hash_bind(emacs_env *env, ptrdiff_t nargs __attribute__((unused)), emacs_value args[], void *data) {
+  struct Upsert *upsert = (struct Upsert *)data;
+  if (!upsert->errmsg)
+    upsert->errmsg = bind_value(env, upsert->db, upsert->stmt, ++upsert->bound, args[1]);
+  return Q(nil);
+}
+
+/* Return the statement that writes the columns of UPSERT to TABLE,
+   updating rows that conflict on the COUNT columns CONFLICT.  Value
+   is a string to be freed with sqlite3_free.  */
+static
+char *
+upsert_sql(const char *table, struct Upsert *upsert, char **conflict, int count) {
+  sqlite3_str *sql = sqlite3_str_new(NULL);
+  sqlite3_str_appendf(sql, "INSERT INTO \"%w\" (", table);
+  for (int i = 0; i < upsert->count; ++i)
+    sqlite3_str_appendf(sql, "%s\"%w\"", i ? ", " : "", upsert->names[i]);
+  sqlite3_str_appendall(sql, ") VALUES (");
+  for (int i = 0; i < upsert->count; ++i)
+    sqlite3_str_appendf(sql, "%s?%d", i ? ", " : "", i + 1);
+  sqlite3_str_appendall(sql, ") ON CONFLICT");
+  if (count) {
+    for (int i = 0; i < count; ++i)
+      sqlite3_str_appendf(sql, "%s\"%w\"", i ? ", " : " (", conflict[i]);
+    sqlite3_str_appendall(sql, ")");
+  }
+
+  const char *sep = " DO UPDATE SET ";
+  for (int i = 0; i < upsert->count; ++i) {
+    bool key = false;
+    for (int j = 0; j < count && !key; ++j)
+      key = !strcmp(upsert->names[i], conflict[j]);
+    if (!key) {
+      sqlite3_str_appendf(sql, "%s\"%w\" = excluded.\"%w\"", sep, upsert->names[i], upsert->names[i]);
+      sep = ", ";
+    }
   }
+  /* Nothing to update when all columns are keys.  */
+  if (*sep == ' ')
+    sqlite3_str_appendall(sql, " DO NOTHING");
+  return sqlite3_str_finish(sql);
+}
 
-  /* Bind ? values.  */
-  if ((nargs > 2) && !NILP (args[2])) {
-    const char *err = bind_values(env, ptr->db, stmt, args[2]);
-    if (err) {
-      errmsg = err;
-      goto exit;
+/* Write RECORD, a plist or a hash table, with the statement for its
+   columns.  LAST holds the columns of the statement of the previous
+   record, which is reused without generating its SQL again if RECORD
+   has the same columns in the same order.  */
+static
+const char *
+upsert_record(emacs_env *env, struct Lisp_Sqlite *ptr, struct Upsert *upsert, const char *table,
+              char **conflict, int count, emacs_value record, struct Upsert *last) {
+  bool hash = TYPEP(record, hash-table);
+  upsert_clear_columns(upsert);
+  if (hash) {
+    call(maphash, env->make_function(env, 2, 2, upsert_hash_column, NULL, upsert), record);
+  } else {
+    for (emacs_value tail = record; !NILP(tail); tail = call(cdr, call(cdr, tail))) {
+      if (!TYPEP(tail, cons) || !TYPEP(call(cdr, tail), cons)) {
+        xsignal(error, build_string("Records must be plists or hash tables"), record);
+        return "";
+      }
+      if (!upsert_add_column(env, upsert, call(car, tail)))
+        break;
     }
   }
+  if (env->non_local_exit_check(env) != emacs_funcall_exit_return)
+    return "";
+  if (!upsert->count) {
+    xsignal(error, build_string("Empty record"));
+    return "";
+  }
 
-  ret = sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
-  if (ret != SQLITE_OK && ret != SQLITE_DONE) {
-    errmsg = sqlite3_errmsg(ptr->db);
-    goto exit;
+  if (upsert->stmt && upsert_same_columns(upsert, last)) {
+    sqlite3_reset(upsert->stmt);
+  } else {
+    if (upsert->stmt)
+      statement_cache_release(ptr->cache, upsert->stmt);
+    upsert_clear_columns(last);
+    char *sql = upsert_sql(table, upsert, conflict, count);
+    int ret;
+    upsert->stmt = statement_cache_prepare(ptr->db, ptr->cache, sql, &ret);
+    sqlite3_free(sql);
+    if (ret != SQLITE_OK)
+      return sqlite3_errmsg(ptr->db);
+    upsert_copy_columns(upsert, last);
   }
 
-  return make_int(sqlite3_changes(ptr->db));
- exit:
-  if (ret == SQLITE_LOCKED || ret == SQLITE_BUSY) {
-    xsignal(sqlite_locked_error, build_string(errmsg));
+  upsert->errmsg = NULL;
+  upsert->bound = 0;
+  if (hash) {
+    call(maphash, env->make_function(env, 2, 2, upsert_hash_bind, NULL, upsert), record);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return)
+      return "";
+    if (upsert->errmsg)
+      return upsert->errmsg;
+    /* The table was changed from the hash function.  */
+    if (upsert->bound != upsert->count) {
+      xsignal(error, build_string("Record changed while writing it"));
+      return "";
+    }
   } else {
-    xsignal(error, build_string(errmsg));
+    emacs_value tail = record;
+    for (int i = 0; i < upsert->count; ++i) {
+      tail = call(cdr, tail);
+      const char *errmsg = bind_value(env, ptr->db, upsert->stmt, i + 1, call(car, tail));
+      if (errmsg)
+        return errmsg;
+      tail = call(cdr, tail);
+    }
   }
 
-  return Q(nil);
+  if (sqlite3_step(upsert->stmt) != SQLITE_DONE)
+    return sqlite3_errmsg(ptr->db);
+  return NULL;
 }
 
 static
 emacs_value
-row_to_value(emacs_env *env, sqlite3_stmt *stmt) {
-  int len = sqlite3_column_count(stmt);
-  emacs_value values = Q(nil);
+Fsqlite_upsert(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
+  if (!ptr)
+    return Q(nil);
+  if (!CHECK_STRING(env, args[1]))
+    return Q(nil);
 
-  for (int i = 0; i < len; ++i) {
-    emacs_value v;
+  emacs_value records = args[2];
+  bool is_vector = TYPEP(records, vector);
+  if (!(is_vector || NILP(records) || TYPEP(records, cons))) {
+    xsignal(error, build_string("RECORDS must be a list or a vector"));
+    return Q(nil);
+  }
+  emacs_value conflict_columns = keyword_arg(env, nargs, args, 3, ":conflict-columns");
 
-    switch (sqlite3_column_type (stmt, i)) {
-    case SQLITE_INTEGER:
-      v = make_int(sqlite3_column_int64(stmt, i));
-      break;
-    case SQLITE_FLOAT:
-      v = env->make_float(env, sqlite3_column_double(stmt, i));
-      break;
-    case SQLITE_BLOB:
-      v = env->make_unibyte_string(env,
-                                   sqlite3_column_blob(stmt, i),
-                                   sqlite3_column_bytes(stmt, i));
-      break;
-    case SQLITE_TEXT:
-      v = env->make_string(env,
-                           (const char *)sqlite3_column_text(stmt, i),
-                           sqlite3_column_bytes(stmt, i));
-      break;
-    default:
-      v = Q(nil);
-      break;
+  /* The conflict columns are collected like the columns of a record.  */
+  struct Upsert keys = { 0 };
+  for (emacs_value tail = conflict_columns; !NILP(tail); tail = call(cdr, tail)) {
+    if (!TYPEP(tail, cons) || !upsert_add_column(env, &keys, call(car, tail))) {
+      if (env->non_local_exit_check(env) == emacs_funcall_exit_return)
+        xsignal(error, build_string("CONFLICT-COLUMNS must be a list"), conflict_columns);
+      upsert_clear_columns(&keys);
+      free(keys.names);
+      return Q(nil);
     }
+  }
 
-    values = call(cons, v, values);
+  char *table = copy_string(env, args[1]);
+  struct Upsert upsert = { .db = ptr->db };
+  struct Upsert last = { 0 };
+  const char *errmsg = NULL;
+  int changes = 0;
+
+  bool own;
+  if (write_group_begin(ptr->db, &own) != SQLITE_OK)
+    errmsg = sqlite3_errmsg(ptr->db);
+
+  int len = is_vector ? env->vec_size(env, records) : XFIXNUM(call(length, records));
+  for (int i = 0; i < len && !errmsg; ++i) {
+    emacs_value record;
+    if (is_vector) {
+      record = env->vec_get(env, records, i);
+    } else {
+      record = call(car, records);
+      records = call(cdr, records);
+    }
+    errmsg = upsert_record(env, ptr, &upsert, table, keys.names, keys.count, record, &last);
+    if (!errmsg)
+      changes += sqlite3_changes(ptr->db);
   }
 
-  return call(nreverse, values);
-}
+  if (upsert.stmt)
+    statement_cache_release(ptr->cache, upsert.stmt);
+  if (!errmsg && write_group_end(ptr->db, own, true) != SQLITE_OK)
+    errmsg = sqlite3_errmsg(ptr->db);
 
-static
-emacs_value
-column_names(emacs_env *env, sqlite3_stmt *stmt) {
-  emacs_value columns = Q(nil);
-  int count = sqlite3_column_count(stmt);
-  for (int i = 0; i < count; ++i)
-    columns = call(cons, build_string(sqlite3_column_name(stmt, i)), columns);
+  emacs_value value = make_int(changes);
+  if (errmsg) {
+    /* A pending signal is already set if the message is empty.  */
+    if (*errmsg)
+      xsignal(error, build_string(errmsg));
+    write_group_end(ptr->db, own, false);
+    value = Q(nil);
+  }
 
-  return call(nreverse, columns);
+  upsert_clear_columns(&upsert);
+  free(upsert.names);
+  upsert_clear_columns(&last);
+  free(last.names);
+  upsert_clear_columns(&keys);
+  free(keys.names);
+  free(table);
+  return value;
 }
 
 static
 emacs_value
-Fsqlite_select(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+Fsqlite_execute_returning(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
   struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
   if (!ptr)
     return Q(nil);
 
-  if(!CHECK_STRING(env, args[1]))
+  if (!CHECK_STRING(env, args[1]))
     return Q(nil);
 
-  const char *errmsg = NULL;
-  ptrdiff_t size = 0;
-  env->copy_string_contents(env, args[1], NULL, &size);
-  char *encoded = malloc(size);
-  env->copy_string_contents(env, args[1], encoded, &size);
-  sqlite3_stmt *stmt = NULL;
+  ptrdiff_t positional = positional_args(env, nargs, args, 2);
+  emacs_value values = (positional > 2) ? args[2] : Q(nil);
+  emacs_value hints = keyword_arg(env, nargs, args, positional, ":decode");
 
-  int ret = sqlite3_prepare_v2(ptr->db, encoded, size, &stmt, NULL);
+  char *encoded = copy_string(env, args[1]);
+  int ret;
+  sqlite3_stmt *stmt = statement_cache_prepare(ptr->db, ptr->cache, encoded, &ret);
   free(encoded);
 
+  const char *errmsg = NULL;
   if (ret != SQLITE_OK) {
-    if (stmt)
-      sqlite3_finalize (stmt);
-    errmsg = sqlite_prepare_errdata (ret, sdb);
+    errmsg = sqlite3_errmsg(ptr->db);
     goto exit;
   }
+  if (!stmt)
+    return Q(nil);
 
-  /* Query with parameters.  */
-  if ((nargs > 2) && !NILP(args[2])) {
-    const char *err = bind_values(env, ptr->db, stmt, args[2]);
+  unsigned char *decode = NULL;
+  if (!NILP(hints) && !(decode = decode_hints(env, hints, sqlite3_column_count(stmt)))) {
+    statement_cache_release(ptr->cache, stmt);
+    return Q(nil);
+  }
+
+  if (!NILP(values)) {
+    const char *err = bind_values(env, ptr->db, stmt, values);
     if (err) {
-      sqlite3_finalize (stmt);
+      free(decode);
+      statement_cache_release(ptr->cache, stmt);
       errmsg = err;
       goto exit;
     }
   }
 
-  /* Return a handle to get the data.  */
-  if ((nargs > 3) && EQ(args[3], Q(set)))
-    return lisp_statement_make(env, ptr->db, stmt);
-
-  /* Return the data directly.  */
+  /* Step to the end, so that all RETURNING rows are seen.  */
   emacs_value retval = Q(nil);
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+    retval = call(cons, row_to_value(env, stmt, decode), retval);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return)
+      break;
+  }
+  free(decode);
 
-  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
-    retval = call(cons, row_to_value(env, stmt), retval);
-
-  retval = call(nreverse, retval);
-
-  if ((nargs > 3) && EQ(args[3], Q(full)))
-    retval = call(cons, column_names(env, stmt), retval);
+  if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+    statement_cache_release(ptr->cache, stmt);
+    return Q(nil);
+  }
+  if (ret != SQLITE_DONE) {
+    errmsg = sqlite3_errmsg(ptr->db);
+    statement_cache_release(ptr->cache, stmt);
+    goto exit;
+  }
 
-  sqlite3_finalize (stmt);
-  return retval;
+  statement_cache_release(ptr->cache, stmt);
+  return call(nreverse, retval);
  exit:
-  xsignal(error, build_string(errmsg));
+  if (ret == SQLITE_LOCKED || ret == SQLITE_BUSY) {
+    xsignal(sqlite_locked_error, build_string(errmsg));
+  } else {
+    xsignal(error, build_string(errmsg));
+  }
   return Q(nil);
 }
 
 static
 emacs_value
-Fsqlite_transaction(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
-  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
-  int ret = sqlite3_exec(ptr->db, "begin", NULL, NULL, NULL);
-  if (ret != SQLITE_OK)
-    return Q(nil);
-  return Q(t);
-}
-
-static
-emacs_value
-Fsqlite_commit(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+Fsqlite_execute_batch(emacs_env *env, ptrdiff_t nargs __attribute__((unused)), emacs_value args[], void *data __attribute__((unused))) {
   struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
   if (!ptr)
     return Q(nil);
 
-  int ret = sqlite3_exec(ptr->db, "commit", NULL, NULL, NULL);
-  if (ret != SQLITE_OK)
+  if (!CHECK_STRING(env, args[1]))
     return Q(nil);
-  return Q(t);
-}
 
-static
-emacs_value
-Fsqlite_rollback(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
-  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
-  if (!ptr)
+  emacs_value sets = args[2];
+  bool is_vector = TYPEP(sets, vector);
+  if (!(is_vector || NILP(sets) || TYPEP(sets, cons))) {
+    xsignal(error, build_string("VALUE-SETS must be a list or a vector"));
     return Q(nil);
+  }
+  int len = is_vector ? env->vec_size(env, sets) : XFIXNUM(call(length, sets));
 
-  int ret = sqlite3_exec(ptr->db, "rollback", NULL, NULL, NULL);
-  if (ret != SQLITE_OK)
-    return Q(nil);
-  return Q(t);
-}
+  char *encoded = copy_string(env, args[1]);
+  int ret;
+  sqlite3_stmt *stmt = statement_cache_prepare(ptr->db, ptr->cache, encoded, &ret);
+  free(encoded);
 
-static
-emacs_value
-Fsqlite_pragma(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
-  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
-  if (!ptr)
+  if (ret != SQLITE_OK) {
+    xsignal(error, build_string(sqlite3_errmsg(ptr->db)));
+    return Q(nil);
+  }
+  if (!stmt) {
+    xsignal(error, build_string("Empty query"));
     return Q(nil);
+  }
 
-  emacs_value pragma = call(concat, build_string("PRAGMA "), args[1]);
+  const char *errmsg = NULL;
+  bool own;
+  if (write_group_begin(ptr->db, &own) != SQLITE_OK)
+    errmsg = sqlite3_errmsg(ptr->db);
 
-  ptrdiff_t size = 0;
-  env->copy_string_contents(env, pragma, NULL, &size);
-  char *encoded = malloc(size);
-  env->copy_string_contents(env, pragma, encoded, &size);
+  emacs_value *rowids = calloc(len + 1, sizeof(emacs_value));
+  for (int i = 0; i < len && !errmsg; ++i) {
+    emacs_value values;
+    if (is_vector) {
+      values = env->vec_get(env, sets, i);
+    } else {
+      values = call(car, sets);
+      sets = call(cdr, sets);
+    }
 
-  int ret = sqlite3_exec(ptr->db, encoded, NULL, NULL, NULL);
-  free(encoded);
-  if (ret != SQLITE_OK)
-    return Q(nil);
-  return Q(t);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (!NILP(values) && (errmsg = bind_values(env, ptr->db, stmt, values)))
+      break;
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+      ;
+    if (ret != SQLITE_DONE) {
+      errmsg = sqlite3_errmsg(ptr->db);
+      break;
+    }
+    rowids[i] = make_int(sqlite3_last_insert_rowid(ptr->db));
+  }
+
+  statement_cache_release(ptr->cache, stmt);
+  if (!errmsg && write_group_end(ptr->db, own, true) != SQLITE_OK)
+    errmsg = sqlite3_errmsg(ptr->db);
+
+  emacs_value retval = Q(nil);
+  if (errmsg) {
+    /* A pending signal is already set if the message is empty.  */
+    if (*errmsg)
+      xsignal(error, build_string(errmsg));
+    write_group_end(ptr->db, own, false);
+  } else {
+    retval = env->funcall(env, Q(vector), len, rowids);
+  }
+  free(rowids);
+  return retval;
 }
 
+/* Prepare the query in ARGS[1] with the values in ARGS[2], if any, and
+   step it once.  Value is the statement, to be released to the cache
+   of PTR, or NULL with an error signaled.  */
 static
-emacs_value
-Fsqlite_next(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
-  struct Lisp_Statement *ptr = lisp_statement_check(env, args[0]);
-  if (!ptr)
-    return Q(nil);
+sqlite3_stmt *
+select_first(emacs_env *env, struct Lisp_Sqlite *ptr, ptrdiff_t nargs, emacs_value args[nargs], int *ret) {
+  if (!CHECK_STRING(env, args[1]))
+    return NULL;
 
-  int ret = sqlite3_step(ptr->stmt);
-  if (ret != SQLITE_ROW && ret != SQLITE_OK && ret != SQLITE_DONE) {
-    xsignal(error, build_string(sqlite3_errmsg(ptr->db)));
-    return Q(nil);
-  }
+  char *encoded = copy_string(env, args[1]);
+  sqlite3_stmt *stmt = statement_cache_prepare(ptr->db, ptr->cache, encoded, ret);
+  free(encoded);
 
-  if (ret == SQLITE_DONE) {
-    ptr->eof = true;
-    return Q(nil);
+  const char *errmsg = NULL;
+  if (*ret != SQLITE_OK) {
+    errmsg = sqlite3_errmsg(ptr->db);
+  } else if (!stmt) {
+    errmsg = "Empty query";
+  } else if (nargs > 2 && !NILP(args[2])) {
+    errmsg = bind_values(env, ptr->db, stmt, args[2]);
+  }
+  if (!errmsg) {
+    *ret = sqlite3_step(stmt);
+    if (*ret != SQLITE_ROW && *ret != SQLITE_DONE)
+      errmsg = sqlite3_errmsg(ptr->db);
   }
 
-  return row_to_value(env, ptr->stmt);
+  if (errmsg) {
+    if (*errmsg) {
+      if (*ret == SQLITE_LOCKED || *ret == SQLITE_BUSY)
+        xsignal(sqlite_locked_error, build_string(errmsg));
+      else
+        xsignal(error, build_string(errmsg));
+    }
+    if (stmt)
+      statement_cache_release(ptr->cache, stmt);
+    return NULL;
+  }
+  return stmt;
 }
 
 static
 emacs_value
-Fsqlite_columns(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
-  struct Lisp_Statement *ptr = lisp_statement_check(env, args[0]);
+Fsqlite_select_value(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
   if (!ptr)
     return Q(nil);
 
-  return column_names(env, ptr->stmt);
-}
-
-static
-emacs_value
-Fsqlite_more_p(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
-  struct Lisp_Statement *ptr = lisp_statement_check(env, args[0]);
-  if (!ptr)
+  int ret;
+  sqlite3_stmt *stmt = select_first(env, ptr, nargs, args, &ret);
+  if (!stmt)
     return Q(nil);
 
-  if (!ptr->eof)
-    return Q(t);
-  return Q(nil);
+  emacs_value value = Q(nil);
+  if (ret == SQLITE_ROW)
+    value = value_to_lisp(env, sqlite3_column_value(stmt, 0));
+  /* Releasing resets the statement, which ends its read transaction.  */
+  statement_cache_release(ptr->cache, stmt);
+  return value;
 }
 
 static
 emacs_value
-Fsqlite_finalize(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
-  struct Lisp_Statement *ptr = lisp_statement_check(env, args[0]);
+Fsqlite_exists_p(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs], void *data __attribute__((unused))) {
+  struct Lisp_Sqlite *ptr = lisp_sqlite_check(env, args[0]);
   if (!ptr)
     return Q(nil);
 
-  sqlite3_finalize(ptr->stmt);
-  ptr->stmt = NULL;
-  return Q(t);
+  int ret;
+  sqlite3_stmt *stmt = select_first(env, ptr, nargs, args, &ret);
+  if (!stmt)
+    return Q(nil);
+
+  statement_cache_release(ptr->cache, stmt);
+  return (ret == SQLITE_ROW) ? Q(t) : Q(nil);
 }
 
 static
@@ -578,6 +7794,15 @@ Fsqlite_available_p(emacs_env *env, ptrdiff_t nargs, emacs_value args[nargs] __a
 int
 emacs_module_init(struct emacs_runtime *ert) {
   emacs_env *env = ert->get_environment(ert);
+  crc32_init();
+  vec_init();
+  main_thread = pthread_self();
+
+#ifdef SQLITE_BACKPORT_EXTENSIONS
+#define X(init) sqlite3_auto_extension((void (*)(void))init);
+  SQLITE_BACKPORT_EXTENSIONS
+#undef X
+#endif
 
   struct {
     const char *name;
@@ -591,9 +7816,24 @@ emacs_module_init(struct emacs_runtime *ert) {
       EMACS_ATTRIBUTE_NONNULL(1);
     const char *docstring;
   } funcs[] = {
-    {"sqlite-open", 0, 1, Fsqlite_open,
+    {"sqlite-open", 0, emacs_variadic_function, Fsqlite_open,
      "Open FILE as an sqlite database.\n"
-     "If FILE is nil, an in-memory database will be opened instead."},
+     "If FILE is nil, an in-memory database will be opened instead.\n"
+     "\n"
+     "If SHARED is non-nil, every handle opened with :shared on the same\n"
+     "file uses a single connection and statement cache, which is closed\n"
+     "when the last of them is closed.  Such handles also share their\n"
+     "transaction state.  `sqlite-session-start' and `sqlite-maintenance'\n"
+     "are not available on them, since they would apply to all of them.\n"
+     "\n"
+     "If LAZY is non-nil, the database is only opened when it is first\n"
+     "used, or when Emacs has been idle for LAZY seconds if it is a\n"
+     "number.  Errors opening it are then signaled on that first use.\n"
+     "\n(fn &optional FILE &key SHARED LAZY)"},
+    {"sqlite-ensure-open", 1, 1, Fsqlite_ensure_open,
+     "Open DB now if it was opened with :lazy and not used yet.\n"
+     "Value is t.  An error is signaled if DB cannot be opened, or has\n"
+     "been closed."},
     {"sqlite-close", 1, 1, Fsqlite_close,
      "Close the sqlite database DB."},
     {"sqlite-execute", 2, 3, Fsqlite_execute,
@@ -602,8 +7842,44 @@ emacs_module_init(struct emacs_runtime *ert) {
      "\n"
      "   insert into foo values (?, ?, ...)\n"
      "\n"
+     "Strings, numbers, nil, t and `false' are bound as SQL values.  Other\n"
+     "values, such as lists or symbols, are bound as BLOBs once wrapped\n"
+     "in `sqlite-encode-value'.\n"
+     "\n"
      "Value is the number of affected rows."},
-    {"sqlite-select", 2, 4, Fsqlite_select,
+    {"sqlite-execute-returning", 2, emacs_variadic_function, Fsqlite_execute_returning,
+     "Execute QUERY in DB like `sqlite-execute' and return the rows it returns.\n"
+     "QUERY is run to completion, so that all the rows of a RETURNING clause\n"
+     "are returned, as a list of lists.  VALUES and the :decode keyword\n"
+     "argument are as in `sqlite-select'.\n"
+     "\n(fn DB QUERY &optional VALUES &key DECODE)"},
+    {"sqlite-execute-batch", 3, 3, Fsqlite_execute_batch,
+     "Execute QUERY in DB once for each element of VALUE-SETS.\n"
+     "VALUE-SETS is a list or a vector of the values to bind, as VALUES of\n"
+     "`sqlite-execute'.  Either all executions are done or none: in one\n"
+     "transaction, or in a savepoint inside a transaction of the user.\n"
+     "\n"
+     "Value is a vector of the rowid of the last row inserted after each\n"
+     "execution, as `last_insert_rowid()' returns it."},
+    {"sqlite-upsert", 3, emacs_variadic_function, Fsqlite_upsert,
+     "Insert RECORDS into TABLE of DB, updating the rows they conflict with.\n"
+     "RECORDS is a list or a vector of plists or hash tables mapping column\n"
+     "names, as strings, symbols or keywords, to values.  Either all records\n"
+     "are written or none: in one transaction, or in a savepoint inside a\n"
+     "transaction of the user.  Consecutive records with the same columns\n"
+     "in the same order share a statement, which is kept in the statement\n"
+     "cache of DB.\n"
+     "\n"
+     "Keyword arguments:\n"
+     ":conflict-columns COLUMNS  The columns of the unique index to check for\n"
+     "                          conflicts.  Without them, a conflict on any\n"
+     "                          unique constraint updates the row, which needs\n"
+     "                          SQLite 3.35 or later.\n"
+     "\n"
+     "Value is the number of rows inserted or updated.\n"
+     "\n"
+     "(fn DB TABLE RECORDS &key CONFLICT-COLUMNS)"},
+    {"sqlite-select", 2, emacs_variadic_function, Fsqlite_select,
      "Select data from the database DB that matches QUERY.\n"
      "If VALUES is non-nil, it should be a list or a vector specifying the\n"
      "values that will be interpolated into a parameterized statement.\n"
@@ -615,7 +7891,33 @@ emacs_module_init(struct emacs_runtime *ert) {
      "should be returned as a list of rows), or `full' (the same, but the\n"
      "first element in the return list will be the column names), or `set',\n"
      "which means that we return a set object that can be queried with\n"
-     "`sqlite-next' and other functions to get the data."},
+     "`sqlite-next' and other functions to get the data.\n"
+     "\n"
+     "Keyword arguments:\n"
+     ":decode HINTS     A list with an element for each column saying how\n"
+     "                  to decode it: nil, `decompress' to return the\n"
+     "                  value of decompress() on the column without\n"
+     "                  passing the compressed bytes to Lisp, or `lisp'\n"
+     "                  to decode values of `sqlite-encode-value'.\n"
+     ":yield-every N    Let Emacs process input, timers and process output\n"
+     "                  after every N rows, and return nil if the user\n"
+     "                  asks to quit.  DB cannot be closed meanwhile.\n"
+     "\n(fn DB QUERY &optional VALUES RETURN-TYPE &key DECODE YIELD-EVERY)"},
+    {"sqlite-select-map", 3, emacs_variadic_function, Fsqlite_select_map,
+     "Call FUNCTION on each row of QUERY in DB, without making a list of them.\n"
+     "Each row is passed as a list.  VALUES and the keyword arguments are\n"
+     "as in `sqlite-select'.  Value is the number of rows, or nil if the\n"
+     "user asked to quit.\n"
+     "\n(fn FUNCTION DB QUERY &optional VALUES &key DECODE YIELD-EVERY)"},
+    {"sqlite-select-value", 2, 3, Fsqlite_select_value,
+     "Return the first column of the first row that QUERY selects in DB.\n"
+     "VALUES are bound as in `sqlite-select'.  Value is nil if there is\n"
+     "no row.  The statement is reset at once, so that no read transaction\n"
+     "stays open."},
+    {"sqlite-exists-p", 2, 3, Fsqlite_exists_p,
+     "Return non-nil if QUERY selects any row in DB.\n"
+     "VALUES are bound as in `sqlite-select'.  Only the first row is\n"
+     "stepped to, and no values are converted."},
     {"sqlite-transaction", 1, 1, Fsqlite_transaction,
      "Start a transaction in DB."},
     {"sqlite-commit", 1, 1, Fsqlite_commit,
@@ -633,6 +7935,286 @@ emacs_module_init(struct emacs_runtime *ert) {
     {"sqlite-finalize", 1, 1, Fsqlite_finalize,
      "Mark this SET as being finished.\n"
      "This will free the resources held by SET."},
+    {"sqlite-create-function", 4, 5, Fsqlite_create_function,
+     "Define the SQL function NAME in DB, implemented by FUNCTION.\n"
+     "ARITY is the number of arguments, or nil to accept any number.\n"
+     "\n"
+     "FUNCTION is called with the arguments converted to Lisp values, and\n"
+     "its value is returned to SQL.  If FUNCTION is a cons (STEP . FINAL),\n"
+     "an aggregate function is defined instead: STEP is called with the\n"
+     "state returned by its previous call (initially nil) followed by the\n"
+     "arguments, and FINAL is called with the last state to produce the\n"
+     "result.  If FUNCTION is nil, the function NAME is removed.\n"
+     "\n"
+     "If DETERMINISTIC is non-nil, FUNCTION always returns the same result\n"
+     "for the same arguments, so SQLite may use it in indexes and factor it\n"
+     "out of loops.\n"
+     "\n"
+     "The natively implemented functions regexp (backing the REGEXP\n"
+     "operator, with Emacs regexp syntax), casefold, fnv1a and crc32, and\n"
+     "the collations emacs and emacs_nocase are always available."},
+    {"sqlite-fts-index-files", 3, emacs_variadic_function, Fsqlite_fts_index_files,
+     "Index FILES into the full-text search TABLE of DB.\n"
+     "TABLE must have the columns path and content.  The rows previously\n"
+     "indexed for each of FILES are replaced by rows holding the text of\n"
+     "the file, split into chunks at line boundaries.  Files that cannot\n"
+     "be read are skipped.  Value is the number of files indexed.\n"
+     "\n"
+     "Keyword arguments:\n"
+     ":chunk-size N  Make chunks of about N bytes (default 4096), or\n"
+     "               store each file in one row if N is 0.\n"
+     ":async BOOL    Index on a worker thread through a connection of\n"
+     "               its own, and return a job object instead.  The\n"
+     "               result is then available from `sqlite-job-wait'.\n"
+     ":callback FN   Call FN with the job object once an asynchronous\n"
+     "               job is done.\n"
+     "\n(fn DB TABLE FILES &key CHUNK-SIZE ASYNC CALLBACK)"},
+    {"sqlite-fts-index-buffer", 3, emacs_variadic_function, Fsqlite_fts_index_buffer,
+     "Index the text of BUFFER into the full-text search TABLE of DB.\n"
+     "This is like `sqlite-fts-index-files', with the rows stored under\n"
+     "PATH, which defaults to the file name or name of BUFFER.\n"
+     "\n(fn DB TABLE BUFFER &key PATH CHUNK-SIZE ASYNC CALLBACK)"},
+    {"sqlite-fts-offsets", 3, emacs_variadic_function, Fsqlite_fts_offsets,
+     "Return the positions of the matches of QUERY in the FTS5 TABLE of DB.\n"
+     "Value is a list of (ROWID . OFFSETS) for the matching rows, best\n"
+     "match first.  OFFSETS is a vector of integer triples COLUMN START\n"
+     "LENGTH, where START and LENGTH count characters of the column text,\n"
+     "so matches can be highlighted without fetching snippets.\n"
+     "\n"
+     "The same offsets are available in SQL as the BLOB returned by the\n"
+     "auxiliary function match_offsets(TABLE).\n"
+     "\n"
+     "Keyword arguments:\n"
+     ":limit N  Return at most N rows.\n"
+     "\n(fn DB TABLE QUERY &key LIMIT)"},
+    {"sqlite-index-directory", 3, emacs_variadic_function, Fsqlite_index_directory,
+     "Index the files under DIR into TABLE of DB on a worker thread.\n"
+     "TABLE is created if needed with the columns path (the primary key),\n"
+     "size, mtime and inode, and is updated to hold one row for every\n"
+     "regular file under DIR.  Files whose size, modification time and\n"
+     "inode did not change are not written again, and the rows of files\n"
+     "that no longer exist are deleted.  The rows under a directory that\n"
+     "cannot be read are kept, and the job fails with its error once the\n"
+     "rest of DIR is indexed.\n"
+     "\n"
+     "Value is a job object; `sqlite-job-wait' returns the number of rows\n"
+     "inserted, updated or deleted.  Symbolic links are not followed.\n"
+     "\n"
+     "Keyword arguments:\n"
+     ":match REGEXP    Only index files whose name matches REGEXP.\n"
+     ":exclude REGEXP  Skip files, and directories with everything in\n"
+     "                 them, whose name matches REGEXP.\n"
+     ":callback FN     Call FN with the job object once it is done.\n"
+     "\n(fn DB DIR TABLE &key MATCH EXCLUDE CALLBACK)"},
+    {"sqlite-open-shards", 1, 1, Fsqlite_open_shards,
+     "Open FILES as the shards of one logical database.\n"
+     "Value is an object for `sqlite-shards-select', closed with\n"
+     "`sqlite-close'.  Unlike ATTACH, the number of shards is not limited."},
+    {"sqlite-shards-p", 1, 1, Fsqlite_shards_p,
+     "Say whether OBJECT is an object of `sqlite-open-shards'.\n"
+     "Such objects are not `sqlitep', as they only work with\n"
+     "`sqlite-shards-select' and `sqlite-close'."},
+    {"sqlite-shards-select", 2, emacs_variadic_function, Fsqlite_shards_select,
+     "Run QUERY on every shard of SHARDS in parallel and return all rows.\n"
+     "VALUES are bound as in `sqlite-select'.  By default the rows of each\n"
+     "shard follow those of the previous one.\n"
+     "\n"
+     "Keyword arguments:\n"
+     ":order-by COLUMN  Merge the rows on COLUMN, a column index or name.\n"
+     "                  QUERY must return the rows of each shard sorted\n"
+     "                  on it, with ORDER BY.\n"
+     ":descending BOOL  The rows are sorted in descending order.\n"
+     ":limit N          Return at most N rows.\n"
+     "\n(fn SHARDS QUERY &optional VALUES &key ORDER-BY DESCENDING LIMIT)"},
+    {"sqlite-session-start", 1, 2, Fsqlite_session_start,
+     "Start recording the changes made to TABLES of DB.\n"
+     "If TABLES is nil, record changes to all tables.  Only tables with a\n"
+     "PRIMARY KEY are recorded.  Any session already started on DB is\n"
+     "discarded."},
+    {"sqlite-session-changeset", 1, 2, Fsqlite_session_changeset,
+     "Return the changes recorded by the session of DB as a unibyte string.\n"
+     "The changeset covers all changes since `sqlite-session-start'.  If END\n"
+     "is non-nil, stop recording afterwards.\n"
+     "\n(fn DB &optional END)"},
+    {"sqlite-changeset-apply", 2, emacs_variadic_function, Fsqlite_changeset_apply,
+     "Apply CHANGESET, from `sqlite-session-changeset', to DB.\n"
+     "Value is t, or an error is signaled if applying was aborted, in which\n"
+     "case no change is made.\n"
+     "\n"
+     "Keyword arguments:\n"
+     ":conflict-handler FUNC  Called with the kind of conflict (one of\n"
+     "                        `data', `notfound', `conflict', `constraint'\n"
+     "                        or `foreign-key'), the table name, the\n"
+     "                        operation (`insert', `update' or `delete')\n"
+     "                        and, for `data' and `conflict', the row in\n"
+     "                        DB.  It returns `omit' to skip the change,\n"
+     "                        `replace' to overwrite the row or `abort'.\n"
+     "                        Without it, conflicting changes are omitted.\n"
+     "\n(fn DB CHANGESET &key CONFLICT-HANDLER)"},
+    {"sqlite-select-diff", 2, emacs_variadic_function, Fsqlite_select_diff,
+     "Run QUERY on DB and return how its result changed since TOKEN.\n"
+     "VALUES are bound as in `sqlite-select'.  TOKEN is nil or a token from\n"
+     "a previous call for the same QUERY.  Value is a list\n"
+     "\n"
+     "   (NEW-TOKEN INSERTED UPDATED DELETED)\n"
+     "\n"
+     "where INSERTED and UPDATED are lists of rows in result order and\n"
+     "DELETED is a list of the keys of the rows no longer present.  Rows\n"
+     "are identified by their key, which must be unique in the result.\n"
+     "Only a hash of each row is kept in the token.\n"
+     "\n"
+     "Keyword arguments:\n"
+     ":key COLUMN  The key column, an index or a name.  Defaults to 0.\n"
+     "\n(fn DB QUERY VALUES TOKEN &key KEY)"},
+    {"sqlite-cursor", 4, emacs_variadic_function, Fsqlite_cursor,
+     "Return a cursor paging through the rows of QUERY on DB.\n"
+     "VALUES are bound as in `sqlite-select'.  KEYS is a column name of\n"
+     "the result, or a list of them, that orders the rows uniquely and\n"
+     "is never NULL.  Pages are fetched with `sqlite-cursor-next-page' and\n"
+     "`sqlite-cursor-prev-page', by seeking past the keys of the current\n"
+     "page, so deep pages cost the same as the first one.  QUERY should\n"
+     "not have an ORDER BY or LIMIT of its own.\n"
+     "\n"
+     "Keyword arguments:\n"
+     ":page-size N      Rows per page, at least 1.  Defaults to 100.\n"
+     ":descending BOOL  Page through the keys in descending order.\n"
+     "\n(fn DB QUERY VALUES KEYS &key PAGE-SIZE DESCENDING)"},
+    {"sqlite-cursor-next-page", 1, 1, Fsqlite_cursor_next_page,
+     "Return the rows of the page after the current page of CURSOR.\n"
+     "The first call returns the first page.  At the end, value is nil and\n"
+     "CURSOR stays on the last page."},
+    {"sqlite-cursor-prev-page", 1, 1, Fsqlite_cursor_prev_page,
+     "Return the rows of the page before the current page of CURSOR.\n"
+     "At the start, value is nil and CURSOR stays on the first page."},
+    {"sqlite-load-extension", 2, 2, Fsqlite_load_extension,
+     "Load an SQlite MODULE into DB.\n"
+     "MODULE should be the name of an SQlite module's file, a\n"
+     "shared library in the system-dependent format and having a\n"
+     "system-dependent file-name extension.\n"
+     "\n"
+     "Only modules on Emacs' list of allowed modules can be loaded.\n"
+     "\n(fn DB MODULE)"},
+    {"sqlite-explain-analyze", 2, 3, Fsqlite_explain_analyze,
+     "Run QUERY on DB to completion and return how it was executed.\n"
+     "VALUES are bound as in `sqlite-select'; the rows are discarded.\n"
+     "Value is a plist with the number of :rows, the elapsed :time in\n"
+     "seconds, the statement counters :vm-steps, :fullscan-steps, :sorts\n"
+     "and :autoindex, and the :plan.  The plan is a list of nodes from\n"
+     "EXPLAIN QUERY PLAN, each a plist with :id, :detail and :children.\n"
+     "If SQLite was built with SQLITE_ENABLE_STMT_SCANSTATUS, loop nodes\n"
+     "also have the number of :loops, the :rows visited, the planner's\n"
+     ":estimate of rows and, since SQLite 3.42, the :cycles spent."},
+    {"sqlite-suggest-indexes", 1, 2, Fsqlite_suggest_indexes,
+     "Suggest indexes for the statements in SQL-LIST on DB.\n"
+     "If SQL-LIST is nil, use the statements recently run through\n"
+     "`sqlite-execute' and `sqlite-select', which are in the statement\n"
+     "cache of DB.  The indexes are tried on an in-memory copy of the\n"
+     "schema and its statistics, and DB is not changed.  Value is a plist\n"
+     "\n"
+     "   (:indexes CREATE-INDEX-STATEMENTS\n"
+     "    :statements ((SQL PLAN-BEFORE PLAN-AFTER) ...))\n"
+     "\n"
+     "where the plans are lists of EXPLAIN QUERY PLAN lines.\n"
+     "\n(fn DB &optional SQL-LIST)"},
+    {"sqlite-maintenance", 2, emacs_variadic_function, Fsqlite_maintenance,
+     "Enable or, if ENABLE is nil, disable automatic maintenance of DB.\n"
+     "When enabled, `sqlite-maintenance-run' is called from an idle timer\n"
+     "so that the planner statistics are kept fresh with PRAGMA optimize,\n"
+     "and free pages are released with PRAGMA incremental_vacuum if DB uses\n"
+     "auto_vacuum=incremental.  PRAGMA optimize also runs when DB is\n"
+     "closed.\n"
+     "\n"
+     "Keyword arguments:\n"
+     ":idle SECONDS          Idle time before running.  Defaults to 30.\n"
+     ":min-interval SECONDS  Minimum time between runs.  Defaults to 3600.\n"
+     ":analysis-limit N      Rows read per index by ANALYZE.  Defaults to 400.\n"
+     ":vacuum-pages N        Pages freed per run.  Defaults to 100.\n"
+     "\n(fn DB ENABLE &key IDLE MIN-INTERVAL ANALYSIS-LIMIT VACUUM-PAGES)"},
+    {"sqlite-maintenance-run", 1, 2, Fsqlite_maintenance_run,
+     "Run the maintenance of DB set by `sqlite-maintenance'.\n"
+     "Nothing is done inside a transaction or, unless FORCE is non-nil,\n"
+     "if maintenance is disabled or ran less than its minimum interval\n"
+     "ago.  Value is t if maintenance ran.\n"
+     "\n(fn DB &optional FORCE)"},
+    {"sqlite-warmup", 1, emacs_variadic_function, Fsqlite_warmup,
+     "Warm up DB ahead of its first queries.\n"
+     "STATEMENTS is a list of SQL statements to prepare into the statement\n"
+     "cache, and TABLES a list of tables whose pages, and those of their\n"
+     "indexes, are read into the page cache.  If DB is memory-mapped, the\n"
+     "kernel is asked to read the file ahead instead.\n"
+     "\n"
+     "If IDLE is non-nil, this is done once Emacs has been idle for IDLE\n"
+     "seconds, and the value is nil.  Such a warmup replaces one of DB\n"
+     "still waiting, and is cancelled if DB is closed first.  Otherwise,\n"
+     "value is the number of pages read.\n"
+     "\n(fn DB &key STATEMENTS TABLES IDLE)"},
+    {"sqlite-kv-open", 2, emacs_variadic_function, Fsqlite_kv_open,
+     "Return a key-value store kept in TABLE of DB.\n"
+     "TABLE is created with the columns key and value if needed.  Keys and\n"
+     "values that `sqlite-execute' cannot bind, such as lists, are stored\n"
+     "in their `sqlite-encode-value' encoding and decoded again.  The\n"
+     "store keeps its statements prepared and caches recently used keys,\n"
+     "so TABLE should only be changed through the store.  Inside a\n"
+     "transaction, unbuffered writes become part of it and are cached\n"
+     "only once it is committed.\n"
+     "\n"
+     "Keyword arguments:\n"
+     ":cache-size N            Cache up to N keys (default 1024).\n"
+     ":flush-interval SECONDS  Buffer writes and write them in one\n"
+     "                         transaction SECONDS after the first one,\n"
+     "                         or on `sqlite-kv-flush' or closing DB.\n"
+     "                         If they cannot be written, `sqlite-close'\n"
+     "                         signals an error and leaves DB open.\n"
+     "\n(fn DB TABLE &key CACHE-SIZE FLUSH-INTERVAL)"},
+    {"sqlite-kv-get", 2, 3, Fsqlite_kv_get,
+     "Return the value of KEY in the key-value store KV, or DEFAULT.\n"
+     "\n(fn KV KEY &optional DEFAULT)"},
+    {"sqlite-kv-put", 3, 3, Fsqlite_kv_put,
+     "Set the value of KEY in the key-value store KV to VALUE."},
+    {"sqlite-kv-delete", 2, 2, Fsqlite_kv_delete,
+     "Remove KEY from the key-value store KV."},
+    {"sqlite-kv-map", 2, 2, Fsqlite_kv_map,
+     "Call FUNCTION with each key and value of the key-value store KV.\n"
+     "FUNCTION should not change KV."},
+    {"sqlite-kv-flush", 1, 1, Fsqlite_kv_flush,
+     "Write the buffered writes of the key-value store KV.\n"
+     "Value is the number of keys written."},
+    {"sqlite-encode-value", 1, 1, Fsqlite_encode_value,
+     "Return the binary encoding of VALUE as a unibyte string.\n"
+     "Lists, vectors, hash tables, symbols, numbers and strings, with\n"
+     "their text properties, are encoded directly; other readable values\n"
+     "through their printed representation.  The string has a\n"
+     "`coding-system' property of `binary', so that `sqlite-execute' and\n"
+     "`sqlite-select' bind it as a BLOB, and the `lisp' decode hint of\n"
+     "`sqlite-select' decodes it."},
+    {"sqlite-decode-value", 1, 1, Fsqlite_decode_value,
+     "Return the value encoded in STRING by `sqlite-encode-value'."},
+    {"sqlite-job-done-p", 1, 1, Fsqlite_job_done_p,
+     "Return t if the asynchronous JOB is done."},
+    {"sqlite-job-wait", 1, 1, Fsqlite_job_wait,
+     "Wait for the asynchronous JOB to be done and return its result.\n"
+     "Signal an error if the job failed."},
+    {"sqlite-submit", 2, emacs_variadic_function, Fsqlite_submit,
+     "Run QUERY on DB asynchronously and return a job object.\n"
+     "VALUES are bound as in `sqlite-execute'.  `sqlite-job-wait' returns\n"
+     "the rows of QUERY, or the number of affected rows for statements\n"
+     "that return none.\n"
+     "\n"
+     "Jobs run on worker threads through connections of their own, in\n"
+     "two lanes: queued interactive jobs never wait for background ones,\n"
+     "and a running background statement pauses while interactive jobs\n"
+     "run.  Jobs on an in-memory database run right away.\n"
+     "\n"
+     "Keyword arguments:\n"
+     ":priority LANE  interactive (the default) or background.\n"
+     ":callback FN    Call FN with the job object once it is done.\n"
+     ":token TOKEN    Make the job cancellable with TOKEN.\n"
+     "\n(fn DB QUERY &optional VALUES &key PRIORITY CALLBACK TOKEN)"},
+    {"sqlite-cancel", 2, 2, Fsqlite_cancel,
+     "Cancel the jobs submitted to DB with `sqlite-submit' matching TOKEN.\n"
+     "TOKEN is either a job object or compared with `equal' to the :token\n"
+     "of the jobs.  Cancelled jobs fail with the error \"Cancelled\".\n"
+     "Value is the number of queued or running jobs that were cancelled."},
     {"sqlitep", 1, 1, Fsqlitep,
      "Say whether OBJECT is an SQlite object."},
     {"sqlite-available-p", 0, 0, Fsqlite_available_p,
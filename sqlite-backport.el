@@ -41,6 +41,13 @@
       (setq dirname (file-name-directory (directory-file-name dirname))))
     (file-name-as-directory (file-name-concat dirname "include"))))
 
+(defvar sqlite-backport-compile-flags ""
+  "Extra arguments for the compiler when building the module.
+For example, to link the spellfix extension into the module and
+register it for every connection:
+
+  \"-DSQLITE_BACKPORT_EXTENSIONS='X(sqlite3_spellfix_init)' -DSQLITE_CORE spellfix.c\"")
+
 (defun sqlite-backport--bootstrap ()
   (let* ((lispdir (file-name-directory (locate-library "sqlite-backport")))
          (libname (file-name-concat lispdir "sqlite-backport-module.so")))
@@ -51,9 +58,10 @@
              0
              (shell-command
               (concat
-               "LANG=C.utf8 cc -Wall -Wextra -Werror -shared -fPIC -o sqlite-backport-module.so sqlite-backport-module.c -I "
+               "LANG=C.utf8 cc -Wall -Wextra -Werror -shared -fPIC -pthread -o sqlite-backport-module.so sqlite-backport-module.c -I "
                (shell-quote-argument (sqlite-backport--include-dir))
-               " `pkg-config --cflags --libs sqlite3`")
+               " " sqlite-backport-compile-flags
+               " `pkg-config --cflags --libs sqlite3 zlib` -lm")
               "*compile-sqlite-backport-module*"))
             (load "sqlite-backport-module")
           (pop-to-buffer "*compile-sqlite-backport-module*"))))))
@@ -65,7 +73,13 @@
 ;;;###autoload (autoload 'sqlite-open "sqlite-backport")
 ;;;###autoload (autoload 'sqlite-close "sqlite-backport")
 ;;;###autoload (autoload 'sqlite-execute "sqlite-backport")
+;;;###autoload (autoload 'sqlite-execute-returning "sqlite-backport")
+;;;###autoload (autoload 'sqlite-execute-batch "sqlite-backport")
+;;;###autoload (autoload 'sqlite-upsert "sqlite-backport")
 ;;;###autoload (autoload 'sqlite-select "sqlite-backport")
+;;;###autoload (autoload 'sqlite-select-map "sqlite-backport")
+;;;###autoload (autoload 'sqlite-select-value "sqlite-backport")
+;;;###autoload (autoload 'sqlite-exists-p "sqlite-backport")
 ;;;###autoload (autoload 'sqlite-transaction "sqlite-backport")
 ;;;###autoload (autoload 'sqlite-commit "sqlite-backport")
 ;;;###autoload (autoload 'sqlite-rollback "sqlite-backport")
@@ -74,6 +88,40 @@
 ;;;###autoload (autoload 'sqlite-columns "sqlite-backport")
 ;;;###autoload (autoload 'sqlite-more-p "sqlite-backport")
 ;;;###autoload (autoload 'sqlite-finalize "sqlite-backport")
+;;;###autoload (autoload 'sqlite-create-function "sqlite-backport")
+;;;###autoload (autoload 'sqlite-fts-index-files "sqlite-backport")
+;;;###autoload (autoload 'sqlite-fts-index-buffer "sqlite-backport")
+;;;###autoload (autoload 'sqlite-fts-offsets "sqlite-backport")
+;;;###autoload (autoload 'sqlite-index-directory "sqlite-backport")
+;;;###autoload (autoload 'sqlite-open-shards "sqlite-backport")
+;;;###autoload (autoload 'sqlite-shards-p "sqlite-backport")
+;;;###autoload (autoload 'sqlite-shards-select "sqlite-backport")
+;;;###autoload (autoload 'sqlite-session-start "sqlite-backport")
+;;;###autoload (autoload 'sqlite-session-changeset "sqlite-backport")
+;;;###autoload (autoload 'sqlite-changeset-apply "sqlite-backport")
+;;;###autoload (autoload 'sqlite-select-diff "sqlite-backport")
+;;;###autoload (autoload 'sqlite-cursor "sqlite-backport")
+;;;###autoload (autoload 'sqlite-cursor-next-page "sqlite-backport")
+;;;###autoload (autoload 'sqlite-cursor-prev-page "sqlite-backport")
+;;;###autoload (autoload 'sqlite-load-extension "sqlite-backport")
+;;;###autoload (autoload 'sqlite-explain-analyze "sqlite-backport")
+;;;###autoload (autoload 'sqlite-suggest-indexes "sqlite-backport")
+;;;###autoload (autoload 'sqlite-maintenance "sqlite-backport")
+;;;###autoload (autoload 'sqlite-maintenance-run "sqlite-backport")
+;;;###autoload (autoload 'sqlite-ensure-open "sqlite-backport")
+;;;###autoload (autoload 'sqlite-warmup "sqlite-backport")
+;;;###autoload (autoload 'sqlite-kv-open "sqlite-backport")
+;;;###autoload (autoload 'sqlite-kv-get "sqlite-backport")
+;;;###autoload (autoload 'sqlite-kv-put "sqlite-backport")
+;;;###autoload (autoload 'sqlite-kv-delete "sqlite-backport")
+;;;###autoload (autoload 'sqlite-kv-map "sqlite-backport")
+;;;###autoload (autoload 'sqlite-kv-flush "sqlite-backport")
+;;;###autoload (autoload 'sqlite-encode-value "sqlite-backport")
+;;;###autoload (autoload 'sqlite-decode-value "sqlite-backport")
+;;;###autoload (autoload 'sqlite-job-done-p "sqlite-backport")
+;;;###autoload (autoload 'sqlite-job-wait "sqlite-backport")
+;;;###autoload (autoload 'sqlite-submit "sqlite-backport")
+;;;###autoload (autoload 'sqlite-cancel "sqlite-backport")
 ;;;###autoload (autoload 'sqlitep "sqlite-backport")
 ;;;###autoload (autoload 'sqlite-available-p "sqlite-backport")
 
@@ -207,5 +207,876 @@
           (should (multibyte-string-p c1))
           (should-not (multibyte-string-p c2)))))))
 
+(ert-deftest sqlite-native-functions ()
+  (skip-unless (sqlite-available-p))
+  (let ((db (sqlite-open)))
+    (sqlite-execute db "create table if not exists test11 (col1 text)")
+    (dolist (string '("Hello World" "foo bar" "x(y)|z" "ÄÖÜ"))
+      (sqlite-execute db "insert into test11 values (?)" (list string)))
+    (should
+     (equal
+      (sqlite-select db "select col1 from test11 where col1 regexp ?"
+                     '("^\\(Hello\\|foo\\) "))
+      '(("Hello World") ("foo bar"))))
+    (should
+     (equal
+      (sqlite-select db "select col1 from test11 where col1 regexp ?"
+                     '("(y)|"))
+      '(("x(y)|z"))))
+    (should
+     (equal
+      (sqlite-select db "select 'a' regexp ?1, 'a?' regexp ?1, 'a??' regexp ?1"
+                     '("^a\\??$"))
+      '((1 1 0))))
+    (should-error
+     (sqlite-select db "select col1 from test11 where col1 regexp ?"
+                    '("\\cg")))
+    (should
+     (equal
+      (sqlite-select db "select casefold(col1) from test11 where rowid = 4")
+      '(("äöü"))))
+    (should
+     (equal
+      (sqlite-select db "select fnv1a('a'), crc32('123456789')")
+      '((-5808556873153909620 3421780262))))))
+
+(ert-deftest sqlite-create-function ()
+  (skip-unless (sqlite-available-p))
+  (let ((db (sqlite-open)))
+    (sqlite-execute db "create table if not exists test12 (col1 integer)")
+    (dotimes (i 4)
+      (sqlite-execute db "insert into test12 values (?)" (list i)))
+    (sqlite-create-function db "twice" 1 (lambda (x) (* x 2)) t)
+    (should
+     (equal
+      (sqlite-select db "select twice(col1) from test12")
+      '((0) (2) (4) (6))))
+    (sqlite-execute db "create index test12_twice on test12 (twice(col1))")
+    (should
+     (equal
+      (sqlite-select db "select col1 from test12 where twice(col1) = 4")
+      '((2))))
+    (sqlite-create-function db "total" 1
+                            (cons (lambda (state x) (+ (or state 0) x))
+                                  #'identity))
+    (should
+     (equal (sqlite-select db "select total(col1) from test12") '((6))))
+    (sqlite-create-function db "fail" 1 (lambda (_) (error "Failed")))
+    (should-error (sqlite-select db "select fail(col1) from test12"))
+    (sqlite-create-function db "fail" 1 nil)
+    (should-error (sqlite-select db "select fail(1)"))))
+
+(ert-deftest sqlite-buffer-table ()
+  (skip-unless (sqlite-available-p))
+  (let ((db (sqlite-open))
+        (buffer (generate-new-buffer "sqlite-buffer-table")))
+    (unwind-protect
+        (progn
+          (with-current-buffer buffer
+            (insert "alpha 1\nbéta 2\ngamma 3\n"))
+          (sqlite-execute
+           db (format "create virtual table test13 using emacs_buffer('%s')"
+                      (buffer-name buffer)))
+          (should
+           (equal (sqlite-select db "select line, text, pos from test13")
+                  '((1 "alpha 1" 1) (2 "béta 2" 9) (3 "gamma 3" 16))))
+          (should
+           (equal (sqlite-select db "select text from test13 where line > 1")
+                  '(("béta 2") ("gamma 3"))))
+          ;; Only integers are equal to a line number.
+          (should-not (sqlite-select db "select line from test13 where line = 1.5"))
+          (should-not (sqlite-select db "select line from test13 where line = '2abc'"))
+          (should (equal (sqlite-select db "select line from test13 where line >= 1.5")
+                         '((2) (3))))
+          (sqlite-execute db "create table test14 (col1 integer)")
+          (sqlite-execute db "insert into test14 values (3), (1)")
+          (should
+           (equal
+            (sqlite-select
+             db "select col1, text from test14 join test13 on line = col1")
+            '((3 "gamma 3") (1 "alpha 1"))))
+          (with-current-buffer buffer
+            (erase-buffer)
+            (insert "x\ny"))
+          (should
+           (equal (sqlite-select db "select text from test13")
+                  '(("x") ("y")))))
+      (kill-buffer buffer))
+    (should-error (sqlite-select db "select text from test13"))))
+
+(ert-deftest sqlite-fts-index ()
+  (skip-unless (sqlite-available-p))
+  (let* ((dir (make-temp-file "sqlite-tests" t))
+         (db (sqlite-open (expand-file-name "fts.db" dir)))
+         files)
+    (unwind-protect
+        (progn
+          (dotimes (i 3)
+            (let ((file (expand-file-name (format "note%d.txt" i) dir)))
+              (with-temp-file file
+                (dotimes (j 20)
+                  (insert (format "note %d line %d\n" i j))))
+              (push file files)))
+          (sqlite-execute
+           db "create virtual table test15 using fts5(path unindexed, content)")
+          (should
+           (= (sqlite-fts-index-files db "test15" files :chunk-size 100) 3))
+          (should
+           (equal (sqlite-select db "select count(distinct path) from test15")
+                  '((3))))
+          (should (> (caar (sqlite-select db "select count(*) from test15")) 3))
+          ;; Reindexing replaces the rows of the files.
+          (let ((job (sqlite-fts-index-files db "test15" files
+                                             :chunk-size 0 :async t)))
+            (should (= (sqlite-job-wait job) 3))
+            (should (sqlite-job-done-p job)))
+          (should
+           (equal (sqlite-select db "select count(*) from test15") '((3))))
+          (should
+           (equal
+            (sqlite-select
+             db "select count(*) from test15 where test15 match 'line'")
+            '((3))))
+          (with-temp-buffer
+            (insert "buffer text")
+            (sqlite-fts-index-buffer db "test15" (current-buffer) :path "buf"))
+          (should
+           (equal
+            (sqlite-select
+             db "select path from test15 where test15 match 'buffer'")
+            '(("buf"))))
+          ;; Indexing inside a transaction becomes part of it.
+          (sqlite-transaction db)
+          (with-temp-buffer
+            (insert "rolled back")
+            (should (= (sqlite-fts-index-buffer db "test15" (current-buffer)
+                                                :path "tx")
+                       1)))
+          (sqlite-rollback db)
+          (should-not (sqlite-select db "select * from test15 where path = 'tx'"))
+          (should-error (sqlite-fts-index-files db "test15" files
+                                                :chunk-size "big")))
+      (sqlite-close db)
+      (delete-directory dir t))))
+
+(ert-deftest sqlite-fts-offsets ()
+  (skip-unless (sqlite-available-p))
+  (let ((db (sqlite-open)))
+    (sqlite-execute db "create virtual table test16 using fts5(title, body)")
+    (sqlite-execute db "insert into test16 values (?, ?)"
+                    '("Héllo world" "the world is big, hello again"))
+    (sqlite-execute db "insert into test16 values (?, ?)"
+                    '("nothing" "no match here"))
+    (sqlite-execute db "insert into test16 values (?, ?)"
+                    '("big" "big big world"))
+    (should
+     (equal (sqlite-fts-offsets db "test16" "world")
+            '((1 . [0 6 5 1 4 5]) (3 . [1 8 5]))))
+    (should
+     (equal (sqlite-fts-offsets db "test16" "\"big world\"")
+            '((3 . [1 4 9]))))
+    (should
+     (equal (length (sqlite-fts-offsets db "test16" "big" :limit 1)) 1))
+    (should-error (sqlite-fts-offsets db "test16" "AND"))))
+
+(ert-deftest sqlite-index-directory ()
+  (skip-unless (sqlite-available-p))
+  (let* ((dir (make-temp-file "sqlite-tests" t))
+         (tree (expand-file-name "tree" dir))
+         (db (sqlite-open (expand-file-name "files.db" dir))))
+    (unwind-protect
+        (progn
+          (make-directory (expand-file-name "a/.git" tree) t)
+          (dotimes (i 10)
+            (write-region (make-string i ?x) nil
+                          (expand-file-name (format "a/f%d.org" i) tree)))
+          (write-region "x" nil (expand-file-name "a/.git/obj.org" tree))
+          (write-region "x" nil (expand-file-name "a/readme.txt" tree))
+          (let ((job (sqlite-index-directory db tree "test17"
+                                             :match "\\.org\\'"
+                                             :exclude "\\`\\.git\\'")))
+            (should (= (sqlite-job-wait job) 10)))
+          (should
+           (equal (sqlite-select db "select count(*), sum(size) from test17")
+                  '((10 45))))
+          ;; Unchanged files are skipped, deleted ones are removed.
+          (delete-file (expand-file-name "a/f3.org" tree))
+          (should
+           (= (sqlite-job-wait
+               (sqlite-index-directory db tree "test17"
+                                       :match "\\.org\\'"
+                                       :exclude "\\`\\.git\\'"))
+              1))
+          (should
+           (equal (sqlite-select db "select count(*) from test17") '((9))))
+          ;; A missing DIR is an error, not an empty one.
+          (should-error
+           (sqlite-job-wait
+            (sqlite-index-directory db (expand-file-name "none" dir) "test17")))
+          (should
+           (equal (sqlite-select db "select count(*) from test17") '((9))))
+          (should-error (sqlite-index-directory db tree "test17"
+                                                :match "\\(")))
+      (sqlite-close db)
+      (delete-directory dir t))))
+
+(ert-deftest sqlite-index-directory-unreadable ()
+  (skip-unless (sqlite-available-p))
+  ;; The superuser can read any directory.
+  (skip-unless (/= (user-uid) 0))
+  (let* ((dir (make-temp-file "sqlite-tests" t))
+         (locked (expand-file-name "tree/locked" dir))
+         (db (sqlite-open)))
+    (unwind-protect
+        (progn
+          (make-directory locked t)
+          (write-region "x" nil (expand-file-name "f.org" locked))
+          (write-region "x" nil (expand-file-name "tree/g.org" dir))
+          (should (= (sqlite-job-wait
+                      (sqlite-index-directory
+                       db (expand-file-name "tree" dir) "test38"))
+                     2))
+          (set-file-modes locked 0)
+          (write-region "x" nil (expand-file-name "tree/h.org" dir))
+          ;; The rows of the locked directory are kept, the others
+          ;; are updated, and the job fails.
+          (should-error (sqlite-job-wait
+                         (sqlite-index-directory
+                          db (expand-file-name "tree" dir) "test38")))
+          (should (equal (sqlite-select db "select count(*) from test38")
+                         '((3)))))
+      (set-file-modes locked #o755)
+      (sqlite-close db)
+      (delete-directory dir t))))
+
+;; Shards.
+(ert-deftest sqlite-shards ()
+  (skip-unless (sqlite-available-p))
+  (let* ((dir (make-temp-file "sqlite-tests" t))
+         (files (mapcar (lambda (i)
+                          (expand-file-name (format "shard%d.db" i) dir))
+                        '(0 1 2)))
+         shards)
+    (unwind-protect
+        (progn
+          (let ((i 0))
+            (dolist (file files)
+              (let ((db (sqlite-open file)))
+                (sqlite-execute db "create table test18 (id, name)")
+                (dotimes (j 4)
+                  (sqlite-execute db "insert into test18 values (?, ?)"
+                                  (list (+ i (* j 3)) (format "n%d" j))))
+                (sqlite-close db))
+              (setq i (1+ i))))
+          (setq shards (sqlite-open-shards files))
+          (should (sqlite-shards-p shards))
+          (should-not (sqlitep shards))
+          (should-not (sqlite-shards-p (sqlite-open)))
+          (should
+           (equal (sqlite-shards-select
+                   shards "select id from test18 where id > ?" '(7))
+                  '((9) (10) (8) (11))))
+          (should
+           (equal (sqlite-shards-select
+                   shards "select id from test18 order by id desc" nil
+                   :order-by "id" :descending t :limit 3)
+                  '((11) (10) (9))))
+          (should
+           (equal (sqlite-shards-select
+                   shards "select id from test18 order by id" nil
+                   :order-by 0)
+                  (mapcar #'list (number-sequence 0 11))))
+          (should-error (sqlite-shards-select shards "select nosuch from test18")))
+      (when shards
+        (sqlite-close shards))
+      (delete-directory dir t))))
+
+;; Sessions.
+(ert-deftest sqlite-session ()
+  (skip-unless (sqlite-available-p))
+  (let ((db1 (sqlite-open))
+        (db2 (sqlite-open)))
+    (dolist (db (list db1 db2))
+      (sqlite-execute db "create table test19 (id integer primary key, v)")
+      (sqlite-execute db "insert into test19 values (1, 'a')"))
+    (should (sqlite-session-start db1 '("test19")))
+    (sqlite-execute db1 "insert into test19 values (2, 'b')")
+    (sqlite-execute db1 "update test19 set v = 'c' where id = 1")
+    (let ((changeset (sqlite-session-changeset db1 t)))
+      (should-not (multibyte-string-p changeset))
+      (should (sqlite-changeset-apply db2 changeset))
+      (should (equal (sqlite-select db2 "select * from test19")
+                     '((1 "c") (2 "b")))))
+    (should-error (sqlite-session-changeset db1))
+    (sqlite-session-start db1)
+    (sqlite-execute db1 "update test19 set v = 'd' where id = 2")
+    (sqlite-execute db2 "update test19 set v = 'e' where id = 2")
+    (let ((changeset (sqlite-session-changeset db1))
+          conflicts)
+      (should-error (sqlite-changeset-apply
+                     db2 changeset
+                     :conflict-handler (lambda (&rest _) 'abort)))
+      (should (sqlite-changeset-apply
+               db2 changeset
+               :conflict-handler (lambda (kind table op row)
+                                   (push (list kind table op row) conflicts)
+                                   'replace)))
+      (should (equal conflicts '((data "test19" update (2 "e")))))
+      (should (equal (sqlite-select db2 "select v from test19 where id = 2")
+                     '(("d")))))
+    (sqlite-close db1)
+    (sqlite-close db2)))
+
+(ert-deftest sqlite-select-diff ()
+  (skip-unless (sqlite-available-p))
+  (let ((db (sqlite-open))
+        (query "select v, id from test20 where id < ? order by id"))
+    (sqlite-execute db "create table test20 (id integer primary key, v)")
+    (dotimes (i 4)
+      (sqlite-execute db "insert into test20 values (?, ?)"
+                      (list i (format "v%d" i))))
+    (pcase-let ((`(,token ,inserted ,updated ,deleted)
+                 (sqlite-select-diff db query '(10) nil :key "id")))
+      (should (equal inserted '(("v0" 0) ("v1" 1) ("v2" 2) ("v3" 3))))
+      (should-not updated)
+      (should-not deleted)
+      (sqlite-execute db "update test20 set v = 'x' where id = 1")
+      (sqlite-execute db "delete from test20 where id = 3")
+      (sqlite-execute db "insert into test20 values (5, 'y')")
+      (pcase-let ((`(,token2 ,inserted ,updated ,deleted)
+                   (sqlite-select-diff db query '(10) token :key 1)))
+        (should (equal inserted '(("y" 5))))
+        (should (equal updated '(("x" 1))))
+        (should (equal deleted '(3)))
+        (should (equal (cdr (sqlite-select-diff db query '(10) token2 :key 1))
+                       '(nil nil nil)))
+        ;; A change of storage class is an update.
+        (sqlite-execute db "update test20 set v = 1 where id = 0")
+        (let ((token3 (car (sqlite-select-diff db query '(10) token2 :key 1))))
+          (sqlite-execute db "update test20 set v = 1.0 where id = 0")
+          (should (equal (cdr (sqlite-select-diff db query '(10) token3 :key 1))
+                         '(nil ((1.0 0)) nil))))))
+    (should-error (sqlite-select-diff
+                   db "select 1 union all select 1" nil nil))
+    ;; Floats out of the integer range are valid keys.
+    (should (= (length (nth 1 (sqlite-select-diff
+                               db "select 1e300 union all select -1e300
+                                   union all select 9.3e18" nil nil)))
+               3))
+    (should-error (sqlite-select-diff
+                   db "select 1e300 union all select 1e300" nil nil))
+    (sqlite-close db)))
+
+(ert-deftest sqlite-cursor ()
+  (skip-unless (sqlite-available-p))
+  (let ((db (sqlite-open)))
+    (sqlite-execute db "create table test21 (id integer primary key, v)")
+    (dotimes (i 12)
+      (sqlite-execute db "insert into test21 values (?, ?)"
+                      (list (1+ i) (format "v%d" (1+ i)))))
+    (let ((cursor (sqlite-cursor db "select id from test21 where id > ?"
+                                 '(0) "id" :page-size 5)))
+      (should (equal (sqlite-cursor-next-page cursor) '((1) (2) (3) (4) (5))))
+      (should (equal (sqlite-cursor-next-page cursor) '((6) (7) (8) (9) (10))))
+      (should (equal (sqlite-cursor-next-page cursor) '((11) (12))))
+      (should-not (sqlite-cursor-next-page cursor))
+      (should (equal (sqlite-cursor-prev-page cursor) '((6) (7) (8) (9) (10))))
+      (should (equal (sqlite-cursor-prev-page cursor) '((1) (2) (3) (4) (5))))
+      (should-not (sqlite-cursor-prev-page cursor)))
+    (let ((cursor (sqlite-cursor db "select id from test21" nil '("id")
+                                 :page-size 2 :descending t)))
+      (should (equal (sqlite-cursor-next-page cursor) '((12) (11))))
+      (should (equal (sqlite-cursor-next-page cursor) '((10) (9)))))
+    (should-error (sqlite-cursor db "select id from test21" nil "nosuch"))
+    (should-error (sqlite-cursor db "select id from test21" nil "id" :page-size 0))
+    (should-error (sqlite-cursor db "select id from test21" nil "id" :page-size -1))
+    (sqlite-close db)))
+
+(ert-deftest sqlite-load-extension ()
+  (skip-unless (sqlite-available-p))
+  (let ((db (sqlite-open)))
+    (should-error (sqlite-load-extension db "/usr/lib/libnotallowed.so"))
+    (should-not (sqlite-load-extension
+                 db (expand-file-name "libsqlite3_mod_rot13.so"
+                                      temporary-file-directory)))
+    (should-error (sqlite-select
+                   db "select load_extension('/usr/lib/libnotallowed.so')"))
+    (sqlite-close db)))
+
+(ert-deftest sqlite-vector-functions ()
+  (skip-unless (sqlite-available-p))
+  (let ((db (sqlite-open)))
+    (should
+     (equal (sqlite-select
+             db "select vec_dot(vec_f32('[1, 2, 3]'), vec_f32('[4, 5, 6]')),
+                        vec_cosine(vec_f32('[1, 0]'), vec_f32('[0, 1]')),
+                        vec_l2(vec_f32('[0, 0]'), vec_f32('[3, 4]'))")
+            '((32.0 0.0 5.0))))
+    (should-error (sqlite-select
+                   db "select vec_dot(vec_f32('[1]'), vec_f32('[1, 2]'))"))
+    (sqlite-execute db "create table test22 (id integer primary key, emb blob)")
+    (dotimes (i 20)
+      (sqlite-execute db "insert into test22 values (?, vec_f32(?))"
+                      (list (1+ i) (format "[%d, %d, 1]" i (- 20 i)))))
+    (should
+     (equal (sqlite-select
+             db "select id from vec_top_k('test22', 'emb', vec_f32(?), 3, 'l2')"
+             '("[5, 15.2, 1]"))
+            '((6) (5) (7))))
+    (should
+     (equal (sqlite-select
+             db "select id from vec_top_k('test22', 'emb', vec_f32(?), 2, 'dot')"
+             '("[1, 0, 0]"))
+            '((20) (19))))
+    ;; K larger than the table returns all rows.
+    (should
+     (equal (sqlite-select
+             db "select count(*) from vec_top_k('test22', 'emb', vec_f32(?), 268435457)"
+             '("[1, 0, 0]"))
+            '((20))))
+    (sqlite-close db)))
+
+(ert-deftest sqlite-compress ()
+  (skip-unless (sqlite-available-p))
+  (let ((db (sqlite-open))
+        (text (apply #'concat (make-list 200 "héllo wörld "))))
+    (sqlite-execute db "create table test23 (id integer primary key, body blob)")
+    (sqlite-execute db "insert into test23 values (1, compress(?))" (list text))
+    (sqlite-execute db "insert into test23 values (2, compress(x'0001', 9))")
+    (sqlite-execute db "insert into test23 values (3, 'plain')")
+    (should (< (caar (sqlite-select db "select length(body) from test23"))
+               (length text)))
+    (should (equal (sqlite-select
+                    db "select decompress(body) from test23 where id = 1")
+                   (list (list text))))
+    (should (equal (sqlite-select db "select body from test23 order by id"
+                                  nil :decode '(decompress))
+                   `((,text) (,(string-to-unibyte "\0\1")) ("plain"))))
+    (let ((set (sqlite-select db "select id, body from test23" nil 'set
+                              :decode [nil decompress])))
+      (should (equal (sqlite-next set) (list 1 text)))
+      (sqlite-finalize set))
+    (should-error (sqlite-select db "select body from test23" nil nil
+                                 :decode '(foo)))
+    ;; Values that do not decompress are returned unchanged.
+    (dolist (blob '("0100000099" "8953515A01FFFFFFFF99" "8953515A0105000000789C"))
+      (should (equal (sqlite-select db (format "select hex(decompress(x'%s'))" blob))
+                     (list (list blob)))))
+    (sqlite-close db)))
+
+(ert-deftest sqlite-explain-analyze ()
+  (skip-unless (sqlite-available-p))
+  (let ((db (sqlite-open)))
+    (sqlite-execute db "create table test24 (id integer primary key, x)")
+    (dotimes (i 100)
+      (sqlite-execute db "insert into test24 values (?, ?)" (list i (% i 10))))
+    (let ((result (sqlite-explain-analyze
+                   db "select * from test24 where x = ? order by x" '(3))))
+      (should (= (plist-get result :rows) 10))
+      (should (> (plist-get result :fullscan-steps) 0))
+      (should (equal (mapcar (lambda (node) (plist-get node :detail))
+                             (plist-get result :plan))
+                     '("SCAN test24"))))
+    (should-error (sqlite-explain-analyze db "select nosuch"))
+    (sqlite-close db)))
+
+(ert-deftest sqlite-suggest-indexes ()
+  (skip-unless (sqlite-available-p))
+  (let ((db (sqlite-open)))
+    (sqlite-execute db "create table test25 (id integer primary key, folder, created)")
+    (let ((result (sqlite-suggest-indexes
+                   db '("select * from test25 where folder = ? and created > ?"))))
+      (should (equal (plist-get result :indexes)
+                     '("CREATE INDEX \"test25_idx_folder_created\" ON \"test25\"(\"folder\", \"created\")")))
+      (should (equal (cadr (car (plist-get result :statements)))
+                     '("SCAN test25"))))
+    ;; The statement cache is used by default.
+    (sqlite-select db "select * from test25 where created = ?" '(1))
+    (should (equal (plist-get (sqlite-suggest-indexes db) :indexes)
+                   '("CREATE INDEX \"test25_idx_created\" ON \"test25\"(\"created\")")))
+    ;; DB itself is not changed.
+    (should (equal (sqlite-select db "select count(*) from sqlite_schema")
+                   '((1))))
+    (sqlite-close db)))
+
+;; `sqlite-maintenance-run' requires a file-backed database for
+;; incremental vacuum to have any effect.
+(ert-deftest sqlite-maintenance ()
+  (skip-unless (sqlite-available-p))
+  (let* ((file (make-temp-file "sqlite-maintenance"))
+         (db (sqlite-open file)))
+    (unwind-protect
+        (progn
+          (sqlite-execute db "pragma auto_vacuum = incremental")
+          (sqlite-execute db "create table test26 (id integer primary key, body)")
+          (dotimes (i 500)
+            (sqlite-execute db "insert into test26 (body) values (?)"
+                            (list (make-string 200 ?x))))
+          (sqlite-execute db "delete from test26")
+          (let ((free (caar (sqlite-select db "pragma freelist_count"))))
+            (should (> free 5))
+            ;; Disabled by default.
+            (should-not (sqlite-maintenance-run db))
+            (should (sqlite-maintenance db t :vacuum-pages 5 :min-interval 0))
+            (should (sqlite-maintenance-run db))
+            (should (= (caar (sqlite-select db "pragma freelist_count"))
+                       (- free 5)))
+            ;; The analysis limit of the connection is kept.
+            (should (equal (sqlite-select db "pragma analysis_limit") '((0))))
+            ;; Never inside a transaction.
+            (sqlite-execute db "begin")
+            (should-not (sqlite-maintenance-run db t))
+            (sqlite-execute db "commit")
+            (should-not (sqlite-maintenance db nil))
+            (should-not (sqlite-maintenance-run db))
+            (should (sqlite-maintenance-run db t))))
+      (sqlite-close db)
+      (delete-file file))))
+
+;; Handles opened with :shared on the same file use one connection.
+(ert-deftest sqlite-open-shared ()
+  (skip-unless (sqlite-available-p))
+  (let* ((file (make-temp-file "sqlite-shared"))
+         (link (concat file "-link"))
+         (db1 (sqlite-open file :shared t))
+         db2 db3)
+    (unwind-protect
+        (progn
+          (make-symbolic-link file link)
+          (setq db2 (sqlite-open link :shared t)
+                db3 (sqlite-open file))
+          (sqlite-execute db1 "create table test27 (id)")
+          (sqlite-execute db1 "begin")
+          (sqlite-execute db1 "insert into test27 values (1)")
+          ;; The transaction is shared, but not with unshared handles.
+          (should (equal (sqlite-select db2 "select * from test27") '((1))))
+          (should-not (sqlite-select db3 "select * from test27"))
+          (sqlite-execute db2 "commit")
+          (should-error (sqlite-maintenance db1 t))
+          (should-error (sqlite-session-start db1))
+          ;; Closing one handle leaves the connection open for the others.
+          (should (sqlite-close db1))
+          (should-error (sqlite-select db1 "select 1"))
+          (should (equal (sqlite-select db2 "select * from test27") '((1)))))
+      (mapc #'sqlite-close (delq nil (list db2 db3)))
+      (delete-file link)
+      (delete-file file))))
+
+(ert-deftest sqlite-open-lazy ()
+  (skip-unless (sqlite-available-p))
+  (let* ((dir (make-temp-file "sqlite-lazy" t))
+         (file (expand-file-name "test.db" dir))
+         (db (sqlite-open file :lazy t)))
+    (unwind-protect
+        (progn
+          (should (sqlitep db))
+          (should-not (file-exists-p file))
+          (sqlite-execute db "create table test28 (id)")
+          (should (file-exists-p file))
+          (should (sqlite-ensure-open db))
+          (sqlite-close db)
+          ;; Errors are signaled on first use.
+          (setq db (sqlite-open (expand-file-name "none/test.db" dir) :lazy t))
+          (should-error (sqlite-select db "select 1"))
+          ;; Closing an unused database does not open it.
+          (setq db (sqlite-open (expand-file-name "none/test.db" dir) :lazy t))
+          (should (sqlite-close db))
+          ;; Closing or using it cancels the idle timer.
+          (dolist (use (list #'sqlite-close #'sqlite-ensure-open))
+            (let ((db (sqlite-open file :lazy 600)))
+              (should (cl-some (lambda (timer) (memq db (timer--args timer)))
+                               timer-idle-list))
+              (funcall use db)
+              (should-not (cl-some (lambda (timer) (memq db (timer--args timer)))
+                                   timer-idle-list))
+              (unless (eq use #'sqlite-close)
+                (sqlite-close db)))))
+      (delete-directory dir t))))
+
+(ert-deftest sqlite-warmup ()
+  (skip-unless (sqlite-available-p))
+  (let* ((file (make-temp-file "sqlite-warmup"))
+         (db (sqlite-open file)))
+    (unwind-protect
+        (progn
+          (sqlite-execute db "create table test29 (id, body)")
+          (sqlite-execute db "create index test29_id on test29 (id)")
+          (dotimes (i 1000)
+            (sqlite-execute db "insert into test29 values (?, ?)"
+                            (list i (make-string 100 ?x))))
+          (sqlite-close db)
+          (setq db (sqlite-open file))
+          (should (> (sqlite-warmup db :tables '("test29")
+                                    :statements '("select * from test29 where id = ?"))
+                     10))
+          ;; Everything is in the page cache now.
+          (should (= (sqlite-warmup db :tables '("test29")) 0))
+          (should-error (sqlite-warmup db :tables '("test30")))
+          (should-error (sqlite-warmup db :statements '("select nosuch")))
+          ;; Closing DB cancels a warmup waiting for idle time.
+          (let ((other (sqlite-open file)))
+            (should-not (sqlite-warmup other :tables '("test29") :idle 3600))
+            (should (cl-some (lambda (timer) (memq other (timer--args timer)))
+                             timer-idle-list))
+            (sqlite-close other)
+            (should-not (cl-some (lambda (timer) (memq other (timer--args timer)))
+                                 timer-idle-list))))
+      (sqlite-close db)
+      (delete-file file))))
+
+;; Interactive jobs do not wait for background ones.
+(ert-deftest sqlite-submit ()
+  (skip-unless (sqlite-available-p))
+  (let* ((file (make-temp-file "sqlite-submit"))
+         (db (sqlite-open file))
+         ;; This never ends unless cancelled.
+         (slow "with recursive c(x) as (select 1 union all select x + 1 from c)
+                select count(*) from c"))
+    (unwind-protect
+        (progn
+          (sqlite-execute db "create table test30 (id)")
+          (sqlite-execute db "insert into test30 values (1), (2)")
+          (let ((background (sqlite-submit db slow :priority 'background
+                                           :token 'indexer))
+                (queued (sqlite-submit db slow :priority 'background
+                                       :token 'indexer)))
+            (should (equal (sqlite-job-wait
+                            (sqlite-submit db "select id from test30 where id > ?" '(1)))
+                           '((2))))
+            (should-not (sqlite-job-done-p queued))
+            (should (= (sqlite-cancel db 'indexer) 2))
+            (should-error (sqlite-job-wait background))
+            (should-error (sqlite-job-wait queued)))
+          (should (= (sqlite-job-wait
+                      (sqlite-submit db "insert into test30 values (?)" '(3)))
+                     1))
+          (let ((job (sqlite-submit db "select count(*) from test30")))
+            (should (equal (sqlite-job-wait job) '((3))))
+            (should (= (sqlite-cancel db job) 0)))
+          (should-error (sqlite-submit db "select 1" :priority 'urgent))
+          ;; A background writer is not paused while it holds the lock
+          ;; an interactive writer waits for.
+          (let ((writer (sqlite-submit
+                         db "insert into test30 with recursive c(x) as
+                             (select 1 union all select x + 1 from c
+                              where x < 1000000) select x from c"
+                         nil :priority 'background)))
+            (should (= (sqlite-job-wait
+                        (sqlite-submit db "insert into test30 values (0)"))
+                       1))
+            (should (= (sqlite-job-wait writer) 1000000))))
+      (sqlite-close db)
+      (delete-file file))))
+
+(ert-deftest sqlite-select-map ()
+  (skip-unless (sqlite-available-p))
+  (let ((db (sqlite-open))
+        (query "with recursive c(x) as (select 1 union all select x + 1 from c
+                where x < 1000) select x, x * 2 from c")
+        (sum 0))
+    (should (= (sqlite-select-map (lambda (row) (setq sum (+ sum (cadr row))))
+                                  db query nil :yield-every 100)
+               1000))
+    (should (= sum 1001000))
+    ;; Timers run while the query yields.
+    (let ((fired nil)
+          (seen nil))
+      (run-with-timer 0 nil (lambda () (setq fired t)))
+      (sqlite-select-map (lambda (_) (when fired (setq seen t)))
+                         db query nil :yield-every 100)
+      (should seen))
+    (should (equal (sqlite-select db query nil nil :yield-every 10)
+                   (sqlite-select db query)))
+    (should (= (sqlite-select-map #'ignore db "select ?" '(1)) 1))
+    (should-error (sqlite-select-map (lambda (_) (error "Stop")) db query))
+    ;; FUNCTION cannot close the database under the query.
+    (should-error (sqlite-select-map (lambda (_) (sqlite-close db)) db query))
+    (should (equal (sqlite-select db "select 1") '((1))))
+    (sqlite-close db)))
+
+(ert-deftest sqlite-kv ()
+  (skip-unless (sqlite-available-p))
+  (let* ((db (sqlite-open))
+         (kv (sqlite-kv-open db "test31" :cache-size 4))
+         (buffered (sqlite-kv-open db "test32" :flush-interval 60))
+         pairs)
+    (should-not (sqlite-kv-get kv "a"))
+    (should (eq (sqlite-kv-get kv "a" 'none) 'none))
+    (should-error (sqlite-kv-open db "test31" :cache-size 0))
+    (should-error (sqlite-kv-open db "test31" :cache-size -1))
+    (sqlite-kv-put kv "a" 1)
+    (sqlite-kv-put kv 2 "two")
+    (should (equal (sqlite-kv-get kv "a") 1))
+    (should (equal (sqlite-kv-get kv 2) "two"))
+    ;; Evicted keys are read back from the table.
+    (dotimes (i 10)
+      (sqlite-kv-put kv (format "k%d" i) i))
+    (should (equal (sqlite-kv-get kv "a") 1))
+    (sqlite-kv-delete kv "a")
+    (should-not (sqlite-kv-get kv "a"))
+    (should (equal (sqlite-select db "select count(*) from test31") '((11))))
+    (sqlite-kv-map (lambda (key value) (push (cons key value) pairs)) kv)
+    (should (equal (assoc 2 pairs) '(2 . "two")))
+    (should-error (sqlite-kv-map (lambda (_key _value) (sqlite-close db)) kv))
+    ;; Encoded values are decoded again.
+    (sqlite-kv-put kv '(l) [1 (2)])
+    (should (equal (sqlite-kv-get kv '(l)) [1 (2)]))
+    ;; Buffered writes are visible at once, and written on flush.
+    (dotimes (i 100)
+      (sqlite-kv-put buffered i (* i i)))
+    (should (equal (sqlite-kv-get buffered 9) 81))
+    (should (equal (sqlite-select db "select count(*) from test32") '((0))))
+    (should (= (sqlite-kv-flush buffered) 100))
+    (should (equal (sqlite-select db "select value from test32 where key = 9")
+                   '((81))))
+    ;; Rolled back writes are not kept in the cache.
+    (sqlite-transaction db)
+    (sqlite-kv-put kv "t" 1)
+    (should (equal (sqlite-kv-get kv "t") 1))
+    (sqlite-rollback db)
+    (should-not (sqlite-kv-get kv "t"))
+    ;; Writes flushed in a rolled back transaction are written again.
+    (sqlite-kv-put buffered "t" 2)
+    (sqlite-transaction db)
+    (should (= (sqlite-kv-flush buffered) 1))
+    (sqlite-rollback db)
+    (should (= (sqlite-kv-flush buffered) 1))
+    (should (equal (sqlite-select db "select value from test32 where key = 't'")
+                   '((2))))
+    (sqlite-close db)
+    (should-error (sqlite-kv-get kv "a"))))
+
+(ert-deftest sqlite-kv-close ()
+  (skip-unless (sqlite-available-p))
+  (let* ((file (make-temp-file "sqlite-kv"))
+         (db (sqlite-open file))
+         (other (sqlite-open file))
+         (kv (sqlite-kv-open db "test37" :flush-interval 60)))
+    (unwind-protect
+        (progn
+          (sqlite-kv-put kv "a" 1)
+          ;; Writes that cannot be flushed keep the database open.
+          (sqlite-execute other "begin immediate")
+          (should-error (sqlite-close db))
+          (sqlite-execute other "commit")
+          (should (equal (sqlite-kv-get kv "a") 1))
+          (should (sqlite-close db))
+          (should (equal (sqlite-select other "select key, value from test37")
+                         '(("a" 1)))))
+      (sqlite-close other)
+      (delete-file file))))
+
+(ert-deftest sqlite-encode-value ()
+  (skip-unless (sqlite-available-p))
+  (let ((db (sqlite-open))
+        (table (make-hash-table :test #'equal))
+        (values (list '(1 -2 3.5 "str" [a nil t] (foo . bar))
+                      (propertize "héllo" 'face 'bold)
+                      (unibyte-string 0 255 128)
+                      (expt 2 80)
+                      'sym)))
+    (puthash "key" '(1 2) table)
+    (dolist (value values)
+      (should (equal-including-properties
+               (sqlite-decode-value (sqlite-encode-value value))
+               value)))
+    (let ((decoded (sqlite-decode-value (sqlite-encode-value table))))
+      (should (eq (hash-table-test decoded) 'equal))
+      (should (equal (gethash "key" decoded) '(1 2))))
+    (should-error (sqlite-decode-value "junk"))
+    (should-error (sqlite-encode-value (current-buffer)))
+    (sqlite-execute db "create table test33 (a, b)")
+    ;; Values are only encoded when asked to.
+    (should-error (sqlite-execute db "insert into test33 values (?, ?)"
+                                  '((1 "x") [2])))
+    (sqlite-execute db "insert into test33 values (?, ?)"
+                    (list (sqlite-encode-value '(1 "x"))
+                          (sqlite-encode-value [2])))
+    (should (equal (sqlite-select db "select typeof(a), typeof(b) from test33")
+                   '(("blob" "blob"))))
+    (should (equal (sqlite-select db "select * from test33" nil nil
+                                  :decode '(lisp lisp))
+                   '(((1 "x") [2]))))
+    ;; Other BLOBs are returned as they are.
+    (should (equal (sqlite-select db "select x'ec0599', x'ec'" nil nil
+                                  :decode '(lisp lisp))
+                   (list (list (unibyte-string #xec 5 #x99)
+                               (unibyte-string #xec)))))
+    (sqlite-close db)))
+
+(ert-deftest sqlite-upsert ()
+  (skip-unless (sqlite-available-p))
+  (let ((db (sqlite-open))
+        (record (make-hash-table :test #'equal)))
+    (sqlite-execute db "create table test34 (id integer primary key, name, n)")
+    (should (= (sqlite-upsert db "test34" '((:id 1 :name "a") (:id 2 :name "b" :n 5))
+                              :conflict-columns '(id))
+               2))
+    (puthash "id" 1 record)
+    (puthash "n" 9 record)
+    (should (= (sqlite-upsert db "test34" (vector record '(id 3 name "c"))
+                              :conflict-columns '("id"))
+               2))
+    (should (equal (sqlite-select db "select * from test34 order by id")
+                   '((1 "a" 9) (2 "b" 5) (3 "c" nil))))
+    ;; Records switch between sets of columns.
+    (should (= (sqlite-upsert db "test34" '((:id 1 :n 1) (:id 2 :n 2) (:id 3 :name "z")
+                                            (:n 3 :id 3))
+                              :conflict-columns '(id))
+               4))
+    (should (equal (sqlite-select db "select * from test34 order by id")
+                   '((1 "a" 1) (2 "b" 2) (3 "z" 3))))
+    ;; A failing record rolls back the others.
+    (should-error (sqlite-upsert db "test34" '((:id 4) (:nosuch 1))))
+    (should-error (sqlite-upsert db "test34" '((:id 5) (:id))))
+    (should (equal (sqlite-select db "select count(*) from test34") '((3))))
+    ;; Also inside a transaction of the user.
+    (sqlite-transaction db)
+    (sqlite-execute db "insert into test34 (id) values (6)")
+    (should-error (sqlite-upsert db "test34" '((:id 4) (:nosuch 1))))
+    (sqlite-commit db)
+    (should (equal (sqlite-select db "select id from test34 where id > 3") '((6))))
+    (sqlite-close db)))
+
+(ert-deftest sqlite-execute-returning ()
+  (skip-unless (sqlite-available-p))
+  (let ((db (sqlite-open)))
+    (sqlite-execute db "create table test35 (id integer primary key, name)")
+    (should (equal (sqlite-execute-returning
+                    db "insert into test35 (name) values (?), (?) returning id, name"
+                    '("a" "b"))
+                   '((1 "a") (2 "b"))))
+    (should (equal (sqlite-execute-returning db "update test35 set name = upper(name) returning name")
+                   '(("A") ("B"))))
+    (should (equal (sqlite-execute-batch db "insert into test35 (name) values (?)"
+                                         '(("c") ("d")))
+                   [3 4]))
+    ;; A failing execution rolls back the others.
+    (should-error (sqlite-execute-batch db "insert into test35 (id) values (?)"
+                                        [(10) (1)]))
+    (should (equal (sqlite-select db "select count(*) from test35") '((4))))
+    ;; Also inside a transaction of the user.
+    (sqlite-transaction db)
+    (sqlite-execute db "insert into test35 (name) values ('e')")
+    (should-error (sqlite-execute-batch db "insert into test35 (id) values (?)"
+                                        [(10) (1)]))
+    (sqlite-commit db)
+    (should (equal (sqlite-select db "select count(*) from test35") '((5))))
+    (sqlite-close db)))
+
+(ert-deftest sqlite-select-value ()
+  (skip-unless (sqlite-available-p))
+  (let ((db (sqlite-open)))
+    (sqlite-execute db "create table test36 (id integer primary key, name)")
+    (sqlite-execute db "insert into test36 (name) values ('a'), ('b')")
+    (should (= (sqlite-select-value db "select count(*) from test36") 2))
+    (should (equal (sqlite-select-value db "select name from test36 where id = ?" '(2))
+                   "b"))
+    (should-not (sqlite-select-value db "select name from test36 where id = ?" [9]))
+    (should (sqlite-exists-p db "select 1 from test36 where name = ?" '("a")))
+    (should-not (sqlite-exists-p db "select 1 from test36 where name = 'c'"))
+    (should-error (sqlite-select-value db "select nosuch"))
+    (sqlite-close db)))
+
 (ert t)
 ;;; sqlite-tests.el ends here